@@ -2,11 +2,18 @@
 
 #pragma once
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <netinet/in.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,81 +26,466 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EVENT,                              /**< Event-driven epoll loop */
+    PREFORK,                            /**< Pool of pre-forked workers */
+    THREADED,                           /**< Pool of worker threads */
+    URING,                              /**< Event-driven io_uring loop */
     UNKNOWN
 } ServerMode;
 
-/* Global Variables */
+/**
+ * Access log formats
+ */
+typedef enum {
+    ACCESS_LOG_COMMON,                  /**< Common log format */
+    ACCESS_LOG_COMBINED,                /**< Combined log format (adds Referer and User-Agent) */
+    ACCESS_LOG_JSON,                    /**< One JSON object per line */
+} AccessFormat;
+
+/* Global Variables
+ *
+ * These are defined in globals.c (so the benchmarks share the defaults of the
+ * server), and are only assigned during startup (parse_options and main),
+ * before any worker threads or processes exist, and are read-only afterward.
+ */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern int   Workers;                   /**< Number of pre-forked workers */
+extern int   Threads;                   /**< Number of worker threads */
+extern int   KeepAliveTimeout;          /**< Idle seconds before closing persistent connection */
+extern int   KeepAliveMax;              /**< Maximum requests per persistent connection */
+extern size_t CacheSize;                /**< Hot file cache budget in bytes */
+extern bool  Compression;               /**< Whether to compress text files on the fly */
+extern int   FastCGIWorkers;            /**< FastCGI workers per script (0 disables FastCGI) */
+extern char *AccessLogPath;             /**< Path to access log (NULL disables it) */
+extern AccessFormat AccessLogFormat;    /**< Format of access log entries */
+extern int   AccessLogSample;           /**< Log one in this many successful requests */
+extern int   MaxConnections;            /**< Maximum concurrent connections (0 for no limit) */
+extern int   MaxClientConnections;      /**< Maximum concurrent connections per client address (0 for no limit) */
+extern int   ListenBacklog;             /**< Length of server socket accept queue */
+extern int   RequestTimeout;            /**< Seconds a client has to send request headers */
+extern int   BodyTimeout;               /**< Idle seconds allowed while sending a request body */
+extern size_t MaxBodySize;              /**< Largest request body accepted in bytes */
+extern bool  Affinity;                  /**< Whether to pin workers to CPUs */
+extern char *TLSPort;                   /**< Port number of TLS listener (NULL disables it) */
+extern char *TLSCertificate;            /**< Path to PEM certificate chain */
+extern char *TLSKey;                    /**< Path to PEM private key (NULL if in certificate file) */
+extern char *MetricsPath;               /**< URI of metrics endpoint (NULL disables it) */
 
-/* Logging Macros */
+/* Logging Macros
+ *
+ * LOG_LEVEL selects which macros are compiled in: 0 for fatal only, 1 to add
+ * log, and 2 to add debug (the default, unless NDEBUG is defined).  Requests
+ * themselves are recorded by the access log instead (see access_log).
+ */
 
+#ifndef LOG_LEVEL
 #ifdef NDEBUG
-#define debug(M, ...)
+#define LOG_LEVEL       1
 #else
+#define LOG_LEVEL       2
+#endif
+#endif
+
+#if LOG_LEVEL >= 2
 #define debug(M, ...)   fprintf(stderr, "[%5d] DEBUG %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define debug(M, ...)
 #endif
 
-#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
+#if LOG_LEVEL >= 1
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define log(M, ...)
+#endif
 
-/* HTTP Request */
+#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
+
+/* Content Codings */
+
+typedef enum {
+    ENCODING_IDENTITY   = 0,            /**< Not encoded */
+    ENCODING_GZIP       = 1 << 0,       /**< gzip */
+    ENCODING_BROTLI     = 1 << 1,       /**< br */
+    ENCODING_ALL        = ENCODING_GZIP | ENCODING_BROTLI,
+} Encoding;
+
+/* Hot File Cache */
 
-typedef struct header Header;
-struct header {
-    char    *name;                      /*< Name of header entry */
-    char    *data;                      /*< Data of header entry */
-    Header  *next;                      /*< Next header entry */
+typedef struct cache_entry CacheEntry;
+struct cache_entry {
+    char        *path;                  /*< Resolved path of file */
+    Encoding     encoding;              /*< Content coding of data */
+    int          variants;              /*< Other codings the file is available in */
+    char        *source;                /*< File data was read from (precompressed sibling or path) */
+    char        *header;                /*< Response header (without Connection) */
+    size_t       hlength;               /*< Length of response header */
+    char        *data;                  /*< File contents (encoded) */
+    size_t       size;                  /*< Size of data */
+    const char  *mimetype;              /*< Mimetype of file */
+    char       **entries;               /*< Sorted names (directory listings only) */
+    size_t       nentries;              /*< Number of entries */
+    size_t       esize;                 /*< Size of entries block */
+
+    ino_t        inode;                 /*< Inode of source when cached */
+    off_t        length;                /*< Size of source when cached */
+    struct timespec mtime;              /*< Modification time when cached */
+    struct timespec ctime;              /*< Status change time when cached */
+    time_t       checked;               /*< Last time file was revalidated */
+
+    size_t       references;            /*< Number of holders of entry */
+    bool         permanent;             /*< Never released (see error_page) */
+    struct shared_slot *slot;           /*< Shared cache slot pinning the entry */
+    CacheEntry  *next;                  /*< Next entry in hash bucket */
+    CacheEntry  *newer;                 /*< Next more recently used entry */
+    CacheEntry  *older;                 /*< Next less recently used entry */
 };
 
-typedef struct {
-    int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
-    char    *method;                    /*< HTTP method */
-    char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
-    char    *query;                     /*< HTTP query string */
+CacheEntry *cache_lookup(const char *path, Encoding encoding);
+CacheEntry *cache_insert(const char *path, Encoding encoding, int variants, const char *source, int fd, const struct stat *st, const char *mimetype);
+CacheEntry *cache_insert_listing(const char *path, const struct stat *st, char *data, size_t size, char **entries, size_t nentries, size_t esize);
+void        cache_release(CacheEntry *e);
+bool        cache_fits(off_t size);
+void        cache_flush(void);
+bool        cache_changed(const CacheEntry *e, const struct stat *st);
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+int         shared_cache_start(void);
+bool        shared_cache_started(void);
+CacheEntry *shared_cache_lookup(const char *path, Encoding encoding);
+CacheEntry *shared_cache_insert(CacheEntry *e);
+void        shared_cache_release(CacheEntry *e);
+void        shared_cache_flush(void);
 
-    Header  *headers;                   /*< List of name, data Header pairs */
-} Request;
+/* Arena Allocator */
 
-Request *   accept_request(int sfd);
-void	    free_request(Request *request);
-int	    parse_request(Request *request);
+#define ARENA_BLOCK_SIZE    8192
 
-/* HTTP Request Handlers */
+typedef struct arena_block ArenaBlock;
+struct arena_block {
+    ArenaBlock *next;                   /*< Previously filled block */
+    size_t      size;                   /*< Capacity of data */
+    size_t      used;                   /*< Number of data bytes allocated */
+    char        data[] __attribute__((aligned(16)));
+};
+
+typedef struct {
+    ArenaBlock *blocks;                 /*< Current block (newest first) */
+} Arena;
+
+void *	    arena_alloc(Arena *a, size_t size);
+char *	    arena_strdup(Arena *a, const char *s);
+char *	    arena_printf(Arena *a, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void	    arena_reset(Arena *a);
+void	    arena_free(Arena *a);
+
+/* HTTP Request */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
     HTTP_STATUS_BAD_REQUEST= 1,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND= 2,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR= 3,   /* 500 Internal Server Error */
+    HTTP_STATUS_PARTIAL_CONTENT = 4,    /* 206 Partial Content */
+    HTTP_STATUS_NOT_MODIFIED = 5,       /* 304 Not Modified */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE = 6,  /* 416 Range Not Satisfiable */
+    HTTP_STATUS_FORBIDDEN = 7,          /* 403 Forbidden */
+    HTTP_STATUS_METHOD_NOT_ALLOWED = 8, /* 405 Method Not Allowed */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE = 9,  /* 413 Payload Too Large */
+    HTTP_STATUS_SERVICE_UNAVAILABLE = 10,   /* 503 Service Unavailable */
+    HTTP_STATUS_REQUEST_TIMEOUT = 11,   /* 408 Request Timeout */
+    HTTP_STATUS_URI_TOO_LONG = 12,      /* 414 URI Too Long */
+    HTTP_STATUS_HEADER_FIELDS_TOO_LARGE = 13,   /* 431 Request Header Fields Too Large */
+    HTTP_STATUS_NOT_IMPLEMENTED = 14,   /* 501 Not Implemented */
+    HTTP_STATUS_COUNT,
 } Status;
 
+#define REQUEST_MAX_HEADERS 64
+#define REQUEST_MAX_LINE    4096        /* Longest request line accepted */
+#define REQUEST_MAX_RANGES  16
+
+typedef struct {
+    size_t   offset;                    /*< Offset of string in request buffer */
+    size_t   length;                    /*< Length of string */
+} StringView;
+
+typedef struct {
+    StringView name;                    /*< Name of header entry */
+    StringView data;                    /*< Data of header entry */
+} Header;
+
+typedef struct {
+    const char *header;                 /*< Multipart delimiter and headers sent before range */
+    size_t      hlength;                /*< Length of header */
+    off_t       start;                  /*< Offset of first file byte in range */
+    off_t       end;                    /*< Offset just past last file byte in range */
+} Range;
+
+/**
+ * Request parser states
+ */
+typedef enum {
+    PARSE_REQUEST_LINE = 0,             /**< Expecting request line */
+    PARSE_HEADERS,                      /**< Expecting header or blank line */
+    PARSE_DONE,                         /**< Request fully parsed */
+    PARSE_ERROR,                        /**< Request is malformed */
+} ParseState;
+
+typedef struct {
+    int     fd;                         /*< Client socket file descripter */
+    FILE    *stream;                    /*< Client socket output stream */
+    StringView method;                  /*< HTTP method */
+    StringView uri;                     /*< HTTP uniform resource identifier */
+    StringView query;                   /*< HTTP query string */
+    StringView version;                 /*< HTTP version */
+    bool     head;                      /*< Whether method is HEAD (header without body) */
+    char    *path;                      /*< Real path corrsponding to URI and RootPath (in arena) */
+    Arena    arena;                     /*< Memory for request lifetime objects */
+
+    struct sockaddr_storage addr;       /*< Address of client */
+    socklen_t addrlen;                  /*< Length of addr (0 if not known yet) */
+    char     host[INET6_ADDRSTRLEN];    /*< Numeric host of client (see request_host) */
+    char     port[8];                   /*< Port number of client (see request_port) */
+
+    Header   headers[REQUEST_MAX_HEADERS];  /*< Array of name, data Header pairs */
+    size_t   nheaders;                  /*< Number of headers */
+
+    char     buffer[BUFSIZ];            /*< Client socket input buffer */
+    size_t   nread;                     /*< Number of bytes in input buffer */
+    size_t   offset;                    /*< Offset of unparsed input in buffer */
+    size_t   scan;                      /*< Offset up to which input was searched */
+    ParseState state;                   /*< Progress of request parser */
+
+    CacheEntry *entry;                  /*< Cached file to send instead of header and file */
+    int      file;                      /*< File to send after response header (or -1) */
+    off_t    file_offset;               /*< Offset of next file byte to send */
+    off_t    file_end;                  /*< Offset just past last file byte to send */
+    Range   *ranges;                    /*< Parts of multipart/byteranges response (in arena) */
+    size_t   nranges;                   /*< Number of parts (including closing delimiter) */
+    size_t   range;                     /*< Index of next part to send */
+    size_t   range_sent;                /*< Number of bytes of next part's header sent */
+
+    bool     keepalive;                 /*< Whether connection persists after response */
+    size_t   nrequests;                 /*< Number of requests already served on connection */
+    int      waiting;                   /*< Readable while connections wait for this worker (or -1, see wait_request) */
+
+    Status   status;                    /*< Status of response (or of parse error) */
+    uint64_t started;                   /*< Time request handling started (see metrics_now) */
+    size_t   nsent;                     /*< Number of response bytes sent */
+
+    int      admission;                 /*< Connection counters held (see admission_acquire) */
+    struct ssl_st *tls;                 /*< TLS session (or NULL for plain connections) */
+} Request;
+
+#define request_string(r, v)    ((r)->buffer + (v).offset)
+
+Request *   accept_request(int sfd, int flags);
+Request *   open_request(int fd, const struct sockaddr *addr, socklen_t length);
+int         open_request_stream(Request *request);
+const char *request_host(Request *request);
+const char *request_port(Request *request);
+void	    free_request(Request *request);
+void	    reset_request(Request *request);
+bool	    wait_request(Request *request, int timeout);
+int	    parse_request(Request *request);
+int	    parse_request_input(Request *request);
+const char *request_header(Request *request, const char *name);
+ssize_t     request_recv(Request *request, void *buffer, size_t size, int flags);
+ssize_t     request_send(Request *request, const void *buffer, size_t size, int flags);
+ssize_t     request_sendmsg(Request *request, struct iovec *iov, int n, int flags);
+ssize_t     request_sendfile(Request *request, int fd, off_t *offset, size_t count);
+
+/* Request Queue */
+
+typedef struct {
+    size_t   sequence;                  /*< Position this cell is ready for */
+    Request *request;                   /*< Queued request */
+} QueueCell;
+
+typedef struct {
+    QueueCell *cells;                   /*< Ring of queue cells */
+    size_t     mask;                    /*< Number of cells - 1 */
+    size_t     head __attribute__((aligned(64)));    /*< Next push position */
+    size_t     tail __attribute__((aligned(64)));    /*< Next pop position */
+    sem_t      items;                   /*< Number of queued requests */
+} Queue;
+
+Queue *	    queue_create(size_t capacity);
+void	    queue_delete(Queue *q);
+bool	    queue_push(Queue *q, Request *r);
+Request *   queue_pop(Queue *q);
+
+/* Timer Wheel */
+
+#define TIMER_SLOTS         64          /* One slot per second (power of two) */
+
+typedef struct timer Timer;
+struct timer {
+    time_t      deadline;               /*< Expiry time (0 if not armed) */
+    Timer      *prev;                   /*< Previous timer in slot */
+    Timer      *next;                   /*< Next timer in slot */
+};
+
+typedef struct {
+    Timer      *slots[TIMER_SLOTS];     /*< Armed timers by deadline */
+    time_t      current;                /*< Next second to check */
+    size_t      armed;                  /*< Number of armed timers */
+} TimerWheel;
+
+void        timer_set(TimerWheel *wheel, Timer *timer, time_t deadline);
+void        timer_cancel(TimerWheel *wheel, Timer *timer);
+Timer *     timer_expired(TimerWheel *wheel, time_t now);
+Timer *     timer_next(TimerWheel *wheel, Timer *timer);
+
+/* Error Pages */
+
+int         load_error_pages(const char *root);
+CacheEntry *error_page(Status status);
+size_t      error_page_render(char *body, size_t size, Status status);
+
+/* HTTP Request Handlers */
+
 Status      handle_request(Request *request);
+bool        request_script(Request *request);
+void        handle_connection(Request *request);
+void        response_complete(Request *request, uint64_t start);
+void        response_abort(Request *request, Status status);
+int         send_response_file(Request *request);
+bool        response_file_pending(Request *request);
+int         response_entry_vector(Request *request, struct iovec *iov);
+void        write_response_status(FILE *stream, Status status, const char *mimetype, size_t length);
+void        write_response_validators(FILE *stream, const struct stat *st, Encoding encoding, int variants);
+char **     cgi_environment(Request *request);
+
+/* FastCGI */
+
+int         fastcgi_start(void);
+void        fastcgi_stop(void);
+bool        fastcgi_script(const char *path);
+Status      handle_fastcgi_request(Request *request);
+
+/* Compression */
+
+int         request_encodings(Request *request);
+Encoding    encoding_select(int accepted);
+const char *encoding_name(Encoding encoding);
+const char *encoding_extension(Encoding encoding);
+bool        mimetype_compressible(const char *mimetype);
+int         compress_data(Encoding encoding, const char *data, size_t size, char **output, size_t *length);
+
+/* Admission Control */
+
+int         admission_start(void);
+bool        admission_acquire(Request *request);
+void        admission_release(Request *request);
+void        admission_reject(Request *request);
+
+/* Reload and Restart */
+
+/**
+ * Events reported by reload_poll
+ */
+typedef enum {
+    RELOAD_CONFIG = 1 << 0,             /**< Configuration was reloaded (SIGHUP) */
+    RELOAD_DRAIN  = 1 << 1,             /**< Server should finish its connections and exit (SIGQUIT) */
+} ReloadEvent;
+
+int         reload_start(char *argv[]);
+int         reload_listener(void);
+int         reload_tls_listener(void);
+size_t      reload_listeners(const int **fds);
+void        reload_share(const int *fds, size_t n);
+void        reload_ready(void);
+bool        reload_wait(int sfd);
+int         reload_poll(int sfd);
+bool        reload_draining(void);
+const sigset_t *reload_sigmask(void);
+
+/* TLS Termination */
+
+int         tls_start(void);
+int         tls_listener(void);
+int         tls_open(Request *request);
+int         tls_handshake(Request *request);
+ssize_t     tls_recv(Request *request, void *buffer, size_t size);
+ssize_t     tls_send(Request *request, const void *buffer, size_t size);
+ssize_t     tls_sendfile(Request *request, int fd, off_t offset, size_t size);
+bool        tls_pending(Request *request);
+void        tls_shutdown(Request *request);
+void        tls_close(Request *request);
+
+/* CPU Affinity */
+
+int         affinity_pin(int index);
+int         affinity_steer(int sfd, int cpu);
+
+/* Access Log */
+
+int         access_log_start(void);
+void        access_log_defer(void);
+void        access_log(Request *request);
+
+/* Metrics */
+
+/**
+ * Request stages timed by metrics
+ */
+typedef enum {
+    STAGE_ACCEPT = 0,                   /**< Setting up accepted connection */
+    STAGE_PARSE,                        /**< Parsing request */
+    STAGE_PATH,                         /**< Resolving request path */
+    STAGE_CACHE,                        /**< Serving from hot file cache */
+    STAGE_FILE,                         /**< File handler */
+    STAGE_BROWSE,                       /**< Directory listing handler */
+    STAGE_CGI,                          /**< CGI handler */
+    STAGE_FASTCGI,                      /**< FastCGI handler */
+    STAGE_WRITE,                        /**< Sending staged response and file */
+    STAGE_COUNT
+} Stage;
+
+int         metrics_start(void);
+uint64_t    metrics_now(void);
+uint64_t    metrics_record(Stage stage, uint64_t start);
+void        metrics_status(Status status);
+void        metrics_bytes(size_t bytes);
+void        metrics_connection(int delta);
+void        metrics_write(FILE *stream);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         event_server(int sfd);
+int         prefork_server(int sfd);
+int         threaded_server(int sfd);
+int         uring_server(int sfd);
+
+/* Script Offload */
+
+int         script_start(void);
+bool        script_submit(Request *request, void *context);
+void *      script_complete(void);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *port, bool reuseport);
+int	    socket_nonblocking(int fd);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+#define SCAN_MAX_DELIMITERS 4
+
+const char *scan_delimiters(const char *s, size_t length, const char *delimiters);
+
+int	    load_mimetypes(const char *path);
+const char *determine_mimetype(const char *path);
+char *	    determine_request_path(Arena *arena, const char *uri, mode_t *mode);
+void        path_cache_flush(void);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
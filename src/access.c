@@ -0,0 +1,389 @@
+/* access.c: Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ACCESS_LOG_RING_SIZE    (256 << 10) /* Bytes of entries buffered per thread */
+#define ACCESS_LOG_ENTRY_SIZE   4096        /* Longest entry (longer fields are truncated) */
+#define ACCESS_LOG_FIELD_SIZE   1024        /* Longest escaped field */
+#define ACCESS_LOG_INTERVAL     20          /* Milliseconds between drains */
+
+/* Entry Ring
+ *
+ * Each thread appends entries to its own ring, and the drain thread of its
+ * process consumes them.  head is only advanced by the thread and tail only by
+ * the drain thread, so neither side needs a lock.
+ */
+
+typedef struct log_ring LogRing;
+struct log_ring {
+    char     data[ACCESS_LOG_RING_SIZE];        /*< Buffered entries */
+    size_t   head __attribute__((aligned(64))); /*< Bytes ever appended */
+    size_t   tail __attribute__((aligned(64))); /*< Bytes ever written to log */
+    size_t   sampled;                           /*< Requests seen (for sampling) */
+    size_t   dropped;                           /*< Entries that did not fit */
+    LogRing *next;                              /*< Next ring of process */
+};
+
+/* Internal Declarations */
+LogRing *access_log_ring(void);
+bool    access_log_drain(void);
+void *  access_log_thread(void *arg);
+void    access_log_stop(void);
+void    access_log_forked(void);
+size_t  access_log_format(char *entry, size_t size, Request *r, long duration);
+size_t  access_log_escape(char *s, size_t size, const char *data, size_t length, bool json);
+const char *access_log_time(bool json);
+
+/* Internal Variables */
+static int              LogFD     = -1;             /* Access log file */
+static LogRing         *Rings     = NULL;           /* Rings of this process */
+static pthread_mutex_t  RingsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        Drainer;                    /* Drain thread of this process */
+static bool             Draining  = false;          /* Whether Drainer is running */
+static bool             Deferred  = false;          /* Whether entries wait for exit (see access_log_defer) */
+static volatile bool    Stopping  = false;          /* Whether Drainer should exit */
+static __thread LogRing *Ring     = NULL;           /* Ring of calling thread */
+
+/**
+ * Open access log.
+ *
+ * @return  0 on success (or if AccessLogPath is NULL) and -1 on error.
+ *
+ * This opens AccessLogPath ("-" for standard output) for appending.  It must
+ * be called before any worker threads or processes are started; until it is
+ * called, access_log does nothing.
+ **/
+int access_log_start(void) {
+    if (!AccessLogPath) {
+        return 0;
+    }
+
+    if (streq(AccessLogPath, "-")) {
+        LogFD = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    } else {
+        LogFD = open(AccessLogPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    if (LogFD < 0) {
+        fprintf(stderr, "Could Not Open Access Log %s: %s\n", AccessLogPath, strerror(errno));
+        return -1;
+    }
+
+    if (AccessLogSample < 1) {
+        AccessLogSample = 1;
+    }
+    pthread_atfork(NULL, NULL, access_log_forked);
+    atexit(access_log_stop);
+    return 0;
+}
+
+/**
+ * Write entries of this process only when it exits.
+ *
+ * Processes that serve a single connection (forking mode) call this, so they
+ * neither start a drain thread nor wait for one to wake up when exiting:
+ * their entries stay in the ring and go out in one write at exit (see
+ * access_log_stop), or earlier if the ring fills up.
+ **/
+void access_log_defer(void) {
+    Deferred = true;
+}
+
+/**
+ * Append access log entry for finished request.
+ *
+ * @param   r           Request structure (with its response sent).
+ *
+ * The entry is formatted and copied into the ring of the calling thread;
+ * writing it to the log is left to the drain thread (started by the first
+ * entry of each process).  If the ring is full, the entry is dropped and
+ * counted instead of waiting (unless the process has no drain thread, see
+ * access_log_defer, in which case the ring is written out first).
+ **/
+void access_log(Request *r) {
+    char     entry[ACCESS_LOG_ENTRY_SIZE];
+    LogRing *ring;
+
+    if (LogFD < 0 || !(ring = access_log_ring())) {
+        return;
+    }
+
+    /* Sample successful (not 4xx or 5xx) responses */
+    if (http_status_string(r->status)[0] < '4' && ring->sampled++ % AccessLogSample) {
+        return;
+    }
+
+    size_t length = access_log_format(entry, sizeof(entry), r, (metrics_now() - r->started) / 1000);
+    size_t head   = ring->head;
+    size_t tail   = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (Deferred && ACCESS_LOG_RING_SIZE - (head - tail) < length) {
+        access_log_drain();
+        tail = ring->tail;
+    }
+
+    if (ACCESS_LOG_RING_SIZE - (head - tail) < length) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Copy entry (wrapping around end of ring) */
+    size_t offset = head % ACCESS_LOG_RING_SIZE;
+    size_t first  = length < ACCESS_LOG_RING_SIZE - offset ? length : ACCESS_LOG_RING_SIZE - offset;
+    memcpy(ring->data + offset, entry, first);
+    memcpy(ring->data, entry + first, length - first);
+
+    __atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return ring of calling thread.
+ *
+ * @return  LogRing structure (or NULL if it cannot be allocated).
+ *
+ * The first ring of a process also starts its drain thread (unless entries
+ * are deferred, see access_log_defer).
+ **/
+LogRing *access_log_ring(void) {
+    if (Ring) {
+        return Ring;
+    }
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&RingsLock);
+    ring->next = Rings;
+    __atomic_store_n(&Rings, ring, __ATOMIC_RELEASE);
+    if (!Draining && !Deferred && pthread_create(&Drainer, NULL, access_log_thread, NULL) == 0) {
+        Draining = true;
+    }
+    pthread_mutex_unlock(&RingsLock);
+
+    return Ring = ring;
+}
+
+/**
+ * Write buffered entries of every ring in this process to the log.
+ *
+ * @return  Whether or not any entries were written.
+ *
+ * Each ring's pending entries are written with a single vectored write (two
+ * iovecs when they wrap around the end of the ring).
+ **/
+bool access_log_drain(void) {
+    bool written = false;
+
+    for (LogRing *ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+
+        while (tail < head) {
+            size_t offset = tail % ACCESS_LOG_RING_SIZE;
+            size_t length = head - tail;
+            size_t first  = length < ACCESS_LOG_RING_SIZE - offset ? length : ACCESS_LOG_RING_SIZE - offset;
+            struct iovec iov[] = {
+                { ring->data + offset, first },
+                { ring->data,          length - first },
+            };
+
+            ssize_t nwritten = writev(LogFD, iov, length > first ? 2 : 1);
+            if (nwritten < 0) {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Could Not Write Access Log: %s\n", strerror(errno));
+                nwritten = length;              /* Discard entries */
+            }
+            tail += nwritten;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            written = true;
+        }
+
+        size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            fprintf(stderr, "Access Log Dropped %zu Entries\n", dropped);
+        }
+    }
+
+    return written;
+}
+
+/**
+ * Drain rings until the process exits (drain thread).
+ *
+ * Sleeping between drains lets entries accumulate, so that each write covers
+ * many of them.
+ **/
+void *access_log_thread(void *arg) {
+    struct timespec interval = { 0, ACCESS_LOG_INTERVAL * 1000000 };
+
+    while (!Stopping) {
+        access_log_drain();
+        nanosleep(&interval, NULL);
+    }
+
+    access_log_drain();
+    return NULL;
+}
+
+/**
+ * Write remaining entries before process exits (atexit handler).
+ **/
+void access_log_stop(void) {
+    if (Draining) {
+        Stopping = true;
+        pthread_join(Drainer, NULL);
+        Draining = false;
+    } else if (Deferred) {
+        access_log_drain();
+    }
+}
+
+/**
+ * Forget parent's rings in forked child (pthread_atfork handler).
+ *
+ * The drain thread is not copied into the child, and the parent still writes
+ * the entries buffered in its rings, so the child starts over.
+ **/
+void access_log_forked(void) {
+    pthread_mutex_init(&RingsLock, NULL);
+    Rings    = NULL;
+    Ring     = NULL;
+    Draining = false;
+}
+
+/**
+ * Format access log entry.
+ *
+ * @param   entry       Buffer for entry.
+ * @param   size        Size of buffer.
+ * @param   r           Request structure.
+ * @param   duration    Microseconds from start of request to end of response.
+ * @return  Length of entry (including its newline).
+ *
+ * Common and combined entries follow the Apache formats (the byte count
+ * includes the response header).  JSON entries are one object per line.
+ **/
+size_t access_log_format(char *entry, size_t size, Request *r, long duration) {
+    char        method[64], uri[ACCESS_LOG_FIELD_SIZE], query[ACCESS_LOG_FIELD_SIZE];
+    char        referer[ACCESS_LOG_FIELD_SIZE], agent[ACCESS_LOG_FIELD_SIZE];
+    const char *referer_header = request_header(r, "Referer");
+    const char *agent_header   = request_header(r, "User-Agent");
+    const char *status         = http_status_string(r->status);
+    bool        json           = AccessLogFormat == ACCESS_LOG_JSON;
+    int         length;
+
+    access_log_escape(method, sizeof(method), request_string(r, r->method), r->method.length, json);
+    access_log_escape(uri, sizeof(uri), request_string(r, r->uri), r->uri.length, json);
+    access_log_escape(query, sizeof(query), request_string(r, r->query), r->query.length, json);
+    access_log_escape(referer, sizeof(referer), referer_header, referer_header ? strlen(referer_header) : 0, json);
+    access_log_escape(agent, sizeof(agent), agent_header, agent_header ? strlen(agent_header) : 0, json);
+
+    if (json) {
+        length = snprintf(entry, size,
+            "{\"time\":\"%s\",\"host\":\"%s\",\"method\":\"%s\",\"uri\":\"%s\",\"query\":\"%s\","
+            "\"version\":\"%.*s\",\"status\":%.3s,\"bytes\":%zu,\"duration_us\":%ld,"
+            "\"referer\":\"%s\",\"user_agent\":\"%s\"}\n",
+            access_log_time(true), request_host(r), method, uri, query,
+            (int)r->version.length, request_string(r, r->version), status, r->nsent, duration,
+            referer, agent);
+    } else if (!r->method.length) {
+        /* Request line could not be parsed */
+        length = snprintf(entry, size, "%s - - [%s] \"-\" %.3s %zu",
+            request_host(r), access_log_time(false), status, r->nsent);
+    } else {
+        length = snprintf(entry, size, "%s - - [%s] \"%s %s%s%s %.*s\" %.3s %zu",
+            request_host(r), access_log_time(false), method, uri,
+            r->query.length ? "?" : "", query,
+            (int)r->version.length, request_string(r, r->version), status, r->nsent);
+    }
+
+    if (!json) {
+        if (AccessLogFormat == ACCESS_LOG_COMBINED && length < (int)size) {
+            length += snprintf(entry + length, size - length, " \"%s\" \"%s\"",
+                referer_header ? referer : "-", agent_header ? agent : "-");
+        }
+        if (length < (int)size) {
+            length += snprintf(entry + length, size - length, "\n");
+        }
+    }
+
+    /* Keep truncated entries on their own line */
+    if (length >= (int)size) {
+        length = size - 1;
+        entry[length - 1] = '\n';
+    }
+    return length;
+}
+
+/**
+ * Escape field of access log entry.
+ *
+ * @param   s           Buffer for escaped field.
+ * @param   size        Size of buffer.
+ * @param   data        Field data (may be NULL if length is 0).
+ * @param   length      Length of data.
+ * @param   json        Whether to escape for a JSON string (otherwise as Apache
+ * does for quoted fields).
+ * @return  Length of escaped field (truncated to fit buffer).
+ *
+ * Quotes, backslashes, and control characters are escaped, so that clients
+ * cannot forge entries.
+ **/
+size_t access_log_escape(char *s, size_t size, const char *data, size_t length, bool json) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < length && n + 7 < size; i++) {
+        unsigned char c = data[i];
+
+        if (c == '"' || c == '\\') {
+            s[n++] = '\\';
+            s[n++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            n += sprintf(s + n, json ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            s[n++] = c;
+        }
+    }
+
+    s[n] = '\0';
+    return n;
+}
+
+/**
+ * Return current time formatted for access log.
+ *
+ * @param   json        Whether to use ISO 8601 (otherwise the Apache format).
+ * @return  Formatted time (in thread local storage).
+ *
+ * The time only changes once a second, so it is reformatted at most that
+ * often.
+ **/
+const char *access_log_time(bool json) {
+    static __thread time_t Formatted = 0;
+    static __thread char   Stamp[32];
+    time_t now = time(NULL);
+
+    if (now != Formatted) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(Stamp, sizeof(Stamp), json ? "%Y-%m-%dT%H:%M:%SZ" : "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        Formatted = now;
+    }
+    return Stamp;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
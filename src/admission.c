@@ -0,0 +1,158 @@
+/* admission.c: Connection Admission Control */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ADMISSION_BUCKETS   4096        /* Per-client counters (addresses are hashed) */
+#define ADMISSION_TOTAL     (1 << 0)    /* Request holds a server-wide connection */
+#define ADMISSION_CLIENT    (1 << 1)    /* Request holds a connection of its client */
+
+/* Counters */
+
+typedef struct {
+    int         connections;                    /*< Admitted connections */
+    int         clients[ADMISSION_BUCKETS];     /*< Admitted connections by client bucket */
+} AdmissionBlock;
+
+/* Internal Declarations */
+size_t  admission_bucket(Request *r);
+
+/* Internal Variables */
+static AdmissionBlock *Admission = NULL;        /* Shared by every worker */
+
+/**
+ * Allocate shared connection counters.
+ *
+ * @return  0 on success and -1 on error.
+ *
+ * As with the metrics, the counters live in an anonymous shared mapping, so
+ * this must be called before any worker processes are forked for the limits
+ * to cover all of them.  Until it is called, every connection is admitted.
+ **/
+int admission_start(void) {
+    void *block = mmap(NULL, sizeof(AdmissionBlock), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (block == MAP_FAILED) {
+        fprintf(stderr, "Could Not Map Admission Counters: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Admission = block;
+    return 0;
+}
+
+/**
+ * Admit connection if the server and its client are below their limits.
+ *
+ * @param   r           Request structure of new connection.
+ * @return  Whether or not the connection may be served.
+ *
+ * An admitted connection counts against MaxConnections and
+ * MaxClientConnections until it is released (see admission_release, which
+ * free_request calls).  Counters are raised first and lowered again if that
+ * went over the limit, so concurrent acceptors never admit too many.
+ *
+ * Clients are counted in ADMISSION_BUCKETS buckets by hashed address, so
+ * addresses sharing a bucket share its limit.
+ **/
+bool admission_acquire(Request *r) {
+    if (!Admission) {
+        return true;
+    }
+
+    if (MaxConnections > 0) {
+        if (__atomic_add_fetch(&Admission->connections, 1, __ATOMIC_RELAXED) > MaxConnections) {
+            __atomic_sub_fetch(&Admission->connections, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        r->admission |= ADMISSION_TOTAL;
+    }
+
+    if (MaxClientConnections > 0) {
+        int *client = &Admission->clients[admission_bucket(r)];
+
+        if (__atomic_add_fetch(client, 1, __ATOMIC_RELAXED) > MaxClientConnections) {
+            __atomic_sub_fetch(client, 1, __ATOMIC_RELAXED);
+            admission_release(r);
+            return false;
+        }
+        r->admission |= ADMISSION_CLIENT;
+    }
+
+    return true;
+}
+
+/**
+ * Release counters held by connection.
+ *
+ * @param   r           Request structure.
+ **/
+void admission_release(Request *r) {
+    if (r->admission & ADMISSION_TOTAL) {
+        __atomic_sub_fetch(&Admission->connections, 1, __ATOMIC_RELAXED);
+    }
+    if (r->admission & ADMISSION_CLIENT) {
+        __atomic_sub_fetch(&Admission->clients[admission_bucket(r)], 1, __ATOMIC_RELAXED);
+    }
+    r->admission = 0;
+}
+
+/**
+ * Turn away connection that was not admitted.
+ *
+ * @param   r           Request structure of new connection.
+ *
+ * This answers with the prebuilt 503 response (with Retry-After, see
+ * load_error_pages) without reading the request (see response_abort).
+ **/
+void admission_reject(Request *r) {
+    debug("Rejecting request from %s:%s", request_host(r), request_port(r));
+    response_abort(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+}
+
+/**
+ * Determine client counter of connection.
+ *
+ * @param   r           Request structure.
+ * @return  Index into AdmissionBlock clients.
+ *
+ * Only the address is hashed (not the port).  If the address of the client
+ * is not known yet, it is looked up first.
+ **/
+size_t admission_bucket(Request *r) {
+    const unsigned char *address = NULL;
+    size_t length = 0;
+    size_t hash   = 2166136261u;
+
+    if (!r->addrlen) {
+        socklen_t addrlen = sizeof(r->addr);
+        if (getpeername(r->fd, (struct sockaddr *)&r->addr, &addrlen) == 0) {
+            r->addrlen = addrlen;
+        }
+    }
+
+    if (r->addrlen && r->addr.ss_family == AF_INET) {
+        address = (const unsigned char *)&((struct sockaddr_in *)&r->addr)->sin_addr;
+        length  = sizeof(struct in_addr);
+    } else if (r->addrlen && r->addr.ss_family == AF_INET6) {
+        address = (const unsigned char *)&((struct sockaddr_in6 *)&r->addr)->sin6_addr;
+        length  = sizeof(struct in6_addr);
+    }
+
+    /* FNV-1a, as for the cache */
+    for (size_t i = 0; i < length; i++) {
+        hash ^= address[i];
+        hash *= 16777619u;
+    }
+    return hash % ADMISSION_BUCKETS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
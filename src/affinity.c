@@ -0,0 +1,98 @@
+/* affinity.c: CPU Affinity */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Internal Declarations */
+int     affinity_cpu(int index);
+
+/**
+ * Pin calling thread to the CPU of a worker.
+ *
+ * @param   index       Worker index (0 for the only worker of event modes).
+ * @return  CPU the thread is now pinned to (or -1 on error).
+ *
+ * Workers are given the CPUs the process may run on in turn, wrapping around
+ * if there are more workers than CPUs, so respawned workers get the CPU of the
+ * worker they replace.
+ *
+ * This must be called before the worker allocates anything of its own: every
+ * worker allocates its hot file cache entries, request arenas, and connection
+ * state lazily, and Linux places pages on the NUMA node of the CPU that first
+ * touches them, so pinning first keeps that memory on the worker's node.
+ **/
+int affinity_pin(int index) {
+    cpu_set_t set;
+    unsigned  cpu  = 0;
+    unsigned  node = 0;
+    int       target;
+
+    if ((target = affinity_cpu(index)) < 0) {
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(target, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Could Not Pin Worker %d To CPU %d: %s\n", index, target, strerror(errno));
+        return -1;
+    }
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        debug("Pinned worker %d to CPU %u (node %u)", index, cpu, node);
+    }
+    return target;
+}
+
+/**
+ * Steer connections of SO_REUSEPORT listener to CPU.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   cpu         CPU of worker accepting from sfd.
+ * @return  0 on success and -1 on error.
+ *
+ * With SO_INCOMING_CPU set on every listener of a SO_REUSEPORT group, the
+ * kernel hands a new connection to the listener of the CPU that received it,
+ * so (with NIC queues or RPS steered to the same CPUs) a connection is
+ * received, accepted, and served on one CPU and node.
+ **/
+int affinity_steer(int sfd, int cpu) {
+    if (setsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        fprintf(stderr, "Could Not Steer Listener To CPU %d: %s\n", cpu, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Determine CPU of worker.
+ *
+ * @param   index       Worker index.
+ * @return  CPU number (or -1 on error).
+ **/
+int affinity_cpu(int index) {
+    cpu_set_t set;
+    int       count;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0 || (count = CPU_COUNT(&set)) == 0) {
+        fprintf(stderr, "Could Not Get CPU Affinity: %s\n", strerror(errno));
+        return -1;
+    }
+
+    index %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
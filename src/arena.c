@@ -0,0 +1,122 @@
+/* arena.c: Request Arena Allocator */
+
+#include "spidey.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define ARENA_ALIGNMENT     16          /* Suits any object type (see ArenaBlock) */
+
+/**
+ * Allocate memory from arena.
+ *
+ * @param   a           Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to uninitialized memory (or NULL on error).
+ *
+ * Allocations are carved out of the current block by bumping an offset.  When
+ * the block is full, a new one of at least ARENA_BLOCK_SIZE bytes is chained in
+ * front of it.  The memory stays valid until the arena is reset or freed.
+ **/
+void *arena_alloc(Arena *a, size_t size) {
+    ArenaBlock *b = a->blocks;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (!b || b->size - b->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+        if (!(b = malloc(sizeof(ArenaBlock) + capacity))) {
+            return NULL;
+        }
+        b->next   = a->blocks;
+        b->size   = capacity;
+        b->used   = 0;
+        a->blocks = b;
+    }
+
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/**
+ * Copy string into arena.
+ *
+ * @param   a           Arena structure.
+ * @param   s           String to copy.
+ * @return  Copy of s allocated from arena (or NULL on error).
+ **/
+char *arena_strdup(Arena *a, const char *s) {
+    size_t length = strlen(s);
+    char  *copy   = arena_alloc(a, length + 1);
+
+    if (copy) {
+        memcpy(copy, s, length + 1);
+    }
+    return copy;
+}
+
+/**
+ * Format string into arena.
+ *
+ * @param   a           Arena structure.
+ * @param   format      printf format string.
+ * @return  Formatted string allocated from arena (or NULL on error).
+ **/
+char *arena_printf(Arena *a, const char *format, ...) {
+    va_list args;
+    int     length;
+    char   *s;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0 || !(s = arena_alloc(a, length + 1))) {
+        return NULL;
+    }
+
+    va_start(args, format);
+    vsnprintf(s, length + 1, format, args);
+    va_end(args);
+    return s;
+}
+
+/**
+ * Release all allocations from arena, keeping its first block.
+ *
+ * @param   a           Arena structure.
+ *
+ * The oldest block is kept (and reused) so that a typical request on a
+ * persistent connection never needs to call malloc again.
+ **/
+void arena_reset(Arena *a) {
+    ArenaBlock *b = a->blocks;
+
+    while (b && b->next) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    if ((a->blocks = b)) {
+        b->used = 0;
+    }
+}
+
+/**
+ * Deallocate every block in arena.
+ *
+ * @param   a           Arena structure.
+ **/
+void arena_free(Arena *a) {
+    arena_reset(a);
+    free(a->blocks);
+    a->blocks = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
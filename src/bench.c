@@ -0,0 +1,608 @@
+/* bench.c: Spidey HTTP Load Generator */
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_BUFFER_SIZE   (64 << 10)  /* Bytes of response read at a time */
+#define BENCH_SMALL_FILES   16          /* Number of small files in tree */
+#define BENCH_SMALL_SIZE    1024        /* Size of each small file */
+#define BENCH_LARGE_SIZE    (4 << 20)   /* Size of large file */
+#define BENCH_DIRECTORY     200         /* Number of entries in listed directory */
+#define BENCH_STARTUP       5000        /* Milliseconds to wait for server to listen */
+
+/* Workloads */
+
+typedef struct {
+    const char *name;                   /*< Name shown in report */
+    const char *uris[BENCH_SMALL_FILES];    /*< URIs requested in turn */
+} Workload;
+
+static const Workload Workloads[] = {
+    { "small",     { "/small/0.txt", "/small/1.txt", "/small/2.txt", "/small/3.txt",
+                     "/small/4.txt", "/small/5.txt", "/small/6.txt", "/small/7.txt",
+                     "/small/8.txt", "/small/9.txt", "/small/10.txt", "/small/11.txt",
+                     "/small/12.txt", "/small/13.txt", "/small/14.txt", "/small/15.txt" } },
+    { "large",     { "/large.bin" } },
+    { "directory", { "/directory" } },
+    { "cgi",       { "/script.cgi?bench=1" } },
+};
+
+static const char *Modes[] = { "single", "forking", "event", "prefork", "threaded", "uring", NULL };
+
+/* Client Thread */
+
+typedef struct {
+    const Workload *workload;           /*< Workload to drive */
+    size_t          index;              /*< Index of thread (selects first URI) */
+    uint32_t       *latencies;          /*< Latency of each request in microseconds */
+    size_t          count;              /*< Number of latencies recorded */
+    size_t          capacity;           /*< Capacity of latencies */
+    size_t          errors;             /*< Number of failed requests */
+} Client;
+
+/* Global Variables */
+
+static char         *SpideyPath = "bin/spidey";
+static int           Connections = 32;
+static int           Duration    = 2;
+static char          Port[16];
+static volatile bool Running     = false;
+
+/* Internal Declarations */
+int     bench_tree(const char *root);
+int     bench_file(const char *path, size_t size, mode_t mode, const char *contents);
+int     bench_remove(const char *path, const struct stat *st, int type, struct FTW *ftw);
+int     bench_port(void);
+pid_t   bench_start(const char *mode, const char *root);
+void    bench_stop(pid_t pid);
+int     bench_connect(void);
+void *  bench_client(void *arg);
+int     bench_request(Client *c, int *fd, const char *uri, char *buffer);
+double  bench_percentile(const uint32_t *latencies, size_t count, double p);
+int     bench_compare(const void *a, const void *b);
+double  bench_now(void);
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hcdms]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c clients    Number of concurrent client connections (default: 32)\n");
+    fprintf(stderr, "    -d seconds    Duration of each run (default: 2)\n");
+    fprintf(stderr, "    -m mode       Only benchmark this mode (may be repeated)\n");
+    fprintf(stderr, "    -s path       Path to spidey executable (default: bin/spidey)\n");
+    exit(status);
+}
+
+/**
+ * Benchmark every server mode against every workload.
+ *
+ * This generates a document tree in a temporary directory, then for each
+ * mode starts the server on a free port and, for each workload, runs
+ * Connections client threads for Duration seconds.  Each client sends
+ * requests back to back on a persistent connection (reconnecting whenever the
+ * server closes it), and the latency of each request, including any
+ * reconnect, is recorded.
+ **/
+int main(int argc, char *argv[]) {
+    const char *modes[sizeof(Modes) / sizeof(Modes[0])] = { NULL };
+    size_t      nmodes = 0;
+    char        root[] = "/tmp/spidey-bench.XXXXXX";
+    int         status = EXIT_SUCCESS;
+
+    /* Parse command line options */
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (arg[1] != 'h' && argind == argc) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'c':
+                Connections = atoi(argv[argind++]);
+                break;
+            case 'd':
+                Duration = atoi(argv[argind++]);
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'm':
+                if (nmodes < sizeof(modes) / sizeof(modes[0]) - 1) {
+                    modes[nmodes++] = argv[argind];
+                }
+                argind++;
+                break;
+            case 's':
+                SpideyPath = argv[argind++];
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+
+    if (Connections < 1 || Duration < 1) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!nmodes) {
+        for (; Modes[nmodes]; nmodes++) {
+            modes[nmodes] = Modes[nmodes];
+        }
+    }
+
+    /* Responses are read until close, so a reset peer must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!mkdtemp(root) || bench_tree(root) < 0) {
+        fprintf(stderr, "Could Not Generate Document Tree: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %-10s %10s %10s %9s %9s %9s %7s\n",
+           "Mode", "Workload", "Requests", "Req/s", "p50 ms", "p99 ms", "p999 ms", "Errors");
+
+    for (size_t m = 0; m < nmodes; m++) {
+        pid_t pid = bench_start(modes[m], root);
+        if (pid < 0) {
+            fprintf(stderr, "Could Not Start %s Server\n", modes[m]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        for (size_t w = 0; w < sizeof(Workloads) / sizeof(Workloads[0]); w++) {
+            Client    *clients = calloc(Connections, sizeof(Client));
+            pthread_t *threads = calloc(Connections, sizeof(pthread_t));
+            size_t     count = 0, errors = 0;
+            int        started = 0;
+
+            if (!clients || !threads) {
+                free(clients);
+                free(threads);
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            /* Run client threads for Duration seconds */
+            Running = true;
+            double start = bench_now();
+            for (; started < Connections; started++) {
+                clients[started].workload = &Workloads[w];
+                clients[started].index    = started;
+                if (pthread_create(&threads[started], NULL, bench_client, &clients[started]) != 0) {
+                    break;
+                }
+            }
+            sleep(Duration);
+            Running = false;
+            for (int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            double elapsed = bench_now() - start;
+
+            /* Merge latencies and report */
+            for (int i = 0; i < started; i++) {
+                count  += clients[i].count;
+                errors += clients[i].errors;
+            }
+
+            uint32_t *latencies = malloc((count ? count : 1) * sizeof(uint32_t));
+            size_t    offset = 0;
+            for (int i = 0; i < started; i++) {
+                if (latencies) {
+                    memcpy(latencies + offset, clients[i].latencies, clients[i].count * sizeof(uint32_t));
+                    offset += clients[i].count;
+                }
+                free(clients[i].latencies);
+            }
+
+            if (latencies) {
+                qsort(latencies, count, sizeof(uint32_t), bench_compare);
+                printf("%-10s %-10s %10zu %10.0f %9.3f %9.3f %9.3f %7zu\n",
+                       modes[m], Workloads[w].name, count, count / elapsed,
+                       bench_percentile(latencies, count, 0.50),
+                       bench_percentile(latencies, count, 0.99),
+                       bench_percentile(latencies, count, 0.999), errors);
+                fflush(stdout);
+            }
+
+            free(latencies);
+            free(clients);
+            free(threads);
+        }
+
+        bench_stop(pid);
+    }
+
+    nftw(root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
+
+/**
+ * Generate document tree.
+ *
+ * @param   root        Path to empty directory.
+ * @return  0 on success and -1 on error.
+ *
+ * The tree has BENCH_SMALL_FILES small files, one large file, a directory
+ * with BENCH_DIRECTORY entries, and a CGI script.
+ **/
+int bench_tree(const char *root) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/small", root);
+    if (mkdir(path, 0755) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_SMALL_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/small/%d.txt", root, i);
+        if (bench_file(path, BENCH_SMALL_SIZE, 0644, NULL) < 0) {
+            return -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/large.bin", root);
+    if (bench_file(path, BENCH_LARGE_SIZE, 0644, NULL) < 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/directory", root);
+    if (mkdir(path, 0755) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_DIRECTORY; i++) {
+        snprintf(path, sizeof(path), "%s/directory/entry-%04d.txt", root, i);
+        if (bench_file(path, 0, 0644, NULL) < 0) {
+            return -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/script.cgi", root);
+    return bench_file(path, 0, 0755,
+        "#!/bin/sh\n"
+        "printf 'HTTP/1.0 200 OK\\r\\nContent-Type: text/plain\\r\\n\\r\\n'\n"
+        "echo \"$QUERY_STRING\"\n");
+}
+
+/**
+ * Create file filled with contents (or with size bytes of text).
+ *
+ * @param   path        Path of file.
+ * @param   size        Size of file (if contents is NULL).
+ * @param   mode        Permissions of file.
+ * @param   contents    Contents of file (or NULL).
+ * @return  0 on success and -1 on error.
+ **/
+int bench_file(const char *path, size_t size, mode_t mode, const char *contents) {
+    FILE *fs = fopen(path, "w");
+
+    if (!fs) {
+        return -1;
+    }
+
+    if (contents) {
+        fputs(contents, fs);
+    } else {
+        for (size_t i = 0; i < size; i++) {
+            fputc(i % 64 == 63 ? '\n' : 'a' + i % 26, fs);
+        }
+    }
+
+    if (fclose(fs) != 0) {
+        return -1;
+    }
+    return chmod(path, mode);
+}
+
+/**
+ * Remove file or directory (nftw callback).
+ **/
+int bench_remove(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+/**
+ * Find free TCP port and store it in Port.
+ *
+ * @return  0 on success and -1 on error.
+ **/
+int bench_port(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    snprintf(Port, sizeof(Port), "%d", ntohs(addr.sin_port));
+    close(fd);
+    return 0;
+}
+
+/**
+ * Start server in mode and wait until it accepts connections.
+ *
+ * @param   mode        Name of server mode.
+ * @param   root        Document root.
+ * @return  Process id of server (or -1 on error).
+ *
+ * The server runs in its own process group, so that bench_stop also reaches
+ * any workers or connection processes.  Its log output is discarded.
+ **/
+pid_t bench_start(const char *mode, const char *root) {
+    pid_t pid;
+
+    if (bench_port() < 0 || (pid = fork()) < 0) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (!freopen("/dev/null", "w", stderr)) {
+            _exit(EXIT_FAILURE);
+        }
+        execl(SpideyPath, SpideyPath, "-c", mode, "-p", Port, "-r", root, NULL);
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(pid, pid);
+
+    for (int waited = 0; waited < BENCH_STARTUP; waited += 10) {
+        int fd = bench_connect();
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(10000);
+    }
+
+    bench_stop(pid);
+    return -1;
+}
+
+/**
+ * Stop server and all of its processes.
+ *
+ * @param   pid         Process id of server.
+ **/
+void bench_stop(pid_t pid) {
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    kill(-pid, SIGKILL);
+}
+
+/**
+ * Connect to server.
+ *
+ * @return  Socket file descriptor (or -1 on error).
+ **/
+int bench_connect(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(Port)), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    struct timeval     timeout = { .tv_sec = 5 };
+    int                one = 1;
+    int                fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/**
+ * Send requests until the run ends (thread function).
+ *
+ * @param   arg         Client structure.
+ * @return  NULL.
+ **/
+void *bench_client(void *arg) {
+    Client *c = arg;
+    size_t  nuris = 0;
+    char   *buffer;
+    int     fd = -1;
+
+    while (nuris < BENCH_SMALL_FILES && c->workload->uris[nuris]) {
+        nuris++;
+    }
+
+    if (!(buffer = malloc(BENCH_BUFFER_SIZE))) {
+        return NULL;
+    }
+
+    for (size_t i = c->index; Running; i++) {
+        double start = bench_now();
+
+        if (bench_request(c, &fd, c->workload->uris[i % nuris], buffer) < 0) {
+            c->errors++;
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            continue;
+        }
+
+        if (c->count == c->capacity) {
+            size_t    capacity = c->capacity ? c->capacity * 2 : 4096;
+            uint32_t *grown = realloc(c->latencies, capacity * sizeof(uint32_t));
+            if (!grown) {
+                break;
+            }
+            c->latencies = grown;
+            c->capacity  = capacity;
+        }
+        c->latencies[c->count++] = (bench_now() - start) * 1e6;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Send request and read whole response.
+ *
+ * @param   c           Client structure.
+ * @param   fd          Socket (connected first if -1, and closed and set to
+ *                      -1 if the server closes the connection).
+ * @param   uri         URI to request.
+ * @param   buffer      Buffer of BENCH_BUFFER_SIZE bytes.
+ * @return  0 on success and -1 on error.
+ *
+ * The body is read up to its Content-Length, or until the server closes the
+ * connection if there is none.
+ **/
+int bench_request(Client *c, int *fd, const char *uri, char *buffer) {
+    char    request[256];
+    int     length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", uri);
+    size_t  nread = 0;
+    char   *end = NULL;
+
+    if (*fd < 0 && (*fd = bench_connect()) < 0) {
+        return -1;
+    }
+
+    if (send(*fd, request, length, MSG_NOSIGNAL) != length) {
+        return -1;
+    }
+
+    /* Read header */
+    while (!end) {
+        ssize_t n = recv(*fd, buffer + nread, BENCH_BUFFER_SIZE - 1 - nread, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        nread += n;
+        buffer[nread] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+        if (!end && nread == BENCH_BUFFER_SIZE - 1) {
+            return -1;
+        }
+    }
+
+    if (strncmp(buffer, "HTTP/1.", 7) != 0 || strncmp(buffer + 9, "200", 3) != 0) {
+        return -1;
+    }
+
+    /* Find body length and whether the connection persists */
+    long long remaining = -1;
+    bool      persistent = true;
+    *end = '\0';
+    for (char *line = strstr(buffer, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            remaining = strtoll(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            persistent = false;
+        }
+    }
+    if (remaining < 0) {
+        persistent = false;
+    }
+
+    /* Read body */
+    size_t body = nread - (end + 4 - buffer);
+    if (remaining >= 0) {
+        remaining -= body;
+    }
+    while (remaining != 0) {
+        ssize_t n = recv(*fd, buffer, BENCH_BUFFER_SIZE, 0);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            if (remaining > 0) {
+                return -1;
+            }
+            break;
+        }
+        if (remaining > 0) {
+            remaining -= n;
+        }
+    }
+
+    if (!persistent) {
+        close(*fd);
+        *fd = -1;
+    }
+    return 0;
+}
+
+/**
+ * Return latency at percentile in milliseconds.
+ *
+ * @param   latencies   Sorted latencies in microseconds.
+ * @param   count       Number of latencies.
+ * @param   p           Percentile (0 to 1).
+ * @return  Latency in milliseconds (0 if there are no latencies).
+ **/
+double bench_percentile(const uint32_t *latencies, size_t count, double p) {
+    if (!count) {
+        return 0;
+    }
+    size_t index = p * count;
+    return latencies[index < count ? index : count - 1] / 1000.0;
+}
+
+/**
+ * Compare latencies (qsort callback).
+ **/
+int bench_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Return monotonic time in seconds.
+ **/
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
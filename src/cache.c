@@ -0,0 +1,449 @@
+/* cache.c: Hot File Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_BUCKETS       4096        /* Number of hash table buckets */
+#define CACHE_REVALIDATE    1           /* Seconds between mtime checks */
+
+/* Internal Declarations */
+int     cache_describe(CacheEntry *e, const char *path, const char *source, Encoding encoding, int variants, const struct stat *st, const char *mimetype);
+CacheEntry *cache_link(CacheEntry *e);
+size_t  cache_hash(const char *path);
+void    cache_unlink(CacheEntry *e);
+void    cache_evict(size_t needed);
+void    cache_free(CacheEntry *e);
+
+/* Internal Variables */
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry     *CacheBuckets[CACHE_BUCKETS];
+static CacheEntry     *CacheNewest = NULL;      /* Most recently used entry */
+static CacheEntry     *CacheOldest = NULL;      /* Least recently used entry */
+static size_t          CacheUsed   = 0;         /* Bytes held by cached entries */
+
+/**
+ * Lookup file in cache.
+ *
+ * @param   path        Resolved path of file.
+ * @param   encoding    Content coding of wanted representation.
+ * @return  Referenced CacheEntry (or NULL if the file is not cached).
+ *
+ * A hit moves the entry to the front of the LRU list.  At most once every
+ * CACHE_REVALIDATE seconds, the file the entry was read from is stat'd again
+ * and the entry is dropped if it has changed (or is gone).
+ *
+ * Files in the shared cache (see shared_cache_start) are looked up there
+ * first, without taking CacheLock.
+ *
+ * The returned entry must be released with cache_release.
+ **/
+CacheEntry *cache_lookup(const char *path, Encoding encoding) {
+    CacheEntry *e;
+    time_t now;
+
+    if (!CacheSize) {
+        return NULL;
+    }
+
+    if ((e = shared_cache_lookup(path, encoding))) {
+        return e;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock(&CacheLock);
+
+    for (e = CacheBuckets[cache_hash(path)]; e; e = e->next) {
+        if (e->encoding == encoding && streq(e->path, path)) {
+            break;
+        }
+    }
+
+    if (e && now - e->checked >= CACHE_REVALIDATE) {
+        struct stat st;
+        if (stat(e->source, &st) < 0 || cache_changed(e, &st)) {
+            cache_unlink(e);
+            e = NULL;
+        } else {
+            e->checked = now;
+        }
+    }
+
+    if (e) {
+        /* Move to front of LRU list */
+        if (CacheNewest != e) {
+            if (e->newer)
+                e->newer->older = e->older;
+            if (e->older)
+                e->older->newer = e->newer;
+            if (CacheOldest == e)
+                CacheOldest = e->newer;
+            e->older = CacheNewest;
+            e->newer = NULL;
+            CacheNewest->newer = e;
+            CacheNewest = e;
+        }
+        e->references++;
+    }
+
+    pthread_mutex_unlock(&CacheLock);
+    return e;
+}
+
+/**
+ * Insert file into cache.
+ *
+ * @param   path        Resolved path of file.
+ * @param   encoding    Content coding of representation.
+ * @param   variants    Other content codings the file is available in.
+ * @param   source      Precompressed sibling fd refers to (or NULL if fd is
+ *                      path itself).
+ * @param   fd          Open file descriptor of source.
+ * @param   st          Status of source.
+ * @param   mimetype    Mimetype of file (static string).
+ * @return  Referenced CacheEntry (or NULL if the file was not cached).
+ *
+ * This reads the whole file into memory along with its pre-serialized response
+ * header, then evicts least recently used entries until the new entry fits in
+ * CacheSize.  Files larger than CacheSize / 16 are not cached.
+ *
+ * If an encoding is given without a source, the file is compressed here, so
+ * that each on-the-fly representation is only compressed once.
+ *
+ * When the cache is shared, the entry is copied into the shared cache instead;
+ * if it does not fit there, it is returned without being cached.
+ *
+ * The returned entry must be released with cache_release.
+ **/
+CacheEntry *cache_insert(const char *path, Encoding encoding, int variants, const char *source, int fd, const struct stat *st, const char *mimetype) {
+    CacheEntry *e;
+    size_t offset = 0;
+
+    if (!cache_fits(st->st_size)) {
+        return NULL;
+    }
+
+    if (!(e = calloc(1, sizeof(CacheEntry)))) {
+        return NULL;
+    }
+
+    /* Copy file contents */
+    e->size = st->st_size;
+    if (!(e->data = malloc(e->size ? e->size : 1))) {
+        goto fail;
+    }
+
+    while (offset < e->size) {
+        ssize_t nread = pread(fd, e->data + offset, e->size - offset, offset);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            goto fail;
+        }
+        offset += nread;
+    }
+
+    /* Compress on the fly */
+    if (encoding != ENCODING_IDENTITY && !source) {
+        char  *compressed;
+        size_t length;
+
+        if (compress_data(encoding, e->data, e->size, &compressed, &length) < 0) {
+            goto fail;
+        }
+        free(e->data);
+        e->data = compressed;
+        e->size = length;
+    }
+
+    if (cache_describe(e, path, source, encoding, variants, st, mimetype) < 0) {
+        goto fail;
+    }
+
+    if (shared_cache_started()) {
+        CacheEntry *shared = shared_cache_insert(e);
+        if (shared) {
+            cache_free(e);
+            return shared;
+        }
+        e->references = 1;      /* Only the caller's */
+        return e;
+    }
+
+    return cache_link(e);
+
+fail:
+    cache_free(e);
+    return NULL;
+}
+
+/**
+ * Insert rendered directory listing into cache.
+ *
+ * @param   path        Resolved path of directory.
+ * @param   st          Status of directory (taken before it was read).
+ * @param   data        Rendered text/html listing (allocated with malloc).
+ * @param   size        Length of data.
+ * @param   entries     Sorted entry names (a single malloc'd block holding the
+ *                      pointers followed by the strings).
+ * @param   nentries    Number of entry names.
+ * @param   esize       Size of entries block.
+ * @return  Referenced CacheEntry (or NULL if the listing was not cached).
+ *
+ * The cache takes ownership of data and entries, even on failure.  Listings
+ * are revalidated like files, so adding or removing a file (which updates the
+ * directory's mtime) drops the entry.
+ *
+ * The returned entry must be released with cache_release.
+ **/
+CacheEntry *cache_insert_listing(const char *path, const struct stat *st, char *data, size_t size, char **entries, size_t nentries, size_t esize) {
+    CacheEntry *e;
+
+    if (!cache_fits(size + esize) || !(e = calloc(1, sizeof(CacheEntry)))) {
+        free(data);
+        free(entries);
+        return NULL;
+    }
+
+    e->data     = data;
+    e->size     = size;
+    e->entries  = entries;
+    e->nentries = nentries;
+    e->esize    = esize;
+    if (cache_describe(e, path, NULL, ENCODING_IDENTITY, 0, st, "text/html") < 0) {
+        cache_free(e);
+        return NULL;
+    }
+    return cache_link(e);
+}
+
+/**
+ * Serialize response header of entry and record what it was read from.
+ *
+ * @param   e           CacheEntry structure (with data and size set).
+ * @param   path        Resolved path of file.
+ * @param   source      File data was read from (or NULL if it is path).
+ * @param   encoding    Content coding of data.
+ * @param   variants    Other content codings the file is available in.
+ * @param   st          Status of source.
+ * @param   mimetype    Mimetype of file (static string).
+ * @return  0 on success and -1 on error.
+ **/
+int cache_describe(CacheEntry *e, const char *path, const char *source, Encoding encoding, int variants, const struct stat *st, const char *mimetype) {
+    FILE *stream;
+
+    /* Serialize response header (the Connection header is added when sent) */
+    if (!(stream = open_memstream(&e->header, &e->hlength))) {
+        return -1;
+    }
+    write_response_status(stream, HTTP_STATUS_OK, mimetype, e->size);
+    write_response_validators(stream, st, encoding, variants);
+    fclose(stream);
+
+    if (!(e->path = strdup(path)) || !(e->source = strdup(source ? source : path))) {
+        return -1;
+    }
+    e->encoding   = encoding;
+    e->variants   = variants;
+    e->mimetype   = mimetype;
+    e->inode      = st->st_ino;
+    e->length     = st->st_size;
+    e->mtime      = st->st_mtim;
+    e->ctime      = st->st_ctim;
+    e->checked    = time(NULL);
+    return 0;
+}
+
+/**
+ * Link entry into cache.
+ *
+ * @param   e           CacheEntry structure (see cache_describe).
+ * @return  e with a reference for the caller.
+ **/
+CacheEntry *cache_link(CacheEntry *e) {
+    e->references = 2;          /* One for the cache and one for the caller */
+
+    pthread_mutex_lock(&CacheLock);
+
+    /* Replace any existing entry for path */
+    size_t bucket = cache_hash(e->path);
+    for (CacheEntry *old = CacheBuckets[bucket]; old; old = old->next) {
+        if (old->encoding == e->encoding && streq(old->path, e->path)) {
+            cache_unlink(old);
+            break;
+        }
+    }
+
+    cache_evict(e->size + e->hlength + e->esize);
+
+    e->next = CacheBuckets[bucket];
+    CacheBuckets[bucket] = e;
+    e->older = CacheNewest;
+    if (CacheNewest)
+        CacheNewest->newer = e;
+    CacheNewest = e;
+    if (!CacheOldest)
+        CacheOldest = e;
+    CacheUsed += e->size + e->hlength + e->esize;
+
+    pthread_mutex_unlock(&CacheLock);
+    return e;
+}
+
+/**
+ * Determine if file is small enough to be cached.
+ *
+ * @param   size        Size of file.
+ * @return  Whether or not cache_insert would accept the file.
+ **/
+bool cache_fits(off_t size) {
+    return CacheSize && (size_t)size <= CacheSize / 16;
+}
+
+/**
+ * Release reference to cache entry.
+ *
+ * @param   e           CacheEntry structure.
+ *
+ * The entry is deallocated once it has been removed from the cache and no
+ * requests are still sending it.  Permanent entries (the prebuilt error
+ * pages) are shared by every request and never released.  Entries of the
+ * shared cache are unpinned instead (see shared_cache_release).
+ **/
+void cache_release(CacheEntry *e) {
+    if (!e || e->permanent) {
+        return;
+    }
+
+    if (e->slot) {
+        shared_cache_release(e);
+        return;
+    }
+
+    pthread_mutex_lock(&CacheLock);
+    bool last = --e->references == 0;
+    pthread_mutex_unlock(&CacheLock);
+
+    if (last) {
+        cache_free(e);
+    }
+}
+
+/**
+ * Remove every entry from cache.
+ *
+ * Entries that requests are still sending are deallocated once they are
+ * released (see cache_release).
+ **/
+void cache_flush(void) {
+    pthread_mutex_lock(&CacheLock);
+    while (CacheOldest) {
+        cache_unlink(CacheOldest);
+    }
+    pthread_mutex_unlock(&CacheLock);
+
+    shared_cache_flush();
+}
+
+/**
+ * Determine if file changed since it was cached.
+ *
+ * @param   e           CacheEntry structure.
+ * @param   st          Current status of file.
+ * @return  Whether or not the cached entry is stale.
+ *
+ * Times are compared to the nanosecond, since a directory gaining an entry
+ * in the second it was listed must not keep its stale listing.
+ *
+ * The ctime is compared as well as the mtime so that permission changes (for
+ * instance, a file becoming executable) are also noticed.
+ **/
+bool cache_changed(const CacheEntry *e, const struct stat *st) {
+    return e->inode != st->st_ino || e->length != st->st_size ||
+           e->mtime.tv_sec != st->st_mtim.tv_sec || e->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+           e->ctime.tv_sec != st->st_ctim.tv_sec || e->ctime.tv_nsec != st->st_ctim.tv_nsec;
+}
+
+/**
+ * Hash path string.
+ *
+ * @param   path        Path string.
+ * @return  Bucket index for path (FNV-1a).
+ **/
+size_t cache_hash(const char *path) {
+    size_t hash = 2166136261u;
+
+    for (const char *c = path; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+/**
+ * Remove entry from cache (CacheLock must be held).
+ *
+ * @param   e           CacheEntry structure.
+ **/
+void cache_unlink(CacheEntry *e) {
+    /* Remove from hash chain */
+    for (CacheEntry **p = &CacheBuckets[cache_hash(e->path)]; *p; p = &(*p)->next) {
+        if (*p == e) {
+            *p = e->next;
+            break;
+        }
+    }
+
+    /* Remove from LRU list */
+    if (e->newer)
+        e->newer->older = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    if (CacheNewest == e)
+        CacheNewest = e->older;
+    if (CacheOldest == e)
+        CacheOldest = e->newer;
+
+    CacheUsed -= e->size + e->hlength + e->esize;
+
+    /* Drop cache reference */
+    if (--e->references == 0) {
+        cache_free(e);
+    }
+}
+
+/**
+ * Evict least recently used entries (CacheLock must be held).
+ *
+ * @param   needed      Number of bytes to make room for.
+ **/
+void cache_evict(size_t needed) {
+    while (CacheOldest && CacheUsed + needed > CacheSize) {
+        cache_unlink(CacheOldest);
+    }
+}
+
+/**
+ * Deallocate cache entry.
+ *
+ * @param   e           CacheEntry structure.
+ **/
+void cache_free(CacheEntry *e) {
+    free(e->path);
+    free(e->source);
+    free(e->header);
+    free(e->data);
+    free(e->entries);
+    free(e);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
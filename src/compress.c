@@ -0,0 +1,222 @@
+/* compress.c: Response Content Codings */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define COMPRESS_GZIP_LEVEL     4       /* zlib compression level (files are compressed while a request waits) */
+#define COMPRESS_BROTLI_QUALITY 5       /* Brotli quality (likewise, so well below the slow top levels) */
+
+/* Internal Declarations */
+int compress_gzip(const char *data, size_t size, char **output, size_t *length);
+int compress_brotli(const char *data, size_t size, char **output, size_t *length);
+
+/**
+ * Determine content codings accepted by client.
+ *
+ * @param   r           Request structure.
+ * @return  Mask of Encoding values listed in Accept-Encoding (without q=0).
+ *
+ * Accept-Encoding has the form "gzip, br;q=0.9, *;q=0".  A "*" accepts every
+ * coding that is not otherwise listed.
+ **/
+int request_encodings(Request *r) {
+    const char *s = request_header(r, "Accept-Encoding");
+    int accepted = 0, listed = 0, wildcard = 0;
+
+    while (s && *s) {
+        s += strspn(s, " \t,");
+
+        size_t  length = strcspn(s, " \t,;");
+        int     coding = 0;
+        bool    wild   = false;
+
+        if ((length == 4 && strncasecmp(s, "gzip", 4) == 0) ||
+            (length == 6 && strncasecmp(s, "x-gzip", 6) == 0)) {
+            coding = ENCODING_GZIP;
+        } else if (length == 2 && strncasecmp(s, "br", 2) == 0) {
+            coding = ENCODING_BROTLI;
+        } else if (length == 1 && *s == '*') {
+            wild = true;
+        }
+        s += length;
+
+        /* A weight of zero refuses the coding */
+        bool refused = false;
+        for (; *s && *s != ','; s++) {
+            if (*s == ';') {
+                const char *q = s + 1 + strspn(s + 1, " \t");
+                if (tolower((unsigned char)q[0]) == 'q' && q[1] == '=') {
+                    refused = strtod(q + 2, NULL) <= 0;
+                }
+            }
+        }
+
+        listed |= coding;
+        if (wild) {
+            wildcard = refused ? -1 : 1;
+        } else if (!refused) {
+            accepted |= coding;
+        }
+    }
+
+    if (wildcard > 0) {
+        accepted |= ENCODING_ALL & ~listed;
+    }
+    return accepted;
+}
+
+/**
+ * Select preferred content coding.
+ *
+ * @param   accepted    Mask of acceptable Encoding values.
+ * @return  Best Encoding in mask (or ENCODING_IDENTITY if there is none).
+ *
+ * Brotli is preferred since it compresses text noticeably better than gzip.
+ **/
+Encoding encoding_select(int accepted) {
+    if (accepted & ENCODING_BROTLI)
+        return ENCODING_BROTLI;
+    if (accepted & ENCODING_GZIP)
+        return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
+
+/**
+ * Return static string naming content coding.
+ *
+ * @param   encoding    Content coding.
+ * @return  Content-Encoding token (or NULL for ENCODING_IDENTITY).
+ **/
+const char *encoding_name(Encoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:     return "gzip";
+        case ENCODING_BROTLI:   return "br";
+        default:                return NULL;
+    }
+}
+
+/**
+ * Return static string with file extension of precompressed siblings.
+ *
+ * @param   encoding    Content coding.
+ * @return  Extension including '.' (or NULL for ENCODING_IDENTITY).
+ **/
+const char *encoding_extension(Encoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:     return ".gz";
+        case ENCODING_BROTLI:   return ".br";
+        default:                return NULL;
+    }
+}
+
+/**
+ * Determine if files of mimetype are worth compressing.
+ *
+ * @param   mimetype    Mimetype of file.
+ * @return  Whether or not the mimetype is text-like.
+ *
+ * Images, audio, video, and archives are already compressed.
+ **/
+bool mimetype_compressible(const char *mimetype) {
+    static const char *Compressible[] = {
+        "application/javascript",
+        "application/json",
+        "application/wasm",
+        "application/xml",
+        "application/xhtml+xml",
+        "image/svg+xml",
+        NULL,
+    };
+
+    if (strncmp(mimetype, "text/", 5) == 0) {
+        return true;
+    }
+    for (const char **m = Compressible; *m; m++) {
+        if (streq(mimetype, *m)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compress data with content coding.
+ *
+ * @param   encoding    Content coding (ENCODING_GZIP or ENCODING_BROTLI).
+ * @param   data        Data to compress.
+ * @param   size        Size of data.
+ * @param   output      Where to store newly allocated compressed data.
+ * @param   length      Where to store length of compressed data.
+ * @return  0 on success and -1 on error.
+ **/
+int compress_data(Encoding encoding, const char *data, size_t size, char **output, size_t *length) {
+    switch (encoding) {
+        case ENCODING_GZIP:     return compress_gzip(data, size, output, length);
+        case ENCODING_BROTLI:   return compress_brotli(data, size, output, length);
+        default:                return -1;
+    }
+}
+
+/**
+ * Compress data in gzip format.
+ **/
+int compress_gzip(const char *data, size_t size, char **output, size_t *length) {
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(&stream, size);
+    if (!(*output = malloc(bound))) {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in   = (Bytef *)data;
+    stream.avail_in  = size;
+    stream.next_out  = (Bytef *)*output;
+    stream.avail_out = bound;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+
+    *length = stream.total_out;
+    deflateEnd(&stream);
+    return 0;
+}
+
+/**
+ * Compress data in Brotli format.
+ **/
+int compress_brotli(const char *data, size_t size, char **output, size_t *length) {
+    size_t bound = BrotliEncoderMaxCompressedSize(size);
+
+    if (!bound || !(*output = malloc(bound))) {
+        return -1;
+    }
+
+    *length = bound;
+    if (!BrotliEncoderCompress(COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               size, (const uint8_t *)data, length, (uint8_t *)*output)) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,193 @@
+/* error.c: Prebuilt Error Pages */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ERROR_PAGE_MAX      (64 << 10)  /* Largest custom error page loaded */
+#define ERROR_RETRY_AFTER   1           /* Seconds overloaded clients are asked to wait */
+
+/* Internal Declarations */
+char   *error_page_read(const char *root, const char *code, size_t *size);
+int     error_page_build(CacheEntry *e, Status status, char *data, size_t size);
+
+/* Internal Variables */
+static CacheEntry *ErrorPages[HTTP_STATUS_COUNT];    /* Current pages (see load_error_pages) */
+
+/**
+ * Build complete response of every error status.
+ *
+ * @param   root        Directory searched for custom pages (CODE.html).
+ * @return  0 on success and -1 on error.
+ *
+ * Each 4xx and 5xx status gets a permanent cache entry holding its status
+ * line, headers, and body, so handle_error can send it with a single write
+ * (see send_cache_entry).  A page named after the code in root (for instance
+ * 404.html) replaces the default body.
+ *
+ * Each page is read-only once built, so it may be shared among threads.
+ * Loading again (see reload_configuration) publishes new pages atomically,
+ * while the previous ones are kept: responses in flight may still be sending
+ * them.  If a page cannot be built, its previous one stays in use.
+ **/
+int load_error_pages(const char *root) {
+    int result = 0;
+
+    for (Status status = 0; status < HTTP_STATUS_COUNT; status++) {
+        const char *string = http_status_string(status);
+        char        code[4];
+        char       *data;
+        size_t      size;
+        CacheEntry *e = NULL;
+
+        if (!string || string[0] < '4') {
+            continue;
+        }
+        snprintf(code, sizeof(code), "%.3s", string);
+
+        if ((data = error_page_read(root, code, &size))) {
+            debug("Loaded Custom %s Page", code);
+        } else if ((data = malloc(BUFSIZ))) {
+            size = error_page_render(data, BUFSIZ, status);
+        }
+
+        if (!data || !(e = calloc(1, sizeof(CacheEntry))) || error_page_build(e, status, data, size) < 0) {
+            fprintf(stderr, "Could Not Build %s Page: %s\n", code, strerror(errno));
+            if (e) {
+                free(e->header);
+                free(e);
+            }
+            free(data);
+            result = -1;
+            continue;
+        }
+
+        /* Replace previous page (which is never freed, see above) */
+        __atomic_store_n(&ErrorPages[status], e, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+/**
+ * Return prebuilt response of error status.
+ *
+ * @param   status      HTTP Status.
+ * @return  Permanent CacheEntry (or NULL if none was built for status).
+ **/
+CacheEntry *error_page(Status status) {
+    if ((unsigned)status >= HTTP_STATUS_COUNT) {
+        return NULL;
+    }
+    return __atomic_load_n(&ErrorPages[status], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Render default HTML body of error status.
+ *
+ * @param   body        Buffer to render into.
+ * @param   size        Size of buffer.
+ * @param   status      HTTP Status.
+ * @return  Length of body (truncated to fit in buffer).
+ **/
+size_t error_page_render(char *body, size_t size, Status status) {
+    int length = snprintf(body, size,
+        "<html><body>"
+        "<h1><strong>%s</strong></h1><h2>Good Try!</h2>"
+        "<center><img src=\"https://www.dailydot.com/wp-content/uploads/2019/04/winnie-the-pooh-1024x512.jpg\"></center>"
+        "</html></body>", http_status_string(status));
+
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+/**
+ * Read custom error page.
+ *
+ * @param   root        Directory of custom pages.
+ * @param   code        Three digit status code.
+ * @param   size        Where to store size of page.
+ * @return  Allocated page contents (or NULL if there is no usable page).
+ **/
+char *error_page_read(const char *root, const char *code, size_t *size) {
+    char        path[PATH_MAX];
+    struct stat st;
+    char       *data = NULL;
+    int         fd;
+
+    snprintf(path, sizeof(path), "%s/%s.html", root, code);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > ERROR_PAGE_MAX) {
+        fprintf(stderr, "Ignoring Custom %s Page: Not A File Under %d Bytes\n", code, ERROR_PAGE_MAX);
+        goto done;
+    }
+
+    if (!(data = malloc(st.st_size ? st.st_size : 1))) {
+        goto done;
+    }
+
+    *size = 0;
+    while (*size < (size_t)st.st_size) {
+        ssize_t nread = read(fd, data + *size, st.st_size - *size);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        *size += nread;
+    }
+
+done:
+    close(fd);
+    return data;
+}
+
+/**
+ * Fill permanent cache entry with complete response of error status.
+ *
+ * @param   e           CacheEntry structure.
+ * @param   status      HTTP Status.
+ * @param   data        Allocated body (owned by entry on success).
+ * @param   size        Size of body.
+ * @return  0 on success and -1 on error.
+ *
+ * As for cached files, the header stops before the Connection header, which
+ * depends on the request (see response_entry_vector).
+ **/
+int error_page_build(CacheEntry *e, Status status, char *data, size_t size) {
+    FILE *stream = open_memstream(&e->header, &e->hlength);
+
+    if (!stream) {
+        return -1;
+    }
+
+    write_response_status(stream, status, "text/html", size);
+    if (status == HTTP_STATUS_METHOD_NOT_ALLOWED) {
+        fputs("Allow: GET, HEAD\r\n", stream);
+    }
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+        fprintf(stream, "Retry-After: %d\r\n", ERROR_RETRY_AFTER);
+    }
+    if (fclose(stream) != 0) {
+        return -1;
+    }
+
+    e->data      = data;
+    e->size      = size;
+    e->mimetype  = "text/html";
+    e->permanent = true;
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
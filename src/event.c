@@ -0,0 +1,539 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX_EVENTS    1024
+
+/**
+ * Connection states
+ */
+typedef enum {
+    CONNECTION_HANDSHAKE,               /**< Negotiating TLS session */
+    CONNECTION_READING,                 /**< Reading request headers */
+    CONNECTION_SCRIPT,                  /**< Waiting for script thread */
+    CONNECTION_WRITING,                 /**< Writing staged response */
+    CONNECTION_CLOSED,                  /**< Connection is finished */
+} ConnectionState;
+
+/* Client Connection */
+
+typedef struct connection Connection;
+struct connection {
+    Timer            timer;             /*< Current deadline (first, see connection_expire) */
+    Request         *request;           /*< Client request */
+    ConnectionState  state;             /*< Current state of connection */
+    char            *response;          /*< Staged response data */
+    size_t           length;            /*< Length of staged response */
+    size_t           sent;              /*< Number of response bytes sent */
+    uint64_t         responded;         /*< Time response was staged (0 once sent) */
+    bool             eof;               /*< Whether client finished sending */
+    time_t           header;            /*< Time request started arriving (0 while idle) */
+};
+
+/* Internal Declarations */
+void connection_accept(int sfd, bool tls);
+void connection_process(Connection *c);
+void connection_read(Connection *c);
+void connection_respond(Connection *c);
+void connection_staged(Connection *c);
+void connection_write(Connection *c);
+void connection_schedule(Connection *c);
+void connection_expire(void);
+void connection_drain(int sfd);
+void connection_close(Connection *c);
+
+/* Internal Variables */
+static int         EventFD = -1;        /* Epoll file descriptor */
+static TimerWheel  Timers;              /* Connection deadlines */
+static int         TLSServer = -1;      /* TLS server socket (see tls_start) */
+static int         ScriptFD  = -1;      /* Script completion notification (see script_start) */
+static size_t      Scripts   = 0;       /* Connections waiting for script threads */
+
+/**
+ * Handle HTTP requests with a single event-driven process.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The server socket and every client socket are non-blocking and registered
+ * with an edge-triggered epoll instance, along with the TLS server socket if
+ * TLS is started.  Each client connection moves through the following states:
+ *
+ *  1. CONNECTION_HANDSHAKE: Connections accepted on the TLS server socket
+ *     negotiate their session whenever the socket is ready (see
+ *     tls_handshake), then move on to CONNECTION_READING.  After that, their
+ *     data is decrypted and encrypted as it is received and sent.
+ *
+ *  2. CONNECTION_READING: Parse input as it arrives until the request header
+ *     block is complete (or malformed), then handle the request.  The response is staged in
+ *     memory rather than written directly to the socket.
+ *
+ *  3. CONNECTION_SCRIPT: Requests for CGI and FastCGI scripts are handled
+ *     by script threads instead (see script_submit), so a slow script does not
+ *     hold up the other connections.  Events on the socket are ignored, and
+ *     the connection has no deadline, until the thread has staged the
+ *     response.
+ *
+ *  4. CONNECTION_WRITING: Write the staged response, followed by any file
+ *     body, whenever the socket is writable, then either return to CONNECTION_READING for the next
+ *     (possibly already pipelined) request or close.
+ *
+ *  5. CONNECTION_CLOSED: Release the connection.
+ *
+ * Every connection has a deadline in a timer wheel (see connection_schedule),
+ * so stalled connections are closed without scanning the others.  The TLS
+ * handshake counts toward the RequestTimeout of the first request.
+ *
+ * With Affinity, the loop is pinned to one CPU (see affinity_pin).
+ *
+ * The reload signals are only taken while waiting for events (see
+ * reload_start).  On SIGQUIT, the server socket is closed along with every
+ * idle connection, the others are closed once their current response is sent
+ * (see connection_drain), and the server exits when none are left.
+ **/
+int event_server(int sfd) {
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLET,
+        .data.ptr = NULL,               /* NULL marks the server socket */
+    };
+
+    if (Affinity) {
+        affinity_pin(0);
+    }
+
+    /* Register non-blocking server socket */
+    if (socket_nonblocking(sfd) < 0) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    if ((EventFD = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    if (epoll_ctl(EventFD, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* Register non-blocking TLS server socket */
+    if ((TLSServer = tls_listener()) >= 0) {
+        event.data.ptr = &TLSServer;
+        if (socket_nonblocking(TLSServer) < 0 || epoll_ctl(EventFD, EPOLL_CTL_ADD, TLSServer, &event) < 0) {
+            fprintf(stderr, "Could Not Register TLS Server Socket: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+
+    /* Register script completion notification (scripts run inside the loop
+     * without it) */
+    if ((ScriptFD = script_start()) >= 0) {
+        event.data.ptr = &ScriptFD;
+        if (epoll_ctl(EventFD, EPOLL_CTL_ADD, ScriptFD, &event) < 0) {
+            fprintf(stderr, "Could Not Register Script Notification: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+
+    /* Dispatch events until drained */
+    while (sfd >= 0 || Timers.armed || Scripts) {
+        int n = epoll_pwait(EventFD, events, EVENT_MAX_EVENTS, Timers.armed ? 1000 : -1, reload_sigmask());
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            goto fail;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *data = events[i].data.ptr;
+
+            if (data == &TLSServer) {
+                connection_accept(TLSServer, true);
+            } else if (data == &ScriptFD) {
+                Connection *c;
+
+                while ((c = script_complete())) {
+                    Scripts--;
+                    connection_staged(c);
+                    connection_process(c);
+                }
+            } else if (data) {
+                connection_process(data);
+            } else {
+                connection_accept(sfd, false);
+            }
+        }
+
+        connection_expire();
+
+        if (sfd >= 0 && (reload_poll(sfd) & RELOAD_DRAIN)) {
+            connection_drain(sfd);
+            sfd = -1;
+        }
+    }
+
+    close(EventFD);
+    return EXIT_SUCCESS;
+
+fail:
+    close(EventFD);
+    close(sfd);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Accept all pending connections on server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   tls         Whether sfd is the TLS server socket.
+ *
+ * Since the server socket is edge-triggered, this accepts until the backlog is
+ * drained.  Connections over the admission limits are answered with 503 and
+ * closed right away (TLS connections are just closed, since no session exists
+ * to answer them in).
+ **/
+void connection_accept(int sfd, bool tls) {
+    Request *r;
+
+    while ((r = accept_request(sfd, SOCK_NONBLOCK))) {
+        if (!admission_acquire(r)) {
+            if (!tls)
+                admission_reject(r);
+            free_request(r);
+            continue;
+        }
+
+        if (tls && tls_open(r) < 0) {
+            free_request(r);
+            continue;
+        }
+
+        Connection *c = calloc(1, sizeof(Connection));
+        if (!c) {
+            fprintf(stderr, "Could Not Allocate Connection\n");
+            free_request(r);
+            continue;
+        }
+        c->request = r;
+        c->state   = tls ? CONNECTION_HANDSHAKE : CONNECTION_READING;
+        c->header  = time(NULL);
+        timer_set(&Timers, &c->timer, c->header + RequestTimeout);
+        metrics_connection(1);
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLET,
+            .data.ptr = c,
+        };
+
+        if (epoll_ctl(EventFD, EPOLL_CTL_ADD, r->fd, &event) < 0) {
+            fprintf(stderr, "Could Not Register Connection: %s\n", strerror(errno));
+            connection_close(c);
+            continue;
+        }
+    }
+}
+
+/**
+ * Advance connection state machine as far as the socket allows.
+ *
+ * @param   c           Client connection.
+ *
+ * Since the client socket is edge-triggered, this keeps reading and writing
+ * until an operation would block or the connection closes.
+ **/
+void connection_process(Connection *c) {
+    Request *r = c->request;
+
+    while (true) {
+        switch (c->state) {
+            case CONNECTION_HANDSHAKE:
+                switch (tls_handshake(r)) {
+                    case 0:
+                        c->state = CONNECTION_READING;
+                        break;
+                    case 1:
+                        return;
+                    default:
+                        c->state = CONNECTION_CLOSED;
+                        break;
+                }
+                break;
+
+            case CONNECTION_READING:
+                connection_read(c);
+                if (c->state != CONNECTION_READING)
+                    break;
+                if (parse_request_input(r) != 0) {
+                    connection_respond(c);
+                } else if (c->eof) {
+                    c->state = CONNECTION_CLOSED;
+                } else {
+                    connection_schedule(c);
+                    return;
+                }
+                break;
+
+            case CONNECTION_SCRIPT:
+                return;
+
+            case CONNECTION_WRITING:
+                connection_write(c);
+                if (c->state == CONNECTION_WRITING) {
+                    connection_schedule(c);
+                    return;
+                }
+                break;
+
+            case CONNECTION_CLOSED:
+                connection_close(c);
+                return;
+        }
+    }
+}
+
+/**
+ * Read available request data from client socket.
+ *
+ * @param   c           Client connection.
+ *
+ * This reads until the socket would block or the input buffer is full.  If
+ * the client shuts down its side, then c->eof is set so that any requests it
+ * already sent can still be answered.  On error, the connection is marked
+ * closed.
+ **/
+void connection_read(Connection *c) {
+    Request *r = c->request;
+
+    while (!c->eof && r->nread < sizeof(r->buffer)) {
+        ssize_t nread = request_recv(r, r->buffer + r->nread, sizeof(r->buffer) - r->nread, 0);
+        if (nread > 0) {
+            r->nread += nread;
+            continue;
+        }
+
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (nread == 0)
+            c->eof = true;
+        else
+            c->state = CONNECTION_CLOSED;
+        return;
+    }
+}
+
+/**
+ * Handle buffered request and stage response.
+ *
+ * @param   c           Client connection.
+ *
+ * The request handlers write to r->stream, so it is pointed at a memory
+ * stream that collects the whole response (connections have no socket stream
+ * of their own).
+ *
+ * Script requests are handed to a script thread, which stages the response
+ * while the connection waits in CONNECTION_SCRIPT.
+ **/
+void connection_respond(Connection *c) {
+    Request *r = c->request;
+
+    r->stream = open_memstream(&c->response, &c->length);
+    if (!r->stream) {
+        fprintf(stderr, "Could Not Open Response Stream: %s\n", strerror(errno));
+        c->state  = CONNECTION_CLOSED;
+        return;
+    }
+
+    if (request_script(r) && script_submit(r, c)) {
+        timer_cancel(&Timers, &c->timer);
+        c->state = CONNECTION_SCRIPT;
+        Scripts++;
+        return;
+    }
+
+    handle_request(r);
+    connection_staged(c);
+}
+
+/**
+ * Finish staging response.
+ *
+ * @param   c           Client connection.
+ **/
+void connection_staged(Connection *c) {
+    Request *r = c->request;
+
+    fclose(r->stream);
+    r->stream    = NULL;
+    c->state     = CONNECTION_WRITING;
+    c->responded = metrics_now();
+}
+
+/**
+ * Write staged response to client socket.
+ *
+ * @param   c           Client connection.
+ *
+ * This writes until the socket would block or the response is complete, first
+ * the staged data and then any response file (see send_response_file).  A
+ * completed response on a persistent connection resets the request and goes
+ * back to reading; otherwise (or while draining) the connection is marked
+ * closed.
+ **/
+void connection_write(Connection *c) {
+    Request *r = c->request;
+
+    int flags = MSG_NOSIGNAL | (response_file_pending(r) ? MSG_MORE : 0);
+
+    while (c->sent < c->length) {
+        ssize_t nwritten = request_send(r, c->response + c->sent, c->length - c->sent, flags);
+        if (nwritten >= 0) {
+            c->sent += nwritten;
+            r->nsent += nwritten;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+
+        c->state = CONNECTION_CLOSED;
+        return;
+    }
+
+    switch (send_response_file(r)) {
+        case 1:
+            return;
+        case -1:
+            c->state = CONNECTION_CLOSED;
+            return;
+    }
+
+    response_complete(r, c->responded);
+    c->responded = 0;
+
+    free(c->response);
+    c->response = NULL;
+    c->length   = 0;
+    c->sent     = 0;
+
+    if (r->keepalive && !reload_draining()) {
+        reset_request(r);
+        c->state  = CONNECTION_READING;
+        c->header = 0;
+        timer_set(&Timers, &c->timer, time(NULL) + KeepAliveTimeout);
+    } else {
+        c->state = CONNECTION_CLOSED;
+    }
+}
+
+/**
+ * Update deadline of connection that is waiting on its socket.
+ *
+ * @param   c           Client connection.
+ *
+ * While writing, the connection may stay idle for KeepAliveTimeout seconds
+ * after each write.  While reading, an idle persistent connection keeps the
+ * deadline it got when its last response was sent (KeepAliveTimeout); once
+ * a request starts arriving, the whole header must follow within
+ * RequestTimeout seconds, however slowly it trickles in.
+ **/
+void connection_schedule(Connection *c) {
+    Request *r   = c->request;
+    time_t   now = time(NULL);
+
+    if (c->state == CONNECTION_WRITING) {
+        timer_set(&Timers, &c->timer, now + KeepAliveTimeout);
+    } else if (!c->header && r->nread > r->offset) {
+        c->header = now;
+        timer_set(&Timers, &c->timer, now + RequestTimeout);
+    }
+}
+
+/**
+ * Close connections whose deadline has passed.
+ *
+ * A connection that did not send its request headers in time is answered
+ * with 408 first; idle connections are just closed.
+ **/
+void connection_expire(void) {
+    time_t now = time(NULL);
+    Timer *timer;
+
+    while ((timer = timer_expired(&Timers, now))) {
+        Connection *c = (Connection *)timer;
+
+        if (c->state == CONNECTION_READING && c->header)
+            response_abort(c->request, HTTP_STATUS_REQUEST_TIMEOUT);
+        connection_close(c);
+    }
+}
+
+/**
+ * Stop accepting connections and close idle ones.
+ *
+ * @param   sfd         Server socket file descriptor (closed along with the TLS
+ *                      one).
+ *
+ * Connections that are waiting for a request with nothing buffered are
+ * closed now.  Every other one finishes its current response and is then
+ * closed instead of kept alive (see connection_write).
+ **/
+void connection_drain(int sfd) {
+    Timer *next;
+
+    epoll_ctl(EventFD, EPOLL_CTL_DEL, sfd, NULL);
+    close(sfd);
+
+    if (TLSServer >= 0) {
+        epoll_ctl(EventFD, EPOLL_CTL_DEL, TLSServer, NULL);
+        close(TLSServer);
+        TLSServer = -1;
+    }
+
+    for (Timer *timer = timer_next(&Timers, NULL); timer; timer = next) {
+        Connection *c = (Connection *)timer;
+        Request    *r = c->request;
+
+        next = timer_next(&Timers, timer);
+        if (c->state == CONNECTION_READING && !c->header && r->nread <= r->offset)
+            connection_close(c);
+    }
+
+    log("Draining %zu connections", Timers.armed + Scripts);
+}
+
+/**
+ * Release client connection.
+ *
+ * @param   c           Client connection.
+ **/
+void connection_close(Connection *c) {
+    timer_cancel(&Timers, &c->timer);
+
+    /* Account for abandoned response */
+    if (c->responded)
+        response_complete(c->request, c->responded);
+
+    free(c->response);
+    free_request(c->request);
+    free(c);
+    metrics_connection(-1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
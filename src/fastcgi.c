@@ -0,0 +1,724 @@
+/* fastcgi.c: FastCGI Worker Pools */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FASTCGI_EXTENSION       ".fcgi" /* Scripts that speak FastCGI */
+#define FASTCGI_BACKLOG         128     /* Pending connections per pool */
+#define FASTCGI_MAX_CONTENT     65535   /* Largest record content */
+#define FASTCGI_CHECK_INTERVAL  1       /* Seconds between checks for exited workers */
+
+#define FCGI_VERSION_1          1
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_RESPONDER          1
+#define FCGI_REQUEST_ID         1       /* Each connection carries one request */
+
+/* FastCGI Record Header */
+
+typedef struct {
+    unsigned char version;
+    unsigned char type;
+    unsigned char request_id[2];        /*< Big-endian */
+    unsigned char content_length[2];    /*< Big-endian */
+    unsigned char padding_length;
+    unsigned char reserved;
+} FastCGIHeader;
+
+/* Worker Pool */
+
+typedef struct {
+    char               *path;           /*< Resolved path of script */
+    struct sockaddr_un  address;        /*< Socket workers accept on (in Directory) */
+    socklen_t           length;         /*< Length of address */
+    int                 listener;       /*< Socket workers accept on (kept for their replacements) */
+    pid_t              *workers;        /*< Worker processes (0 if not running) */
+} FastCGIPool;
+
+/* Internal Declarations */
+int          fastcgi_visit(const char *path, const struct stat *st, int type, struct FTW *ftw);
+int          fastcgi_spawn(FastCGIPool *pool, size_t index);
+pid_t        fastcgi_fork(FastCGIPool *pool);
+void         fastcgi_janitor(void);
+void         fastcgi_remove(void);
+void *       fastcgi_monitor(void *arg);
+FastCGIPool *fastcgi_pool(const char *path);
+int          fastcgi_write(int fd, int type, const void *data, size_t length);
+int          fastcgi_read(int fd, void *data, size_t length);
+char *       fastcgi_params(Request *r, size_t *length);
+int          fastcgi_stdin(Request *r, int fd, char *buffer);
+void         fastcgi_output(Request *r, const char *data, size_t length, bool *started);
+
+/* Internal Variables */
+static FastCGIPool *Pools  = NULL;      /* Pools by script (read-only once serving) */
+static size_t       NPools = 0;         /* Number of pools */
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;  /* Protects worker processes */
+static bool         Stopped = false;    /* Whether workers are no longer respawned */
+static sigset_t     Mask;               /* Signal mask workers start with */
+static char         Directory[PATH_MAX];    /* Private directory of pool sockets */
+
+/**
+ * Start a pool of FastCGI workers for every FastCGI script under RootPath.
+ *
+ * @return  Number of pools started (or -1 on error).
+ *
+ * Executable files ending in FASTCGI_EXTENSION each get FastCGIWorkers
+ * processes.  Following the FastCGI convention, every worker of a pool
+ * inherits the same listening unix socket as its standard input and accepts
+ * connections on it.  The sockets are bound in a new directory of TMPDIR that
+ * only the server's user may enter (mkdtemp makes it 0700), so no other user
+ * can connect to a worker and pass it a request of their own.  The directory
+ * is removed once the server exits (see fastcgi_janitor).
+ *
+ * Scripts are only looked for here: a FastCGI script added later is not
+ * served by a pool until the server is restarted (SIGUSR2 restarts it
+ * without dropping connections, see reload_start), and SIGHUP does not scan
+ * RootPath again.
+ *
+ * This must be called before the server starts, so that the pool table is
+ * shared by every server process and thread, and so that the workers are
+ * children of the main process (and die along with it).
+ *
+ * Workers that exit are respawned within FASTCGI_CHECK_INTERVAL seconds by a
+ * monitor thread of the main process (see fastcgi_monitor); meanwhile, new
+ * requests wait on the listening socket.  The thread blocks every signal, so
+ * the reload signals still reach the server (see reload_start).
+ **/
+int fastcgi_start(void) {
+    sigset_t  signals;
+    pthread_t thread;
+    int       status;
+
+    if (FastCGIWorkers <= 0) {
+        return 0;
+    }
+
+    const char *temporary = getenv("TMPDIR");
+    snprintf(Directory, sizeof(Directory), "%s/spidey-fastcgi-XXXXXX", temporary && *temporary ? temporary : P_tmpdir);
+    if (!mkdtemp(Directory)) {
+        fprintf(stderr, "Could Not Create FastCGI Socket Directory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    sigprocmask(SIG_SETMASK, NULL, &Mask);
+    if (nftw(RootPath, fastcgi_visit, 16, FTW_PHYS) < 0) {
+        fprintf(stderr, "Could Not Scan For FastCGI Scripts: %s\n", strerror(errno));
+        fastcgi_janitor();
+        return -1;
+    }
+
+    for (size_t i = 0; i < NPools; i++) {
+        log("Started %d FastCGI workers for %s", FastCGIWorkers, Pools[i].path);
+    }
+
+    fastcgi_janitor();
+    if (NPools) {
+        sigfillset(&signals);
+        pthread_sigmask(SIG_SETMASK, &signals, NULL);
+        if ((status = pthread_create(&thread, NULL, fastcgi_monitor, NULL)) != 0) {
+            fprintf(stderr, "Could Not Start FastCGI Monitor, Not Respawning Workers: %s\n", strerror(status));
+        } else {
+            pthread_detach(thread);
+        }
+        pthread_sigmask(SIG_SETMASK, &Mask, NULL);
+    }
+    return NPools;
+}
+
+/**
+ * Stop all FastCGI workers.
+ *
+ * Workers also receive SIGTERM when the main process dies, but a supervisor
+ * that waits for all of its children must stop them explicitly.
+ **/
+void fastcgi_stop(void) {
+    pthread_mutex_lock(&Lock);
+    Stopped = true;
+    for (size_t i = 0; i < NPools; i++) {
+        for (int w = 0; w < FastCGIWorkers; w++) {
+            if (Pools[i].workers[w] > 0) {
+                kill(Pools[i].workers[w], SIGTERM);
+            }
+        }
+    }
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Determine if script is served by a FastCGI worker pool.
+ *
+ * @param   path        Resolved path of script.
+ * @return  Whether or not a pool exists for path.
+ **/
+bool fastcgi_script(const char *path) {
+    return fastcgi_pool(path) != NULL;
+}
+
+/**
+ * Handle FastCGI request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP FastCGI request.
+ *
+ * This connects to the script's pool, sends the CGI variables as FCGI_PARAMS
+ * and the request body as FCGI_STDIN (see fastcgi_stdin), and then copies
+ * FCGI_STDOUT to the client until FCGI_END_REQUEST.  Output on FCGI_STDERR
+ * goes to the server log.
+ *
+ * Scripts normally send only CGI headers, so a status line is added for them
+ * (from a leading "Status:" header, if any).  Output that starts with its own
+ * status line is sent as is, like plain CGI output.
+ *
+ * If no worker can be reached or the script sends nothing, then handle error
+ * with HTTP_STATUS_INTERNAL_SERVER_ERROR (or HTTP_STATUS_REQUEST_TIMEOUT if
+ * the client stopped sending its body).
+ **/
+Status handle_fastcgi_request(Request *r) {
+    FastCGIPool *pool = fastcgi_pool(r->path);
+    char        *params;
+    size_t       length;
+    bool         started = false;
+    char         content[FASTCGI_MAX_CONTENT + 255];
+    int          fd;
+    int          status;
+
+    r->keepalive = false;
+
+    if (!pool || !(params = fastcgi_params(r, &length))) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Could Not Create FastCGI Socket: %s\n", strerror(errno));
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    if (connect(fd, (struct sockaddr *)&pool->address, pool->length) < 0) {
+        fprintf(stderr, "Could Not Connect To FastCGI Workers: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* Send request */
+    unsigned char begin[8] = { 0, FCGI_RESPONDER, 0 };
+    if (fastcgi_write(fd, FCGI_BEGIN_REQUEST, begin, sizeof(begin)) < 0) {
+        goto fail;
+    }
+    for (size_t offset = 0; offset < length; offset += FASTCGI_MAX_CONTENT) {
+        size_t chunk = length - offset < FASTCGI_MAX_CONTENT ? length - offset : FASTCGI_MAX_CONTENT;
+        if (fastcgi_write(fd, FCGI_PARAMS, params + offset, chunk) < 0) {
+            goto fail;
+        }
+    }
+    if (fastcgi_write(fd, FCGI_PARAMS, NULL, 0) < 0 || (status = fastcgi_stdin(r, fd, content)) < 0) {
+        goto fail;
+    }
+    if (status > 0) {
+        close(fd);
+        return HTTP_STATUS_REQUEST_TIMEOUT;
+    }
+
+    /* Copy response */
+    while (true) {
+        FastCGIHeader header;
+
+        if (fastcgi_read(fd, &header, sizeof(header)) < 0) {
+            fprintf(stderr, "FastCGI Response Ended Early\n");
+            break;
+        }
+
+        size_t clength = (header.content_length[0] << 8) | header.content_length[1];
+        if (fastcgi_read(fd, content, clength + header.padding_length) < 0) {
+            fprintf(stderr, "FastCGI Response Ended Early\n");
+            break;
+        }
+
+        if (header.type == FCGI_STDOUT) {
+            fastcgi_output(r, content, clength, &started);
+        } else if (header.type == FCGI_STDERR) {
+            fprintf(stderr, "%.*s", (int)clength, content);
+        } else if (header.type == FCGI_END_REQUEST) {
+            break;
+        }
+    }
+
+    close(fd);
+    return started ? HTTP_STATUS_OK : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+fail:
+    close(fd);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+/**
+ * Start pool for path if it is a FastCGI script (nftw callback).
+ **/
+int fastcgi_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    size_t length = strlen(path);
+    size_t elength = strlen(FASTCGI_EXTENSION);
+    char   resolved[PATH_MAX];
+
+    if (type != FTW_F || !S_ISREG(st->st_mode) || length <= elength ||
+        !streq(path + length - elength, FASTCGI_EXTENSION) || access(path, X_OK) < 0) {
+        return 0;
+    }
+
+    if (!realpath(path, resolved)) {
+        return 0;
+    }
+
+    FastCGIPool *pools = realloc(Pools, (NPools + 1) * sizeof(FastCGIPool));
+    if (!pools) {
+        return -1;
+    }
+    Pools = pools;
+
+    FastCGIPool *pool = &Pools[NPools];
+    memset(pool, 0, sizeof(FastCGIPool));
+    if (!(pool->path = strdup(resolved)) || !(pool->workers = calloc(FastCGIWorkers, sizeof(pid_t)))) {
+        free(pool->path);
+        return -1;
+    }
+
+    if (fastcgi_spawn(pool, NPools) < 0) {
+        free(pool->path);
+        free(pool->workers);
+        return 0;
+    }
+    NPools++;
+    return 0;
+}
+
+/**
+ * Spawn workers of pool.
+ *
+ * @param   pool        FastCGIPool structure (with path).
+ * @param   index       Index of pool (used to name its socket in Directory).
+ * @return  0 on success and -1 on error.
+ *
+ * The listening socket stays open in the main process, so that replacements
+ * of exited workers can inherit it (see fastcgi_monitor).
+ **/
+int fastcgi_spawn(FastCGIPool *pool, size_t index) {
+    int sfd;
+
+    pool->address.sun_family = AF_UNIX;
+    if (snprintf(pool->address.sun_path, sizeof(pool->address.sun_path), "%s/%zu", Directory, index) >= (int)sizeof(pool->address.sun_path)) {
+        fprintf(stderr, "Could Not Bind FastCGI Socket: Path Too Long\n");
+        return -1;
+    }
+    pool->length = offsetof(struct sockaddr_un, sun_path) + strlen(pool->address.sun_path) + 1;
+
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Could Not Create FastCGI Socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(sfd, (struct sockaddr *)&pool->address, pool->length) < 0 || listen(sfd, FASTCGI_BACKLOG) < 0) {
+        fprintf(stderr, "Could Not Bind FastCGI Socket: %s\n", strerror(errno));
+        close(sfd);
+        return -1;
+    }
+
+    pool->listener = sfd;
+    for (int i = 0; i < FastCGIWorkers; i++) {
+        if ((pool->workers[i] = fastcgi_fork(pool)) < 0) {
+            pool->workers[i] = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fork worker of pool.
+ *
+ * @param   pool        FastCGIPool structure (with listener).
+ * @return  Process identifier of worker (or -1 on error).
+ *
+ * Signals the server ignores or blocks meanwhile are reset, since both
+ * survive exec.
+ **/
+pid_t fastcgi_fork(FastCGIPool *pool) {
+    pid_t parent = getpid();
+    pid_t pid    = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* Workers must not outlive the server */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(EXIT_FAILURE);
+        }
+
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &Mask, NULL);
+
+        /* FCGI_LISTENSOCK_FILENO is standard input */
+        if (dup2(pool->listener, STDIN_FILENO) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+
+        char directory[PATH_MAX];
+        snprintf(directory, sizeof(directory), "%s", pool->path);
+        *strrchr(directory, '/') = '\0';
+        if (chdir(directory[0] ? directory : "/") < 0) {
+            _exit(EXIT_FAILURE);
+        }
+
+        execl(pool->path, pool->path, (char *)NULL);
+        fprintf(stderr, "Could Not Execute FastCGI Script %s: %s\n", pool->path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+/**
+ * Remove pool sockets and their directory once the main process exits.
+ *
+ * A child process waits for the main process to die (by whatever means, since
+ * PR_SET_PDEATHSIG signals it even if the server is killed) and then cleans
+ * up.  Every other signal is blocked, so that it does not die of a signal
+ * meant for the server.  Without any pools, the directory is removed now.
+ **/
+void fastcgi_janitor(void) {
+    pid_t    parent = getpid();
+    pid_t    pid;
+    sigset_t signals;
+    int      signum;
+
+    if (!NPools) {
+        fastcgi_remove();
+        return;
+    }
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return;
+    }
+
+    if (pid == 0) {
+        sigfillset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        for (size_t i = 0; i < NPools; i++) {
+            close(Pools[i].listener);
+        }
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        while (getppid() == parent) {
+            sigwait(&signals, &signum);
+        }
+
+        fastcgi_remove();
+        _exit(EXIT_SUCCESS);
+    }
+}
+
+/**
+ * Remove pool sockets and their directory.
+ **/
+void fastcgi_remove(void) {
+    for (size_t i = 0; i < NPools; i++) {
+        unlink(Pools[i].address.sun_path);
+    }
+    if (rmdir(Directory) < 0) {
+        fprintf(stderr, "Could Not Remove FastCGI Socket Directory %s: %s\n", Directory, strerror(errno));
+    }
+}
+
+/**
+ * Respawn workers that exit until the pools are stopped.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ *
+ * Like the prefork supervisor, this replaces exited workers at most once per
+ * FASTCGI_CHECK_INTERVAL, so a script that fails right away does not spin.
+ * Exited workers are reaped here, unless another waiter (ex. the prefork
+ * supervisor) or an ignored SIGCHLD (forking mode) did already.
+ **/
+void *fastcgi_monitor(void *arg) {
+    int status;
+
+    while (true) {
+        sleep(FASTCGI_CHECK_INTERVAL);
+
+        pthread_mutex_lock(&Lock);
+        for (size_t i = 0; i < NPools && !Stopped; i++) {
+            FastCGIPool *pool = &Pools[i];
+
+            for (int w = 0; w < FastCGIWorkers; w++) {
+                pid_t pid = pool->workers[w];
+
+                if (pid > 0 && waitpid(pid, &status, WNOHANG) == 0) {
+                    continue;
+                }
+                if (pid > 0) {
+                    log("FastCGI worker %d for %s exited, respawning", pid, pool->path);
+                }
+                if ((pool->workers[w] = fastcgi_fork(pool)) < 0) {
+                    pool->workers[w] = 0;
+                }
+            }
+        }
+        pthread_mutex_unlock(&Lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Find pool of script.
+ *
+ * @param   path        Resolved path of script.
+ * @return  FastCGIPool structure (or NULL if there is none).
+ **/
+FastCGIPool *fastcgi_pool(const char *path) {
+    for (size_t i = 0; i < NPools; i++) {
+        if (streq(Pools[i].path, path)) {
+            return &Pools[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write FastCGI record.
+ *
+ * @param   fd          Connection to worker.
+ * @param   type        Record type.
+ * @param   data        Record content.
+ * @param   length      Length of content (at most FASTCGI_MAX_CONTENT).
+ * @return  0 on success and -1 on error.
+ **/
+int fastcgi_write(int fd, int type, const void *data, size_t length) {
+    FastCGIHeader header = {
+        .version        = FCGI_VERSION_1,
+        .type           = type,
+        .request_id     = { 0, FCGI_REQUEST_ID },
+        .content_length = { length >> 8, length & 0xff },
+    };
+    struct iovec iov[] = {
+        { &header, sizeof(header) },
+        { (void *)data, length },
+    };
+    size_t total = sizeof(header) + length;
+
+    while (total > 0) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = 2 };
+        ssize_t nwritten = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Could Not Write FastCGI Record: %s\n", strerror(errno));
+            return -1;
+        }
+
+        total -= nwritten;
+        for (int i = 0; i < 2; i++) {
+            size_t n = (size_t)nwritten < iov[i].iov_len ? (size_t)nwritten : iov[i].iov_len;
+            iov[i].iov_base  = (char *)iov[i].iov_base + n;
+            iov[i].iov_len  -= n;
+            nwritten        -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read exactly length bytes from worker.
+ *
+ * @param   fd          Connection to worker.
+ * @param   data        Buffer to read into.
+ * @param   length      Number of bytes to read.
+ * @return  0 on success and -1 on error or end of file.
+ **/
+int fastcgi_read(int fd, void *data, size_t length) {
+    while (length > 0) {
+        ssize_t nread = read(fd, data, length);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return -1;
+        }
+        data    = (char *)data + nread;
+        length -= nread;
+    }
+    return 0;
+}
+
+/**
+ * Encode CGI variables of request as FastCGI name-value pairs.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   length      Where to store length of encoding.
+ * @return  Encoded pairs allocated from request arena (or NULL on error).
+ *
+ * Each name and value is preceded by its length, in one byte if it is under
+ * 128 and otherwise in four bytes with the high bit set.
+ **/
+char * fastcgi_params(Request *r, size_t *length) {
+    char  **environment = cgi_environment(r);
+    size_t  size = 0;
+    char   *params, *p;
+
+    if (!environment) {
+        return NULL;
+    }
+
+    for (char **e = environment; *e; e++) {
+        size += strlen(*e) - 1 + 8;
+    }
+    if (!(params = p = arena_alloc(&r->arena, size ? size : 1))) {
+        return NULL;
+    }
+
+    for (char **e = environment; *e; e++) {
+        const char *value = strchr(*e, '=') + 1;
+        size_t      lengths[2] = { value - 1 - *e, strlen(value) };
+
+        for (int i = 0; i < 2; i++) {
+            if (lengths[i] < 128) {
+                *p++ = lengths[i];
+            } else {
+                *p++ = (lengths[i] >> 24) | 0x80;
+                *p++ = lengths[i] >> 16;
+                *p++ = lengths[i] >> 8;
+                *p++ = lengths[i];
+            }
+        }
+        memcpy(p, *e, lengths[0]);
+        p += lengths[0];
+        memcpy(p, value, lengths[1]);
+        p += lengths[1];
+    }
+
+    *length = p - params;
+    return params;
+}
+
+/**
+ * Send request body to worker as FCGI_STDIN records.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Connection to worker.
+ * @param   buffer      Buffer of at least FASTCGI_MAX_CONTENT bytes.
+ * @return  0 on success, -1 if the worker cannot be written to, and 1 if the
+ * client stopped sending for BodyTimeout seconds.
+ *
+ * As in handle_cgi_request, the part of the body that is already buffered
+ * goes first, and the rest is forwarded as it arrives from the client.  A
+ * client that closes early just ends the body.  The whole body is sent before
+ * any output is read, as FastCGI responders read their input first.
+ **/
+int fastcgi_stdin(Request *r, int fd, char *buffer) {
+    const char *content_length = request_header(r, "Content-Length");
+    size_t      remaining = content_length ? strtoull(content_length, NULL, 10) : 0;
+    size_t      buffered  = r->nread - r->offset < remaining ? r->nread - r->offset : remaining;
+
+    for (size_t offset = 0; offset < buffered; offset += FASTCGI_MAX_CONTENT) {
+        size_t chunk = buffered - offset < FASTCGI_MAX_CONTENT ? buffered - offset : FASTCGI_MAX_CONTENT;
+        if (fastcgi_write(fd, FCGI_STDIN, r->buffer + r->offset + offset, chunk) < 0) {
+            return -1;
+        }
+    }
+    r->offset += buffered;
+    remaining -= buffered;
+
+    while (remaining > 0) {
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+
+        /* Body may already be decrypted, which polling does not show */
+        if (!tls_pending(r)) {
+            int ready = poll(&pfd, 1, BodyTimeout > 0 ? BodyTimeout * 1000 : -1);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                fprintf(stderr, "Request Body Timed Out\n");
+                return 1;
+            }
+            if (ready < 0) {
+                break;
+            }
+        }
+
+        ssize_t nread = request_recv(r, buffer, remaining < FASTCGI_MAX_CONTENT ? remaining : FASTCGI_MAX_CONTENT, 0);
+        if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        if (fastcgi_write(fd, FCGI_STDIN, buffer, nread) < 0) {
+            return -1;
+        }
+        remaining -= nread;
+    }
+
+    return fastcgi_write(fd, FCGI_STDIN, NULL, 0);
+}
+
+/**
+ * Copy FastCGI standard output to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Output data.
+ * @param   length      Length of data.
+ * @param   started     Whether the status line was already sent.
+ **/
+void fastcgi_output(Request *r, const char *data, size_t length, bool *started) {
+    if (!*started && length > 0) {
+        *started = true;
+
+        if (length >= 5 && strncmp(data, "HTTP/", 5) == 0) {
+            /* Script sent its own status line */
+        } else if (length > 7 && strncasecmp(data, "Status:", 7) == 0 && memchr(data, '\n', length)) {
+            const char *end    = memchr(data, '\n', length);
+            const char *status = data + 7 + strspn(data + 7, " \t");
+            int         slength = end - status;
+
+            if (slength > 0 && status[slength - 1] == '\r') {
+                slength--;
+            }
+            fprintf(r->stream, "HTTP/1.1 %.*s\r\n", slength, status);
+            length -= end + 1 - data;
+            data    = end + 1;
+        } else {
+            fprintf(r->stream, "HTTP/1.1 %s\r\n", http_status_string(HTTP_STATUS_OK));
+        }
+    }
+
+    fwrite(data, 1, length, r->stream);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
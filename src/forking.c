@@ -16,23 +16,56 @@
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Every child holds an admitted connection, so MaxConnections also caps the
+ * number of children.  Connections over the limits, or that no child could
+ * be forked for, are answered with 503 by the parent.
+ *
+ * On SIGQUIT, the parent stops accepting and exits, leaving the children to
+ * finish their connections.
  **/
 int forking_server(int sfd) {
+    /* Ignore children */
+    signal(SIGCHLD, SIG_IGN);
+
+    if (socket_nonblocking(sfd) < 0) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
     /* Accept and handle HTTP request */
-    while (true) {
+    while (!(reload_poll(sfd) & RELOAD_DRAIN)) {
     	/* Accept request */
-        Request *r = accept_request(sfd);
+        if (!reload_wait(sfd)) {
+            continue;
+        }
+
+        Request *r = accept_request(sfd, 0);
+        if (!r) {
+            continue;
+        }
+
+        if (!admission_acquire(r)) {
+            admission_reject(r);
+            free_request(r);
+            continue;
+        }
 
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
 	/* Fork off child process to handle request */
         pid_t pid = fork();
         if(pid == 0){
-            handle_request(r);
+            access_log_defer();
+            handle_connection(r);
             free_request(r);
             exit(EXIT_SUCCESS);
         }
+        else if(pid < 0){
+            fprintf(stderr, "Could Not Fork: %s\n", strerror(errno));
+            admission_reject(r);
+            free_request(r);
+        }
         else{
+            r->admission = 0;       /* The child releases its connection */
             free_request(r);
         }
     }
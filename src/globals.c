@@ -0,0 +1,32 @@
+/* globals.c: Global Variables */
+
+#include "spidey.h"
+
+/* Global Variables */
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+int   Workers	      = 0;
+int   Threads	      = 0;
+int   KeepAliveTimeout = 5;
+int   KeepAliveMax     = 100;
+size_t CacheSize       = 64 << 20;
+bool  Compression      = false;
+int   FastCGIWorkers   = 0;
+char *AccessLogPath    = NULL;
+AccessFormat AccessLogFormat = ACCESS_LOG_COMMON;
+int   AccessLogSample  = 1;
+int   MaxConnections   = 1024;
+int   MaxClientConnections = 0;
+int   ListenBacklog    = SOMAXCONN;
+int   RequestTimeout   = 10;
+int   BodyTimeout      = 30;
+size_t MaxBodySize     = 16 << 20;
+bool  Affinity         = false;
+char *TLSPort          = NULL;
+char *TLSCertificate   = NULL;
+char *TLSKey           = NULL;
+char *MetricsPath      = NULL;
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,19 +2,167 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define BROWSE_ITEM "<li><a href=\"%s/%s\">%s</a></li>\n"
+#define BROWSE_NEXT "<a href=\"?offset=%zu&amp;limit=%zu\">Next</a>\n"
+#define BROWSE_PAGE_SIZE 1000               /* Entries per page of listing by default */
+#define HTTP_DATE   "%a, %d %b %Y %H:%M:%S GMT"
+#define CGI_CHUNK_SIZE  (64 << 10)          /* Bytes of CGI output copied at a time */
+
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
+int    browse_read(Request *request, char ***names, size_t *n);
+CacheEntry *browse_cache(Request *request, const struct stat *st, char **names, size_t n);
+const char *browse_prefix(Request *request);
+size_t browse_render(char *body, const char *prefix, char **names, size_t first, size_t last, size_t n, bool json, bool paged);
+size_t browse_append(char *body, size_t offset, const char *format, ...) __attribute__((format(printf, 3, 4)));
+size_t browse_append_json(char *body, size_t offset, const char *s);
+int    browse_compare(const void *a, const void *b);
+const char *query_parameter(const char *query, const char *name);
 Status handle_file_request(Request *request);
+Status handle_range_request(Request *request, const struct stat *st, const char *mimetype, const Range *ranges, size_t n);
+Status handle_not_modified(Request *request, const struct stat *st, Encoding encoding, int variants);
 Status handle_cgi_request(Request *request);
+Status handle_metrics_request(Request *request);
+bool   request_metrics(Request *request);
 Status handle_error(Request *request, Status status);
+bool   request_fresh(Request *request, const struct stat *st, Encoding encoding);
+CacheEntry *request_cache_lookup(Request *request);
+int    request_ranges(Request *request, const struct stat *st, Range *ranges);
+bool   etag_matches(const char *list, const char *etag);
+void   format_etag(char *etag, size_t size, const struct stat *st, Encoding encoding);
+void   format_http_date(char *date, size_t size, time_t t);
+void   write_response_header(Request *request, Status status, const char *mimetype, size_t length);
+void   write_response_connection(Request *request);
+int    send_cache_entry(Request *request);
+
+/**
+ * Handle HTTP connection.
+ *
+ * @param   r           HTTP Request structure
+ *
+ * This handles requests on the connection until the client or a response
+ * asks for it to be closed, the connection has been idle for KeepAliveTimeout
+ * seconds, or KeepAliveMax requests have been served.  Pipelined requests are
+ * handled in order from the request input buffer.
+ *
+ * Responses are written to the socket stream (see open_request_stream).
+ *
+ * Since the worker serves nothing else meanwhile, a connection waiting for the
+ * next request is closed early once another connection is waiting for the
+ * worker (see wait_request).
+ *
+ * Reads from the socket time out after RequestTimeout seconds, so a stalled
+ * client cannot hold the server (see parse_request).
+ **/
+void    handle_connection(Request *r) {
+    struct timeval timeout = { .tv_sec = RequestTimeout };
+
+    if (!r->stream && open_request_stream(r) < 0)
+        return;
+
+    if (setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        fprintf(stderr, "Could Not Set Receive Timeout: %s\n", strerror(errno));
+
+    metrics_connection(1);
+
+    while (true) {
+        handle_request(r);
+
+        uint64_t start = metrics_now();
+        fflush(r->stream);
+        int sent = send_response_file(r);
+        response_complete(r, start);
+
+        if (sent < 0)
+            break;
+
+        if (!r->keepalive)
+            break;
+
+        reset_request(r);
+        if (!wait_request(r, KeepAliveTimeout * 1000))
+            break;
+    }
+
+    metrics_connection(-1);
+}
+
+/**
+ * Account for finished response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   start       Time sending the response started (see metrics_now).
+ *
+ * This is called once the response is sent (or abandoned), before the
+ * request is reset: it times the write stage, counts the status and bytes
+ * sent, and appends the access log entry.
+ **/
+void    response_complete(Request *r, uint64_t start) {
+    metrics_record(STAGE_WRITE, start);
+    metrics_status(r->status);
+    metrics_bytes(r->nsent);
+    access_log(r);
+}
+
+/**
+ * Answer connection with error response right away.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ *
+ * This sends the prebuilt response of the status (see error_page) in a single
+ * non-blocking write, whatever state the request is in, and accounts for it
+ * (see response_complete).  Input that already arrived is then discarded, so
+ * that closing the socket afterward does not reset the connection before the
+ * client reads the response.  The caller closes the connection.
+ **/
+void    response_abort(Request *r, Status status) {
+    uint64_t start = r->started = metrics_now();
+    CacheEntry *e  = error_page(status);
+    char buffer[BUFSIZ];
+
+    cache_release(r->entry);
+    r->keepalive   = false;
+    r->status      = status;
+    r->entry       = e;
+    r->file_offset = 0;
+    if(e){
+        struct iovec  iov[3];
+        ssize_t nsent = request_sendmsg(r, iov, response_entry_vector(r, iov), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if(nsent > 0)
+            r->nsent += nsent;
+    }
+
+    if(r->tls)
+        tls_shutdown(r);
+    shutdown(r->fd, SHUT_WR);
+    while(request_recv(r, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+
+    response_complete(r, start);
+}
 
 /**
  * Handle HTTP Request.
@@ -26,207 +174,1140 @@ Status handle_error(Request *request, Status status);
  * type, and then dispatches to the appropriate handler type.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * Each stage is timed (see metrics_record) and the status is kept in
+ * r->status for response_complete.  MetricsPath, if set, is answered with the
+ * metrics of the whole server (see request_metrics).
  **/
 Status  handle_request(Request *r) {
+    uint64_t start = r->started = metrics_now();
+    Stage    stage;
     Status result;
-    /* Parse request */
+    /* Parse request (the parser may have picked a more specific status) */
     if(parse_request(r) < 0){
-        result = HTTP_STATUS_BAD_REQUEST;       // We should double check these statuses if we're ever having trouble with valgrind later
+        result = r->status != HTTP_STATUS_OK ? r->status : HTTP_STATUS_BAD_REQUEST;
+        r->keepalive = false;
+        handle_error(r, result);
+        r->status = result;
+        return result;
+    }
+    start = metrics_record(STAGE_PARSE, start);
+
+    /* Request bodies are not read, so they cannot be skipped to reach the
+     * next request on the connection */
+    const char *content_length = request_header(r, "Content-Length");
+    size_t      body_length    = content_length ? strtoull(content_length, NULL, 10) : 0;
+    if(body_length > 0){
+        r->keepalive = false;
+    }
+
+    if(body_length > MaxBodySize){
+        result = HTTP_STATUS_PAYLOAD_TOO_LARGE;
         handle_error(r, result);
+        r->status = result;
         return result;
     }
 
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
+    if(request_metrics(r)){
+        result = handle_metrics_request(r);
+        r->status = result;
+        return result;
+    }
+
+    /* Determine request path (and its file type) */
+    mode_t mode;
+    r->path = determine_request_path(&r->arena, request_string(r, r->uri), &mode);
+    start   = metrics_record(STAGE_PATH, start);
     if(!(r->path)){
         result = HTTP_STATUS_NOT_FOUND;
         handle_error(r, result);
+        r->status = result;
         return result;
     }
 
     debug("HTTP REQUEST PATH: %s", r->path);
-    /* Dispatch to appropriate request handler type based on file type */
-    struct stat path_stat;
-    if( stat(r->path, &path_stat) < 0 ){
-        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+
+    /* Only scripts accept methods other than GET and HEAD */
+    const char *method = request_string(r, r->method);
+    if(!streq(method, "GET") && !streq(method, "HEAD") &&
+       (S_ISDIR(mode) || !(mode & (S_IXUSR | S_IXGRP | S_IXOTH)) || access(r->path, X_OK) < 0)){
+        result = HTTP_STATUS_METHOD_NOT_ALLOWED;
+        handle_error(r, result);
+        r->status = result;
+        return result;
     }
-    
-    if(S_ISDIR(path_stat.st_mode) == 1){
+
+    /* Serve hot files and full directory listings straight from the cache
+     * (unless only part of the file or another view of the listing is wanted) */
+    if(!request_header(r, "Range") && !(S_ISDIR(mode) && r->query.length) && (r->entry = request_cache_lookup(r))){
+        CacheEntry *e = r->entry;
+        struct stat entry_stat;
+        memset(&entry_stat, 0, sizeof(entry_stat));
+        entry_stat.st_ino   = e->inode;
+        entry_stat.st_size  = e->length;
+        entry_stat.st_mtim  = e->mtime;
+
+        if(request_fresh(r, &entry_stat, e->encoding)){
+            r->entry = NULL;
+            result = handle_not_modified(r, &entry_stat, e->encoding, e->variants);
+            cache_release(e);
+        } else {
+            result = HTTP_STATUS_OK;
+        }
+        debug("HTTP REQUEST STATUS: %s (cached)", http_status_string(result));
+        metrics_record(STAGE_CACHE, start);
+        r->status = result;
+        return result;
+    }
+
+    /* Dispatch to appropriate request handler type based on file type (only
+     * files with an execute bit need the access check for CGI) */
+    if(S_ISDIR(mode)){
+       stage  = STAGE_BROWSE;
        result = handle_browse_request(r);
        if(result != HTTP_STATUS_OK)
             handle_error(r, result);
     }
-    else if(access(r->path, X_OK) == 0){
-       result = handle_cgi_request(r);
+    else if((mode & (S_IXUSR | S_IXGRP | S_IXOTH)) && access(r->path, X_OK) == 0){
+       stage  = fastcgi_script(r->path) ? STAGE_FASTCGI : STAGE_CGI;
+       result = stage == STAGE_FASTCGI ? handle_fastcgi_request(r) : handle_cgi_request(r);
        if(result != HTTP_STATUS_OK)
            handle_error(r, result);
     }
-    else if(S_ISREG(path_stat.st_mode) == 1){
+    else if(S_ISREG(mode)){
+       /* 206, 304, and 416 responses are written by handle_file_request */
+       stage  = STAGE_FILE;
        result = handle_file_request(r);
-       if(result != HTTP_STATUS_OK)
+       if(result == HTTP_STATUS_NOT_FOUND || result == HTTP_STATUS_FORBIDDEN || result == HTTP_STATUS_INTERNAL_SERVER_ERROR)
            handle_error(r, result);
     }
     else{                                           // the else condition may be unnecessary here
+        stage  = STAGE_FILE;
         result = HTTP_STATUS_BAD_REQUEST;
         handle_error(r, result);
     }
 
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    debug("HTTP REQUEST STATUS: %s", http_status_string(result));
+    metrics_record(stage, start);
+    r->status = result;
 
     return result;
 }
 
+/**
+ * Determine if request is answered by a script.
+ *
+ * @param   r           HTTP Request structure (with its headers parsed).
+ * @return  Whether handle_request would run a CGI or FastCGI script for it.
+ *
+ * The event and io_uring loops hand such requests to script threads (see
+ * script_submit), since a script may take arbitrarily long to answer.
+ **/
+bool request_script(Request *r) {
+    mode_t mode;
+    char  *path;
+
+    if(r->state != PARSE_DONE || request_metrics(r))
+        return false;
+
+    path = determine_request_path(&r->arena, request_string(r, r->uri), &mode);
+    return path && S_ISREG(mode) && (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) && access(path, X_OK) == 0;
+}
+
 /**
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML or, with "format=json" in the
+ * query, as a JSON object.  Large directories may be fetched a page at a time
+ * with "offset=N" and "limit=N" (BROWSE_PAGE_SIZE entries by default).
+ *
+ * The sorted entry names and the full HTML listing are kept in the hot file
+ * cache, keyed by the directory's path and revalidated against its mtime, so
+ * repeated requests neither read nor sort the directory.  The full listing is
+ * then sent straight from the cache (see send_cache_entry); other views are
+ * rendered from the cached names into the request arena.  Links are made from
+ * the directory's path rather than the request URI (see browse_prefix), so
+ * the cached listing is right for every URI that resolves to the directory.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * with HTTP_STATUS_NOT_FOUND (or HTTP_STATUS_FORBIDDEN if it may not be read).
  **/
 Status  handle_browse_request(Request *r) {
-    struct dirent **entries;
-    int n;
-    
+    const char *query  = request_string(r, r->query);
+    const char *format = query_parameter(query, "format");
+    const char *offset = query_parameter(query, "offset");
+    const char *limit  = query_parameter(query, "limit");
+    const char *prefix = browse_prefix(r);
+    bool        json   = format && strncmp(format, "json", 4) == 0 && (!format[4] || format[4] == '&');
+    bool        paged  = offset || limit;
+    CacheEntry *e;
+    char      **names;
+    size_t      n;
+    struct stat st;
 
-    /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, 0, alphasort);
-    if(n < 0){
+    /* Status is taken before reading, so a concurrent change invalidates
+     * the cached listing */
+    if(stat(r->path, &st) < 0){
         return HTTP_STATUS_NOT_FOUND;
     }
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");                      // Looking at bui's code in lecture and the hints for the project, I think these are the only headers we need
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->stream, "<ul>\n");
-    for(int i = 0; i < n; i++){
-        if(!(streq(entries[i]->d_name, ".")) && !(streq(r->uri, "/"))){                              // Used to not print previous directory.  Changed based on bui's output
-            fprintf(r->stream, "<li><a href=\"%s/%s\">%s</a></li>\n", r->uri, entries[i]->d_name, entries[i]->d_name);    // using href now
-            free(entries[i]);
-        }
-        else if(streq(r->uri, "/")){
-            if(!streq(entries[i]->d_name, ".")){
-                fprintf(r->stream, "<li><a href=\"/%s\">%s</a></li>\n", entries[i]->d_name, entries[i]->d_name);
-                free(entries[i]);
-            }
-            else{
-                free(entries[i]);
-            }
-        }
-        else{
-            free(entries[i]);
-        }
+
+    if((e = cache_lookup(r->path, ENCODING_IDENTITY)) && !e->entries){
+        cache_release(e);
+        e = NULL;
     }
-    fprintf(r->stream, "</ul>\n");
-    
-    free(entries);
+
+    if(e){
+        names = e->entries;
+        n     = e->nentries;
+    } else {
+        if(browse_read(r, &names, &n) < 0)
+            return errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND;
+        e = browse_cache(r, &st, names, n);
+    }
+
+    /* Send full listing directly from cache */
+    if(e && !json && !paged){
+        r->entry = e;
+        return HTTP_STATUS_OK;
+    }
+
+    /* Select page of entries */
+    size_t first = offset ? strtoull(offset, NULL, 10) : 0;
+    size_t count = limit  ? strtoull(limit, NULL, 10)  : (paged ? BROWSE_PAGE_SIZE : n);
+    size_t last;
+    first = first < n ? first : n;
+    last  = count < n - first ? first + count : n;
+
+    /* Measure and then render listing so its Content-Length is known */
+    size_t length = browse_render(NULL, prefix, names, first, last, n, json, paged);
+    char  *body   = arena_alloc(&r->arena, length + 1);
+    if(body)
+        browse_render(body, prefix, names, first, last, n, json, paged);
+    cache_release(e);
+
+    if(!body){
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Write HTTP Header with OK Status and Content-Type, then listing */
+    write_response_header(r, HTTP_STATUS_OK, json ? "application/json" : "text/html", length);
+    if(!r->head)
+        fwrite(body, 1, length, r->stream);
 
     /* Return OK */
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Read and sort names of directory entries.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   names       Where to store array of names (allocated from arena).
+ * @param   n           Where to store number of names.
+ * @return  0 on success and -1 on error.
+ **/
+int     browse_read(Request *r, char ***names, size_t *n) {
+    size_t      capacity = 0;
+    DIR        *dir;
+    struct dirent *entry;
+
+    /* Open a directory for reading */
+    if(!(dir = opendir(r->path))){
+        return -1;
+    }
+
+    /* Collect entry names (except the directory itself) */
+    *names = NULL;
+    *n     = 0;
+    while((entry = readdir(dir))){
+        if(streq(entry->d_name, "."))
+            continue;
+
+        if(*n == capacity){
+            char **grown;
+            capacity = capacity ? capacity * 2 : 64;
+            if(!(grown = arena_alloc(&r->arena, capacity * sizeof(char *))))
+                goto fail;
+            if(*n)
+                memcpy(grown, *names, *n * sizeof(char *));
+            *names = grown;
+        }
+        if(!((*names)[(*n)++] = arena_strdup(&r->arena, entry->d_name)))
+            goto fail;
+    }
+    closedir(dir);
+
+    if(*n)
+        qsort(*names, *n, sizeof(char *), browse_compare);
+    return 0;
+
+fail:
+    closedir(dir);
+    return -1;
+}
+
+/**
+ * Render full listing of directory and insert it into cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   st          Status of directory.
+ * @param   names       Sorted entry names.
+ * @param   n           Number of names.
+ * @return  Referenced CacheEntry (or NULL if the listing was not cached).
+ *
+ * The names are packed with their pointers into one block, so the cached
+ * copy is a single allocation.
+ **/
+CacheEntry *browse_cache(Request *r, const struct stat *st, char **names, size_t n) {
+    const char *prefix = browse_prefix(r);
+    size_t      esize  = n * sizeof(char *);
+    size_t      length = browse_render(NULL, prefix, names, 0, n, n, false, false);
+    char      **entries;
+    char       *strings;
+    char       *body;
+
+    for(size_t i = 0; i < n; i++)
+        esize += strlen(names[i]) + 1;
+
+    if(!cache_fits(length + esize))
+        return NULL;
+
+    if(!(entries = malloc(esize ? esize : 1)) || !(body = malloc(length + 1))){
+        free(entries);
+        return NULL;
+    }
+
+    strings = (char *)(entries + n);
+    for(size_t i = 0; i < n; i++){
+        size_t size = strlen(names[i]) + 1;
+        entries[i]  = memcpy(strings, names[i], size);
+        strings    += size;
+    }
+    browse_render(body, prefix, entries, 0, n, n, false, false);
+
+    return cache_insert_listing(r->path, st, body, length, entries, n, esize);
+}
+
+/**
+ * Determine URI prefix of links in directory listing.
+ *
+ * @param   r           HTTP Request structure (with r->path resolved).
+ * @return  Canonical URI of directory, relative to RootPath and without
+ * trailing '/' (empty for RootPath itself).
+ *
+ * Unlike the request URI, this has no "." or ".." segments, repeated slashes,
+ * or symbolic links left in it.
+ **/
+const char *browse_prefix(Request *r) {
+    size_t      root = strlen(RootPath);
+    const char *prefix;
+
+    if(root && RootPath[root - 1] == '/')
+        root--;
+    prefix = r->path + root;
+    return streq(prefix, "/") ? "" : prefix;
+}
+
+/**
+ * Render directory listing.
+ *
+ * @param   body        Buffer to render into (or NULL to only measure).
+ * @param   prefix      URI of directory (without trailing '/', see browse_prefix).
+ * @param   names       Sorted entry names.
+ * @param   first       Index of first entry to list.
+ * @param   last        Index after last entry to list.
+ * @param   n           Total number of entries.
+ * @param   json        Whether to render JSON instead of HTML.
+ * @param   paged       Whether to link to the next page (HTML only).
+ * @return  Length of listing (excluding its terminating NUL).
+ **/
+size_t  browse_render(char *body, const char *prefix, char **names, size_t first, size_t last, size_t n, bool json, bool paged) {
+    size_t length = 0;
+
+    if(json){
+        length += browse_append(body, length, "{\"total\":%zu,\"offset\":%zu,\"entries\":[", n, first);
+        for(size_t i = first; i < last; i++){
+            length += browse_append(body, length, i > first ? ",\"" : "\"");
+            length += browse_append_json(body, length, names[i]);
+            length += browse_append(body, length, "\"");
+        }
+        length += browse_append(body, length, "]}\n");
+        return length;
+    }
+
+    length += browse_append(body, length, "<ul>\n");
+    for(size_t i = first; i < last; i++)
+        length += browse_append(body, length, BROWSE_ITEM, prefix, names[i], names[i]);
+    length += browse_append(body, length, "</ul>\n");
+
+    if(paged && last < n)
+        length += browse_append(body, length, BROWSE_NEXT, last, last - first);
+    return length;
+}
+
+/**
+ * Append formatted text to listing.
+ *
+ * @param   body        Listing buffer (or NULL to only measure).
+ * @param   offset      Current length of listing.
+ * @param   format      printf format string.
+ * @return  Number of characters appended.
+ **/
+size_t  browse_append(char *body, size_t offset, const char *format, ...) {
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = body ? vsprintf(body + offset, format, args) : vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    return length;
+}
+
+/**
+ * Append string to listing as JSON string contents.
+ *
+ * @param   body        Listing buffer (or NULL to only measure).
+ * @param   offset      Current length of listing.
+ * @param   s           String to escape.
+ * @return  Number of characters appended.
+ **/
+size_t  browse_append_json(char *body, size_t offset, const char *s) {
+    size_t length = 0;
+
+    for(const unsigned char *c = (const unsigned char *)s; *c; c++){
+        if(*c == '"' || *c == '\\')
+            length += browse_append(body, offset + length, "\\%c", *c);
+        else if(*c < 0x20)
+            length += browse_append(body, offset + length, "\\u%04x", *c);
+        else
+            length += browse_append(body, offset + length, "%c", *c);
+    }
+    return length;
+}
+
+/**
+ * Compare directory entry names (in the same order as alphasort).
+ *
+ * @param   a           Pointer to first name.
+ * @param   b           Pointer to second name.
+ * @return  Negative, zero, or positive as with strcoll.
+ **/
+int browse_compare(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Find parameter in query string.
+ *
+ * @param   query       Query string ("name=value&name=value").
+ * @param   name        Name of parameter.
+ * @return  Pointer to value of parameter in query (terminated by '&' or NUL),
+ * or NULL if it is not present.
+ **/
+const char *query_parameter(const char *query, const char *name) {
+    size_t length = strlen(name);
+
+    for(const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL){
+        if(strncmp(p, name, length) == 0 && p[length] == '=')
+            return p + length + 1;
+    }
+    return NULL;
+}
+
 /**
  * Handle file request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This opens the specified file and writes the response header, with the
+ * Content-Length taken from fstat of the open file.  The file itself is not copied here: it is
+ * recorded in r->file and sent afterward by send_response_file, straight from
+ * the file to the socket.
+ *
+ * HEAD requests get the same header (Content-Length and validators included)
+ * without the file.
+ *
+ * Small files are instead loaded into the hot file cache, and the cache entry
+ * (which carries its own header) is sent.
+ *
+ * For compressible mimetypes, a precompressed sibling (path.br or path.gz)
+ * accepted by the client is sent in place of the file.  Otherwise, if
+ * Compression is enabled and the file fits in the cache, it is compressed
+ * once into a cache entry of its own.
  *
  * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * HTTP_STATUS_NOT_FOUND (or HTTP_STATUS_FORBIDDEN if it may not be read).
  **/
 Status  handle_file_request(Request *r) {
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    const char *mimetype;
+    struct stat file_stat;
+    const struct stat *st = &file_stat;
+    int fd;
+
+    /* Open file for reading (its current size comes from the open file,
+     * since the resolved path may have been cached) */
+    fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND;
 
-    /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if(!fs)
+    if(fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)){
+        close(fd);
         return HTTP_STATUS_NOT_FOUND;
+    }
 
     /* Determine mimetype */
     mimetype = determine_mimetype(r->path);
-    if(!mimetype)
-        goto fail;
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n"); 
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);           
-    fprintf(r->stream, "\r\n");                                 // Separate file text and headers
+    /* Negotiate content coding (byte ranges always refer to the file itself) */
+    Encoding    encoding = ENCODING_IDENTITY;
+    int         variants = 0;
+    const char *source   = NULL;
+
+    if(mimetype_compressible(mimetype)){
+        int accepted = request_header(r, "Range") ? 0 : request_encodings(r);
+        int siblings = 0;
 
-    /* Read from file and write to socket in chunks */
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    while(nread > 0){
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+        for(int e = ENCODING_GZIP; e & ENCODING_ALL; e <<= 1){
+            struct stat sibling_stat;
+            char *sibling = arena_printf(&r->arena, "%s%s", r->path, encoding_extension(e));
+            if(sibling && stat(sibling, &sibling_stat) == 0 && S_ISREG(sibling_stat.st_mode))
+                siblings |= e;
+        }
+        variants = siblings | (Compression ? ENCODING_ALL : 0);
+
+        if((encoding = encoding_select(accepted & siblings))){
+            /* Switch to precompressed sibling */
+            char *sibling     = arena_printf(&r->arena, "%s%s", r->path, encoding_extension(encoding));
+            int   sibling_fd  = sibling ? open(sibling, O_RDONLY | O_CLOEXEC) : -1;
+            struct stat sibling_stat;
+
+            if(sibling_fd >= 0 && fstat(sibling_fd, &sibling_stat) == 0){
+                close(fd);
+                fd        = sibling_fd;
+                file_stat = sibling_stat;
+                source    = sibling;
+            } else {
+                if(sibling_fd >= 0)
+                    close(sibling_fd);
+                encoding = ENCODING_IDENTITY;
+            }
+        } else if(Compression && cache_fits(st->st_size)){
+            /* Compress on the fly into the cache */
+            encoding = encoding_select(accepted);
+        }
     }
 
-    /* Close file, deallocate mimetype, return OK */
-    free(mimetype);                     
-    fclose(fs);
+    /* Answer conditional requests the client's copy satisfies */
+    if(request_fresh(r, st, encoding)){
+        close(fd);
+        return handle_not_modified(r, st, encoding, variants);
+    }
+
+    /* Send only the requested byte ranges, if any */
+    Range ranges[REQUEST_MAX_RANGES];
+    int   nranges = request_ranges(r, st, ranges);
+    if(nranges < 0){
+        close(fd);
+        write_response_status(r->stream, HTTP_STATUS_RANGE_NOT_SATISFIABLE, "text/plain", 0);
+        fprintf(r->stream, "Content-Range: bytes */%lld\r\n", (long long)st->st_size);
+        write_response_connection(r);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+    if(nranges > 0){
+        r->file = fd;
+        return handle_range_request(r, st, mimetype, ranges, nranges);
+    }
+
+    /* Send from cache if the file fits */
+    if((r->entry = cache_insert(r->path, encoding, variants, source, fd, st, mimetype))){
+        close(fd);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Send file as is if it could not be compressed */
+    if(encoding != ENCODING_IDENTITY && !source){
+        encoding = ENCODING_IDENTITY;
+    }
+
+    /* Write HTTP Headers with OK status, determined Content-Type, and validators */
+    write_response_status(r->stream, HTTP_STATUS_OK, mimetype, st->st_size);
+    write_response_validators(r->stream, st, encoding, variants);
+    write_response_connection(r);
+
+    if(r->head){
+        close(fd);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Record file to send after header */
+    r->file        = fd;
+    r->file_offset = 0;
+    r->file_end    = st->st_size;
 
     return HTTP_STATUS_OK;
+}
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    if(fs){
-        fclose(fs);
+/**
+ * Handle byte range request.
+ *
+ * @param   r           HTTP Request structure (with r->file open).
+ * @param   st          Status of file.
+ * @param   mimetype    Content-Type of file.
+ * @param   ranges      Satisfiable ranges requested (see request_ranges).
+ * @param   n           Number of ranges.
+ * @return  Status of the HTTP range request.
+ *
+ * A single range is sent as the body of a 206 response with its
+ * Content-Range.  Several ranges are sent as a multipart/byteranges body: the
+ * delimiter and headers of every part are formatted into the request arena
+ * ahead of time, so the Content-Length is known and send_response_file can
+ * interleave them with the file ranges.
+ **/
+Status  handle_range_request(Request *r, const struct stat *st, const char *mimetype, const Range *ranges, size_t n) {
+    long long size = st->st_size;
+
+    if(n == 1){
+        write_response_status(r->stream, HTTP_STATUS_PARTIAL_CONTENT, mimetype, ranges[0].end - ranges[0].start);
+        fprintf(r->stream, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].start, (long long)ranges[0].end - 1, size);
+        write_response_validators(r->stream, st, ENCODING_IDENTITY, 0);
+        write_response_connection(r);
+        if(r->head)
+            goto head;
+
+        r->file_offset = ranges[0].start;
+        r->file_end    = ranges[0].end;
+        return HTTP_STATUS_PARTIAL_CONTENT;
+    }
+
+    static unsigned int Boundaries = 0;
+    char    boundary[32];
+    char   *content_type;
+    Range  *parts;
+    size_t  length = 0;
+
+    snprintf(boundary, sizeof(boundary), "%016llx%08x", (unsigned long long)st->st_ino ^ (unsigned long long)st->st_mtime,
+             __atomic_fetch_add(&Boundaries, 1, __ATOMIC_RELAXED));
+
+    if(!(parts = arena_alloc(&r->arena, (n + 1) * sizeof(Range))) ||
+       !(content_type = arena_printf(&r->arena, "multipart/byteranges; boundary=%s", boundary))){
+        goto fail;
     }
-    if(mimetype){
-        free(mimetype);
+
+    for(size_t i = 0; i < n; i++){
+        parts[i] = ranges[i];
+        parts[i].header = arena_printf(&r->arena,
+            "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+            boundary, mimetype, (long long)ranges[i].start, (long long)ranges[i].end - 1, size);
+        if(!parts[i].header)
+            goto fail;
+        parts[i].hlength = strlen(parts[i].header);
+        length += parts[i].hlength + (ranges[i].end - ranges[i].start);
+    }
+
+    /* The closing delimiter is a final part without any file data */
+    if(!(parts[n].header = arena_printf(&r->arena, "\r\n--%s--\r\n", boundary))){
+        goto fail;
     }
+    parts[n].hlength = strlen(parts[n].header);
+    parts[n].start   = parts[n].end = 0;
+    length += parts[n].hlength;
+
+    write_response_status(r->stream, HTTP_STATUS_PARTIAL_CONTENT, content_type, length);
+    write_response_validators(r->stream, st, ENCODING_IDENTITY, 0);
+    write_response_connection(r);
+    if(r->head)
+        goto head;
+
+    r->ranges      = parts;
+    r->nranges     = n + 1;
+    r->range       = 0;
+    r->range_sent  = 0;
+    r->file_offset = 0;
+    r->file_end    = 0;
+    return HTTP_STATUS_PARTIAL_CONTENT;
+
+head:
+    close(r->file);
+    r->file = -1;
+    return HTTP_STATUS_PARTIAL_CONTENT;
+
+fail:
+    close(r->file);
+    r->file = -1;
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
+/**
+ * Handle request whose cached copy is still current.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   st          Status of file.
+ * @param   encoding    Content coding of representation.
+ * @param   variants    Other content codings the file is available in.
+ * @return  HTTP_STATUS_NOT_MODIFIED.
+ *
+ * A 304 response has no body, but repeats the validators of the file.
+ **/
+Status  handle_not_modified(Request *r, const struct stat *st, Encoding encoding, int variants) {
+    fprintf(r->stream, "HTTP/1.1 %s\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED));
+    write_response_validators(r->stream, st, encoding, variants);
+    write_response_connection(r);
+    return HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * Send response file to client socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  0 when the file is sent (or there is none), 1 if the socket would
+ * block, and -1 on error.
+ *
+ * This must be called after the response header has been flushed.  It uses
+ * sendfile(2) so that file data goes from the page cache to the socket without
+ * a user-space copy, falling back to pread and send if sendfile is not
+ * supported for the file (or the TLS connection is not offloaded to kernel
+ * TLS, see request_sendfile).  Progress is kept in r->file_offset, so on a
+ * non-blocking socket this may be called again once the socket is writable.
+ *
+ * For multipart/byteranges responses, each part's delimiter and headers
+ * (r->ranges) are sent before its range of the file.
+ *
+ * When the file is finished, it is closed.
+ *
+ * Cache entries (r->entry) are sent by send_cache_entry instead.
+ **/
+int     send_response_file(Request *r) {
+    char buffer[BUFSIZ];
+    bool fallback = false;
+
+    if (r->entry) {
+        return send_cache_entry(r);
+    }
+
+    while (true) {
+        while (r->file >= 0 && r->file_offset < r->file_end) {
+            size_t  remaining = r->file_end - r->file_offset;
+            ssize_t nsent;
+
+            if (!fallback) {
+                off_t offset = r->file_offset;
+                nsent = request_sendfile(r, r->file, &offset, remaining);
+                if (nsent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    fallback = true;
+                    continue;
+                }
+            } else {
+                ssize_t nread = pread(r->file, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer), r->file_offset);
+                if (nread <= 0) {
+                    return -1;
+                }
+                bool more = (size_t)nread < remaining || r->range < r->nranges;
+                nsent = request_send(r, buffer, nread, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            }
+
+            if (nsent < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                return -1;
+            }
+
+            /* File was truncated while sending */
+            if (nsent == 0) {
+                return -1;
+            }
+
+            r->file_offset += nsent;
+            r->nsent += nsent;
+        }
+
+        if (r->range >= r->nranges) {
+            break;
+        }
+
+        /* Start next part of multipart response with its delimiter (held back
+         * to share segments with the part's file data) */
+        const Range *part = &r->ranges[r->range];
+        int flags = MSG_NOSIGNAL | (part->end > part->start ? MSG_MORE : 0);
+        while (r->range_sent < part->hlength) {
+            ssize_t nsent = request_send(r, part->header + r->range_sent, part->hlength - r->range_sent, flags);
+            if (nsent < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                return -1;
+            }
+            r->range_sent += nsent;
+            r->nsent += nsent;
+        }
+
+        r->file_offset = part->start;
+        r->file_end    = part->end;
+        r->range++;
+        r->range_sent  = 0;
+    }
+
+    if (r->file >= 0) {
+        close(r->file);
+        r->file = -1;
+    }
+    return 0;
+}
+
+/**
+ * Determine if response file data follows the response header.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether or not send_response_file has file data or parts left.
+ *
+ * Data sent before the file (the response header or an earlier chunk) is sent
+ * with MSG_MORE while this is true, so the kernel coalesces it with the file
+ * data into full TCP segments instead of pushing a short one first.  The last
+ * send of a response never has MSG_MORE, so nothing is left corked.
+ **/
+bool    response_file_pending(Request *r) {
+    return r->file >= 0 && (r->file_offset < r->file_end || r->range < r->nranges);
+}
+
+/**
+ * Send cache entry to client socket.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  0 when the entry is sent, 1 if the socket would block, and -1 on
+ * error.
+ *
+ * The pre-serialized header, the Connection header, and the file contents are
+ * sent with a single vectored write.  r->file_offset tracks progress through
+ * all three, so a partial write on a non-blocking socket can be resumed.
+ **/
+int     send_cache_entry(Request *r) {
+    struct iovec iov[3];
+    int n;
+
+    while ((n = response_entry_vector(r, iov)) > 0) {
+        ssize_t nsent = request_sendmsg(r, iov, n, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+        r->file_offset += nsent;
+        r->nsent += nsent;
+    }
+
+    return 0;
+}
+
+/**
+ * Describe unsent part of cache entry response.
+ *
+ * @param   r           HTTP Request structure (with r->entry set).
+ * @param   iov         Array of three iovecs to fill.
+ * @return  Number of iovecs filled (0 once the whole response is sent).
+ *
+ * The response is the entry's header, the Connection header, and the file
+ * contents (left out for HEAD requests); the first r->file_offset bytes of it
+ * are skipped.
+ **/
+int     response_entry_vector(Request *r, struct iovec *iov) {
+    CacheEntry *e = r->entry;
+    const char *connection = r->keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    struct iovec parts[] = {
+        { e->header,            e->hlength },
+        { (char *)connection,   strlen(connection) },
+        { e->data,              r->head ? 0 : e->size },
+    };
+    size_t skip = r->file_offset;
+    int    n = 0;
+
+    /* Skip parts already sent */
+    for (int i = 0; i < 3; i++) {
+        if (skip >= parts[i].iov_len) {
+            skip -= parts[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)parts[i].iov_base + skip;
+        iov[n].iov_len  = parts[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+
+    return n;
+}
+
 /**
  * Handle CGI request
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This spawns the specified executable directly (without a shell), with its
+ * own CGI environment block (see cgi_environment), and streams its output to
+ * the client in CGI_CHUNK_SIZE chunks.  Any request body (Content-Length
+ * bytes) is forwarded to the script's standard input, starting with the part
+ * already in the request buffer.  Forwarding the body and copying the output
+ * are multiplexed with poll, so a script that writes before it has read all
+ * of its input cannot deadlock with the server.  If the client sends none of
+ * the remaining body for BodyTimeout seconds, the script is killed and, unless
+ * it already started its response, handle error with
+ * HTTP_STATUS_REQUEST_TIMEOUT.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the script cannot be spawned or produces no output, then handle error
+ * with HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ *
+ * The script writes its own headers and its output length is unknown, so the
+ * connection is always closed afterward.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
+    const char *content_length = request_header(r, "Content-Length");
+    size_t      remaining = content_length ? strtoull(content_length, NULL, 10) : 0;
+    char       *argv[] = { r->path, NULL };
+    char      **environment;
+    int         input[2]  = { -1, -1 };     /* Script standard input (socket pair) */
+    int         output[2] = { -1, -1 };     /* Script standard output (pipe) */
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    pid_t       pid;
+    int         status;
+    bool        started = false;
+    bool        stalled = false;
+    char        body[CGI_CHUNK_SIZE];
+    char        buffer[CGI_CHUNK_SIZE];
 
-    /* Export CGI environment variables from request:
-     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    if(r->query)
-        setenv("QUERY_STRING", r->query, 1);
-    /* Export CGI environment variables from request headers */
-    setenv("SCRIPT_FILENAME", r->uri, 1);
-    setenv("REQUEST_METHOD", r->method, 1);
-    setenv("REMOTE_ADDR", r->host, 1);
-    setenv("REQUEST_URI", r->uri, 1);
-    setenv("REMOTE_PORT", r->port, 1);
-    setenv("DOCUMENT_ROOT", r->path, 1);
-    setenv("SERVER_PORT", r->port, 1);
-    setenv("HTTP_HOST", r->host, 1);
-    setenv("HTTP_USER_AGENT", r->uri, 1);
+    r->keepalive = false;
 
-    
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if(!pfs)
+    if(!(environment = cgi_environment(r)))
         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs)){
-        fputs(buffer, r->stream);
+
+    /* A socket pair lets body writes use MSG_NOSIGNAL if the script exits */
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, input) < 0 || pipe2(output, O_CLOEXEC) < 0){
+        fprintf(stderr, "Could Not Create CGI Pipes: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* Spawn script */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    if(r->fd > STDERR_FILENO)
+        posix_spawn_file_actions_addclose(&actions, r->fd);
+    posix_spawnattr_init(&attributes);          /* Scripts must not inherit the blocked reload signals */
+    posix_spawnattr_setsigmask(&attributes, reload_sigmask());
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+    status = posix_spawn(&pid, r->path, &actions, &attributes, argv, environment);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(input[1]);
+    close(output[1]);
+    input[1] = output[1] = -1;
+    if(status != 0){
+        fprintf(stderr, "Could Not Spawn CGI Script: %s\n", strerror(status));
+        goto fail;
+    }
+
+    /* Start with the part of the body that is already buffered */
+    char   *pending  = r->buffer + r->offset;
+    size_t  npending = r->nread - r->offset < remaining ? r->nread - r->offset : remaining;
+    r->offset += npending;
+    remaining -= npending;
+
+    while(true){
+        /* Script sees end of input once the whole body is forwarded */
+        if(!npending && !remaining && input[0] >= 0){
+            close(input[0]);
+            input[0] = -1;
+        }
+
+        struct pollfd fds[] = {
+            { output[0],                          POLLIN,  0 },
+            { npending ? input[0] : -1,           POLLOUT, 0 },
+            { !npending && remaining ? r->fd : -1, POLLIN,  0 },
+        };
+        bool decrypted = fds[2].fd >= 0 && tls_pending(r);  /* Body already read from socket */
+        int ready = poll(fds, 3, decrypted ? 0 : fds[2].fd >= 0 && BodyTimeout > 0 ? BodyTimeout * 1000 : -1);
+        if(ready < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(decrypted){
+            fds[2].revents = POLLIN;
+            ready++;
+        }
+
+        /* Only waiting on the client can time out */
+        if(ready == 0){
+            fprintf(stderr, "Request Body Timed Out\n");
+            kill(pid, SIGKILL);
+            stalled = true;
+            break;
+        }
+
+        /* Forward body to script */
+        if(fds[1].revents){
+            ssize_t nsent = send(input[0], pending, npending, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(nsent > 0){
+                pending  += nsent;
+                npending -= nsent;
+            } else if(nsent < 0 && errno != EAGAIN && errno != EINTR){
+                npending = remaining = 0;       /* Script stopped reading */
+            }
+        }
+
+        /* Read more of body from client */
+        if(fds[2].revents){
+            ssize_t nread = request_recv(r, body, remaining < sizeof(body) ? remaining : sizeof(body), 0);
+            if(nread > 0){
+                pending    = body;
+                npending   = nread;
+                remaining -= nread;
+            } else if(nread == 0 || (errno != EAGAIN && errno != EINTR)){
+                remaining  = 0;
+            }
+        }
+
+        /* Copy output to client */
+        if(fds[0].revents){
+            ssize_t nread = read(output[0], buffer, sizeof(buffer));
+            if(nread < 0 && errno == EINTR)
+                continue;
+            if(nread <= 0)
+                break;
+            started = true;
+
+            /* Chunks bypass the stream buffer of a socket stream */
+            if(fwrite(buffer, 1, nread, r->stream) < (size_t)nread)
+                break;                          /* Client went away */
+        }
+    }
+
+    if(input[0] >= 0)
+        close(input[0]);
+    close(output[0]);
+    while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+
+    if(started)
+        return HTTP_STATUS_OK;
+    return stalled ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+fail:
+    for(int i = 0; i < 2; i++){
+        if(input[i] >= 0)
+            close(input[i]);
+        if(output[i] >= 0)
+            close(output[i]);
     }
-    /* Close popen, return OK */
-    pclose(pfs);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+/**
+ * Build CGI environment of request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  NULL-terminated array of "NAME=value" strings allocated from the
+ * request arena (or NULL on error).
+ *
+ * http://en.wikipedia.org/wiki/Common_Gateway_Interface
+ *
+ * Every request header is passed as HTTP_<NAME> (uppercased, with '-' as
+ * '_'), along with CONTENT_LENGTH and CONTENT_TYPE for request bodies and
+ * HTTPS for TLS connections.
+ **/
+char ** cgi_environment(Request *r) {
+    const char *uri    = request_string(r, r->uri);
+    const char *query  = request_string(r, r->query);
+    const char *length = request_header(r, "Content-Length");
+    const char *type   = request_header(r, "Content-Type");
+    size_t      n = 0;
+    char      **environment = arena_alloc(&r->arena, (r->nheaders + 18) * sizeof(char *));
+
+    if(!environment)
+        return NULL;
+
+    environment[n++] = arena_printf(&r->arena, "GATEWAY_INTERFACE=CGI/1.1");
+    environment[n++] = arena_printf(&r->arena, "SERVER_SOFTWARE=spidey");
+    environment[n++] = arena_printf(&r->arena, "SERVER_PROTOCOL=%s", r->version.length ? request_string(r, r->version) : "HTTP/1.0");
+    environment[n++] = arena_printf(&r->arena, "SERVER_PORT=%s", r->tls ? TLSPort : Port);
+    if(r->tls)
+        environment[n++] = arena_printf(&r->arena, "HTTPS=on");
+    environment[n++] = arena_printf(&r->arena, "REQUEST_METHOD=%s", request_string(r, r->method));
+    environment[n++] = arena_printf(&r->arena, "REQUEST_URI=%s%s%s", uri, query[0] ? "?" : "", query);
+    environment[n++] = arena_printf(&r->arena, "SCRIPT_NAME=%s", uri);
+    environment[n++] = arena_printf(&r->arena, "SCRIPT_FILENAME=%s", r->path);
+    environment[n++] = arena_printf(&r->arena, "QUERY_STRING=%s", query);
+    environment[n++] = arena_printf(&r->arena, "DOCUMENT_ROOT=%s", RootPath);
+    environment[n++] = arena_printf(&r->arena, "REMOTE_ADDR=%s", request_host(r));
+    environment[n++] = arena_printf(&r->arena, "REMOTE_PORT=%s", request_port(r));
+    if(length)
+        environment[n++] = arena_printf(&r->arena, "CONTENT_LENGTH=%s", length);
+    if(type)
+        environment[n++] = arena_printf(&r->arena, "CONTENT_TYPE=%s", type);
+
+    for(size_t i = 0; i < r->nheaders; i++){
+        char *variable = arena_printf(&r->arena, "HTTP_%s=%s",
+            request_string(r, r->headers[i].name), request_string(r, r->headers[i].data));
+        if(!variable)
+            return NULL;
+        for(char *c = variable + 5; *c != '='; c++)
+            *c = *c == '-' ? '_' : toupper((unsigned char)*c);
+        environment[n++] = variable;
+    }
+
+    for(size_t i = 0; i < n; i++){
+        if(!environment[i])
+            return NULL;
+    }
+    environment[n] = NULL;
+    return environment;
+}
+
+/**
+ * Determine if request is for the metrics endpoint.
+ *
+ * @param   r           HTTP Request structure (with its URI parsed).
+ * @return  Whether the URI is MetricsPath (never, unless -x was given).
+ *
+ * The endpoint is opt-in since it is served on the public listener and takes
+ * precedence over any file at the same path.
+ **/
+bool    request_metrics(Request *r) {
+    return MetricsPath && streq(request_string(r, r->uri), MetricsPath);
+}
+
+/**
+ * Handle metrics request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP metrics request.
+ *
+ * This writes the metrics of all workers in the Prometheus text format (see
+ * metrics_write).  They are rendered into a memory stream first so that the
+ * Content-Length is known.
+ **/
+Status  handle_metrics_request(Request *r) {
+    char  *body;
+    size_t length;
+    FILE  *stream = open_memstream(&body, &length);
+
+    if(!stream){
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    metrics_write(stream);
+    fclose(stream);
+
+    write_response_header(r, HTTP_STATUS_OK, "text/plain; version=0.0.4", length);
+    if(!r->head)
+        fwrite(body, 1, length, r->stream);
+    free(body);
     return HTTP_STATUS_OK;
 }
 
@@ -236,23 +1317,313 @@ Status  handle_cgi_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP error request.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This sends the prebuilt response of the status (see load_error_pages), so
+ * that an error costs a single write and nothing is formatted per request.
+ * Statuses without one get an HTML message rendered on the spot.
  **/
 Status  handle_error(Request *r, Status status) {
-    const char *status_string = http_status_string(status);
-    /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
-    /* Write HTML Description of Error*/
-    fprintf(r->stream,"<html><body>");
-    fprintf(r->stream, "<h1><strong>%s</strong></h1><h2>Good Try!</h2>", status_string);
-    fprintf(r->stream, "<center><img src=\"https://www.dailydot.com/wp-content/uploads/2019/04/winnie-the-pooh-1024x512.jpg\"></center>");
-    fprintf(r->stream,"</html></body>");
+    CacheEntry *e = error_page(status);
+    char body[BUFSIZ];
+    size_t length;
+
+    if(e){
+        cache_release(r->entry);
+        r->entry       = e;
+        r->file_offset = 0;
+        return status;
+    }
+
+    /* Render HTML Description of Error */
+    length = error_page_render(body, sizeof(body), status);
+
+    /* Write HTTP Header and Description */
+    write_response_header(r, status, "text/html", length);
+    if(!r->head)
+        fwrite(body, 1, length, r->stream);
     
     /* Return specified status */
     return status;
 }
 
+/**
+ * Write HTTP response header.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body.
+ * @param   length      Content-Length of response body.
+ *
+ * This writes the status line and entity headers (see write_response_status)
+ * and the Connection header matching r->keepalive, followed by the blank line
+ * that ends the header.
+ **/
+void    write_response_header(Request *r, Status status, const char *mimetype, size_t length) {
+    write_response_status(r->stream, status, mimetype, length);
+    write_response_connection(r);
+}
+
+/**
+ * Write Connection header and end of HTTP response header.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+void    write_response_connection(Request *r) {
+    fputs(r->keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n", r->stream);
+}
+
+/**
+ * Write HTTP response status line and entity headers.
+ *
+ * @param   stream      Stream to write to.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body.
+ * @param   length      Content-Length of response body.
+ *
+ * This is the part of the response header that does not depend on the
+ * connection, so the hot file cache can serialize it ahead of time.
+ **/
+void    write_response_status(FILE *stream, Status status, const char *mimetype, size_t length) {
+    fprintf(stream, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n",
+            http_status_string(status), mimetype, length);
+}
+
+/**
+ * Write HTTP response validator and content coding headers of file.
+ *
+ * @param   stream      Stream to write to.
+ * @param   st          Status of file.
+ * @param   encoding    Content coding of representation.
+ * @param   variants    Other content codings the file is available in.
+ *
+ * This writes the ETag and Last-Modified headers that clients send back in
+ * conditional requests.  Unencoded files advertise support for byte ranges,
+ * and responses that depend on Accept-Encoding say so with Vary.
+ **/
+void    write_response_validators(FILE *stream, const struct stat *st, Encoding encoding, int variants) {
+    char etag[64];
+    char date[64];
+
+    const char *coding = encoding != ENCODING_IDENTITY ? encoding_name(encoding) : NULL;
+
+    format_etag(etag, sizeof(etag), st, encoding);
+    format_http_date(date, sizeof(date), st->st_mtime);
+    fprintf(stream, "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s", etag, date,
+            coding ? "Content-Encoding: " : "Accept-Ranges: bytes\r\n",
+            coding ? coding : "",
+            coding ? "\r\n" : "",
+            coding || variants ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/**
+ * Determine if client already has the current version of file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   st          Status of file.
+ * @param   encoding    Content coding of representation.
+ * @return  Whether or not a 304 response should be sent.
+ *
+ * If-None-Match takes precedence over If-Modified-Since (RFC 7232 6), and an
+ * unparseable date is ignored.
+ **/
+bool    request_fresh(Request *r, const struct stat *st, Encoding encoding) {
+    const char *if_none_match     = request_header(r, "If-None-Match");
+    const char *if_modified_since = request_header(r, "If-Modified-Since");
+
+    if(if_none_match){
+        char etag[64];
+        format_etag(etag, sizeof(etag), st, encoding);
+        return etag_matches(if_none_match, etag);
+    }
+
+    if(if_modified_since){
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if(strptime(if_modified_since, HTTP_DATE, &tm))
+            return st->st_mtime <= timegm(&tm);
+    }
+
+    return false;
+}
+
+/**
+ * Find best cached representation of requested file.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Referenced CacheEntry (or NULL if the file must be handled).
+ *
+ * Encoded entries are tried in order of preference.  An unencoded entry is
+ * passed over if the file has a variant the client accepts, so that the
+ * variant gets loaded (and is found here next time).
+ **/
+CacheEntry *request_cache_lookup(Request *r) {
+    int         accepted = request_encodings(r);
+    CacheEntry *e;
+
+    for(int remaining = accepted; remaining; ){
+        Encoding encoding = encoding_select(remaining);
+        if((e = cache_lookup(r->path, encoding)))
+            return e;
+        remaining &= ~encoding;
+    }
+
+    if((e = cache_lookup(r->path, ENCODING_IDENTITY)) && (e->variants & accepted)){
+        cache_release(e);
+        e = NULL;
+    }
+    return e;
+}
+
+/**
+ * Determine requested byte ranges of file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   st          Status of file.
+ * @param   ranges      Array of REQUEST_MAX_RANGES ranges to fill in.
+ * @return  Number of satisfiable ranges, 0 if the whole file should be sent,
+ * or -1 if no requested range can be satisfied.
+ *
+ * Range has the form "bytes=<first>-[<last>]" or "bytes=-<suffix length>",
+ * with several ranges separated by commas.  Per RFC 7233, a malformed Range
+ * (or one with more than REQUEST_MAX_RANGES ranges) is ignored, as is any
+ * Range whose If-Range does not match the current ETag or Last-Modified date.
+ **/
+int     request_ranges(Request *r, const struct stat *st, Range *ranges) {
+    const char *range    = request_header(r, "Range");
+    const char *if_range = request_header(r, "If-Range");
+    off_t       size     = st->st_size;
+    size_t      n = 0, seen = 0;
+
+    if(!range || strncasecmp(range, "bytes=", 6) != 0)
+        return 0;
+
+    if(if_range){
+        char validator[64];
+        if(if_range[0] == '"')
+            format_etag(validator, sizeof(validator), st, ENCODING_IDENTITY);
+        else
+            format_http_date(validator, sizeof(validator), st->st_mtime);
+        if(!streq(if_range, validator))
+            return 0;
+    }
+
+    for(const char *s = range + 6; *s; ){
+        long long first, last;
+        char *end;
+
+        /* Skip list separators and whitespace */
+        if(*s == ',' || *s == ' ' || *s == '\t'){
+            s++;
+            continue;
+        }
+
+        if(*s == '-'){
+            /* Suffix range: last <suffix length> bytes */
+            if(!isdigit((unsigned char)s[1]))
+                return 0;
+            errno = 0;
+            last = strtoll(s + 1, &end, 10);
+            if(errno)
+                return 0;
+            first = last < size ? size - last : 0;
+            last  = size - 1;
+        } else {
+            if(!isdigit((unsigned char)*s))
+                return 0;
+            errno = 0;
+            first = strtoll(s, &end, 10);
+            if(errno || *end != '-')
+                return 0;
+            if(isdigit((unsigned char)end[1])){
+                last = strtoll(end + 1, &end, 10);
+                if(errno || last < first)
+                    return 0;
+            } else {
+                end++;
+                last = size - 1;
+            }
+            if(last >= size)
+                last = size - 1;
+        }
+
+        s = end;
+        while(*s == ' ' || *s == '\t')
+            s++;
+        if(*s && *s != ',')
+            return 0;
+
+        /* Unsatisfiable ranges are dropped, but still count as requested */
+        seen++;
+        if(first < size && first <= last){
+            if(n == REQUEST_MAX_RANGES)
+                return 0;
+            ranges[n].header  = NULL;
+            ranges[n].hlength = 0;
+            ranges[n].start   = first;
+            ranges[n].end     = last + 1;
+            n++;
+        }
+    }
+
+    if(!seen)
+        return 0;
+    return n ? (int)n : -1;
+}
+
+/**
+ * Determine if entity tag is in list (using weak comparison).
+ *
+ * @param   list        Value of If-None-Match header.
+ * @param   etag        Current entity tag of file.
+ * @return  Whether or not list contains etag (or is "*").
+ **/
+bool    etag_matches(const char *list, const char *etag) {
+    size_t length = strlen(etag);
+
+    while(*list){
+        list += strspn(list, " \t,");
+        if(*list == '*')
+            return true;
+        if(strncmp(list, "W/", 2) == 0)
+            list += 2;
+
+        size_t token = strcspn(list, " \t,");
+        if(token == length && strncmp(list, etag, length) == 0)
+            return true;
+        list += token;
+    }
+    return false;
+}
+
+/**
+ * Format entity tag of file.
+ *
+ * @param   etag        Buffer to write quoted entity tag to.
+ * @param   size        Size of buffer.
+ * @param   st          Status of file.
+ * @param   encoding    Content coding of representation.
+ *
+ * The tag changes whenever the file is replaced, resized, or modified, and
+ * each content coding of the same file gets a distinct tag.
+ **/
+void    format_etag(char *etag, size_t size, const struct stat *st, Encoding encoding) {
+    const char *name = encoding_name(encoding);
+
+    snprintf(etag, size, "\"%llx-%llx-%llx%s%s\"", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size, (unsigned long long)st->st_mtime,
+             name ? "-" : "", name ? name : "");
+}
+
+/**
+ * Format time as HTTP date (RFC 7231 7.1.1.1).
+ *
+ * @param   date        Buffer to write date to.
+ * @param   size        Size of buffer.
+ * @param   t           Time to format.
+ **/
+void    format_http_date(char *date, size_t size, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(date, size, HTTP_DATE, &tm);
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
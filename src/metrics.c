@@ -0,0 +1,259 @@
+/* metrics.c: Server Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define METRICS_SLOTS       32          /* Number of counter stripes */
+#define METRICS_SUBBUCKETS  4           /* Histogram buckets per power of two */
+#define METRICS_BUCKETS     96          /* Histogram buckets (the last one has no bound) */
+
+/* Counters */
+
+typedef struct {
+    uint64_t    buckets[STAGE_COUNT][METRICS_BUCKETS];  /*< Observations by microsecond bucket */
+    uint64_t    sums[STAGE_COUNT];                      /*< Sum of observations in nanoseconds */
+    uint64_t    statuses[HTTP_STATUS_COUNT];            /*< Responses by status */
+    uint64_t    bytes;                                  /*< Bytes sent to clients */
+    int64_t     connections;                            /*< Connections opened - closed */
+} __attribute__((aligned(64))) MetricsSlot;
+
+typedef struct {
+    MetricsSlot slots[METRICS_SLOTS];   /*< Counter stripes */
+    unsigned    next;                   /*< Next stripe to hand out */
+} MetricsBlock;
+
+/* Internal Declarations */
+MetricsSlot *metrics_slot(void);
+size_t  metrics_bucket(uint64_t microseconds);
+double  metrics_bound(size_t bucket);
+
+/* Internal Variables */
+static MetricsBlock *Metrics = NULL;                /* Shared by every worker */
+static __thread MetricsSlot *Slot = NULL;           /* Stripe of calling thread */
+
+static const char *StageNames[STAGE_COUNT] = {
+    [STAGE_ACCEPT]  = "accept",
+    [STAGE_PARSE]   = "parse",
+    [STAGE_PATH]    = "path",
+    [STAGE_CACHE]   = "cache",
+    [STAGE_FILE]    = "file",
+    [STAGE_BROWSE]  = "browse",
+    [STAGE_CGI]     = "cgi",
+    [STAGE_FASTCGI] = "fastcgi",
+    [STAGE_WRITE]   = "write",
+};
+
+/**
+ * Allocate shared metrics counters.
+ *
+ * @return  0 on success and -1 on error.
+ *
+ * The counters live in an anonymous shared mapping, so this must be called
+ * before any worker processes are forked for them to report into the same
+ * counters.  Until it is called, recording metrics does nothing.
+ **/
+int metrics_start(void) {
+    void *block = mmap(NULL, sizeof(MetricsBlock), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (block == MAP_FAILED) {
+        fprintf(stderr, "Could Not Map Metrics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Metrics = block;
+    return 0;
+}
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record time spent in request stage.
+ *
+ * @param   stage       Request stage.
+ * @param   start       Time stage started (from metrics_now).
+ * @return  Current time (so that the next stage can start from it).
+ **/
+uint64_t metrics_record(Stage stage, uint64_t start) {
+    uint64_t     now = metrics_now();
+    MetricsSlot *s   = metrics_slot();
+
+    if (s) {
+        uint64_t elapsed = now - start;
+        __atomic_fetch_add(&s->buckets[stage][metrics_bucket(elapsed / 1000)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->sums[stage], elapsed, __ATOMIC_RELAXED);
+    }
+    return now;
+}
+
+/**
+ * Count response status.
+ *
+ * @param   status      HTTP Status of response.
+ **/
+void metrics_status(Status status) {
+    MetricsSlot *s = metrics_slot();
+
+    if (s && status < HTTP_STATUS_COUNT) {
+        __atomic_fetch_add(&s->statuses[status], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Count bytes sent to client.
+ *
+ * @param   bytes       Number of bytes.
+ **/
+void metrics_bytes(size_t bytes) {
+    MetricsSlot *s = metrics_slot();
+
+    if (s) {
+        __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Count connection being opened (1) or closed (-1).
+ *
+ * @param   delta       Change in number of active connections.
+ **/
+void metrics_connection(int delta) {
+    MetricsSlot *s = metrics_slot();
+
+    if (s) {
+        __atomic_fetch_add(&s->connections, delta, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Write metrics in Prometheus text exposition format.
+ *
+ * @param   stream      Stream to write to.
+ *
+ * Every stripe is summed, so the totals cover all workers.  Stage durations
+ * are cumulative histograms with le bounds in seconds.
+ **/
+void metrics_write(FILE *stream) {
+    MetricsSlot total;
+
+    memset(&total, 0, sizeof(total));
+    if (Metrics) {
+        for (size_t i = 0; i < METRICS_SLOTS; i++) {
+            MetricsSlot *s = &Metrics->slots[i];
+
+            for (size_t stage = 0; stage < STAGE_COUNT; stage++) {
+                for (size_t b = 0; b < METRICS_BUCKETS; b++)
+                    total.buckets[stage][b] += __atomic_load_n(&s->buckets[stage][b], __ATOMIC_RELAXED);
+                total.sums[stage] += __atomic_load_n(&s->sums[stage], __ATOMIC_RELAXED);
+            }
+            for (size_t status = 0; status < HTTP_STATUS_COUNT; status++)
+                total.statuses[status] += __atomic_load_n(&s->statuses[status], __ATOMIC_RELAXED);
+            total.bytes       += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+            total.connections += __atomic_load_n(&s->connections, __ATOMIC_RELAXED);
+        }
+    }
+
+    fprintf(stream, "# HELP spidey_stage_duration_seconds Time spent in each request stage.\n");
+    fprintf(stream, "# TYPE spidey_stage_duration_seconds histogram\n");
+    for (size_t stage = 0; stage < STAGE_COUNT; stage++) {
+        uint64_t count = 0;
+
+        for (size_t b = 0; b < METRICS_BUCKETS - 1; b++) {
+            count += total.buckets[stage][b];
+            fprintf(stream, "spidey_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    StageNames[stage], metrics_bound(b), (unsigned long long)count);
+        }
+        count += total.buckets[stage][METRICS_BUCKETS - 1];
+        fprintf(stream, "spidey_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", StageNames[stage], (unsigned long long)count);
+        fprintf(stream, "spidey_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", StageNames[stage], total.sums[stage] / 1e9);
+        fprintf(stream, "spidey_stage_duration_seconds_count{stage=\"%s\"} %llu\n", StageNames[stage], (unsigned long long)count);
+    }
+
+    fprintf(stream, "# HELP spidey_responses_total Responses by status code.\n");
+    fprintf(stream, "# TYPE spidey_responses_total counter\n");
+    for (size_t status = 0; status < HTTP_STATUS_COUNT; status++) {
+        const char *string = http_status_string(status);
+        if (string) {
+            fprintf(stream, "spidey_responses_total{code=\"%.3s\"} %llu\n", string, (unsigned long long)total.statuses[status]);
+        }
+    }
+
+    fprintf(stream, "# HELP spidey_sent_bytes_total Bytes sent to clients.\n");
+    fprintf(stream, "# TYPE spidey_sent_bytes_total counter\n");
+    fprintf(stream, "spidey_sent_bytes_total %llu\n", (unsigned long long)total.bytes);
+
+    fprintf(stream, "# HELP spidey_connections Active client connections.\n");
+    fprintf(stream, "# TYPE spidey_connections gauge\n");
+    fprintf(stream, "spidey_connections %lld\n", (long long)total.connections);
+}
+
+/**
+ * Return counter stripe of calling thread.
+ *
+ * @return  MetricsSlot structure (or NULL if metrics are not started).
+ *
+ * Threads are handed stripes in turn, so threads of the same process rarely
+ * share cache lines.  Forked processes keep their parent's stripe; since all
+ * updates are atomic, sharing one only costs contention.
+ **/
+MetricsSlot *metrics_slot(void) {
+    if (!Slot && Metrics) {
+        Slot = &Metrics->slots[__atomic_fetch_add(&Metrics->next, 1, __ATOMIC_RELAXED) % METRICS_SLOTS];
+    }
+    return Slot;
+}
+
+/**
+ * Determine histogram bucket of observation.
+ *
+ * @param   microseconds    Observed duration.
+ * @return  Bucket index.
+ *
+ * Buckets are log-linear (as in HDR histograms): values below
+ * METRICS_SUBBUCKETS get a bucket each, and every following power of two is
+ * split into METRICS_SUBBUCKETS equal buckets.
+ **/
+size_t metrics_bucket(uint64_t microseconds) {
+    if (microseconds < METRICS_SUBBUCKETS) {
+        return microseconds;
+    }
+
+    size_t magnitude = 63 - __builtin_clzll(microseconds);   /* >= 2 */
+    size_t sub       = (microseconds >> (magnitude - 2)) & (METRICS_SUBBUCKETS - 1);
+    size_t bucket    = (magnitude - 1) * METRICS_SUBBUCKETS + sub;
+
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/**
+ * Return upper bound of histogram bucket in seconds.
+ *
+ * @param   bucket      Bucket index (less than METRICS_BUCKETS - 1).
+ * @return  Smallest duration above every value counted in bucket.
+ **/
+double metrics_bound(size_t bucket) {
+    if (bucket < METRICS_SUBBUCKETS) {
+        return (bucket + 1) / 1e6;
+    }
+
+    size_t   magnitude = bucket / METRICS_SUBBUCKETS + 1;
+    size_t   sub       = bucket % METRICS_SUBBUCKETS;
+    uint64_t width     = 1ULL << (magnitude - 2);
+
+    return ((1ULL << magnitude) + (sub + 1) * width) / 1e6;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
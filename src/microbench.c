@@ -0,0 +1,302 @@
+/* microbench.c: Spidey Library Microbenchmarks */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MICROBENCH_TIME     0.25        /* Seconds each benchmark runs for */
+#define MICROBENCH_BATCH    256         /* Operations between clock reads */
+#define MICROBENCH_DEPTH    16          /* Depth of generated directory tree */
+#define MICROBENCH_FILES    4096        /* Number of files at bottom of tree */
+
+/* Request Corpus */
+
+static const char *Corpus[] = {
+    /* curl */
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    /* Browser navigation */
+    "GET /docs/guide/getting-started.html?lang=en&theme=dark HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.example.com/docs/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=6f1c3a0e9b2d4c7a8e5f; theme=dark; _ga=GA1.2.1234567890.1697040000\r\n"
+    "If-None-Match: \"2d4c7a-1a2b-6523f1c0\"\r\n"
+    "If-Modified-Since: Mon, 09 Oct 2023 12:00:00 GMT\r\n"
+    "\r\n",
+
+    /* Asset fetch behind a proxy */
+    "GET /static/js/app.3f2a9c.js HTTP/1.1\r\n"
+    "Host: cdn.example.com\r\n"
+    "X-Forwarded-For: 203.0.113.7, 198.51.100.23\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: br\r\n"
+    "Range: bytes=0-65535\r\n"
+    "\r\n",
+
+    /* HTTP/1.0 */
+    "GET /cgi-bin/search.cgi?q=spidey HTTP/1.0\r\n"
+    "\r\n",
+};
+
+/* Mimetype Extensions */
+
+static const char *Paths[] = {
+    "/www/index.html", "/www/style.css", "/www/app.js", "/www/logo.png",
+    "/www/photo.JPEG", "/www/data.json", "/www/archive.tar.gz", "/www/font.woff2",
+    "/www/video.mp4", "/www/README", "/www/notes.unknownext", "/www/dir.d/Makefile",
+};
+
+/* Benchmark Results */
+
+typedef struct {
+    size_t  operations;                 /*< Number of operations timed */
+    double  seconds;                    /*< Elapsed time */
+    size_t  allocations;                /*< Number of allocations during operations */
+} Result;
+
+typedef void (*Benchmark)(size_t i);
+
+/* Internal Declarations */
+void    microbench_run(const char *name, Benchmark benchmark);
+void    microbench_parse(size_t i);
+void    microbench_mimetype(size_t i);
+void    microbench_path_hot(size_t i);
+void    microbench_path_cold(size_t i);
+void    microbench_status(size_t i);
+int     microbench_tree(const char *root);
+int     microbench_remove(const char *path, const struct stat *st, int type, struct FTW *ftw);
+double  microbench_now(void);
+
+/* Internal Variables */
+static size_t   Allocations = 0;        /* Number of malloc, calloc, and realloc calls */
+static Request  Parsed;                 /* Request parsed by microbench_parse */
+static Arena    Scratch;                /* Arena for resolved paths */
+static char     Uris[MICROBENCH_FILES][256];    /* URIs of files in tree */
+
+/* Allocation Counting
+ *
+ * These interpose on the C library allocator (including its own internal
+ * calls, as from strdup or open_memstream) for the whole process.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    Allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    Allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    Allocations++;
+    return __libc_realloc(p, size);
+}
+
+/**
+ * Run library microbenchmarks.
+ *
+ * Each benchmark is timed for MICROBENCH_TIME seconds and reported in
+ * nanoseconds and allocations per operation.
+ *
+ * The library logs to stderr (unless it was built with -DNDEBUG), so stderr
+ * is sent to /dev/null; logging is still included in the timings.
+ **/
+int main(int argc, char *argv[]) {
+    char root[] = "/tmp/spidey-microbench.XXXXXX";
+    char resolved[PATH_MAX];
+
+    if (argc > 1) {
+        MimeTypesPath = argv[1];
+    }
+
+    if (!mkdtemp(root) || microbench_tree(root) < 0 || !realpath(root, resolved)) {
+        fprintf(stderr, "Could Not Generate Directory Tree: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    RootPath    = resolved;
+    Parsed.file = -1;
+
+    if (load_mimetypes(MimeTypesPath) < 0) {
+        fprintf(stderr, "Could Not Load %s\n", MimeTypesPath);
+    }
+
+    if (!freopen("/dev/null", "w", stderr)) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %12s %10s %10s\n", "Benchmark", "Operations", "ns/op", "allocs/op");
+    microbench_run("parse_request", microbench_parse);
+    microbench_run("determine_mimetype", microbench_mimetype);
+    microbench_run("determine_request_path", microbench_path_hot);
+    microbench_run("determine_request_path*", microbench_path_cold);
+    microbench_run("http_status_string", microbench_status);
+    printf("(* every lookup misses the path cache)\n");
+
+    arena_free(&Scratch);
+    nftw(root, microbench_remove, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Time benchmark and print its result.
+ *
+ * @param   name        Name of benchmark.
+ * @param   benchmark   Function performing operation i.
+ **/
+void microbench_run(const char *name, Benchmark benchmark) {
+    Result result = { 0, 0, 0 };
+    double start;
+
+    /* Warm up (fills caches and tables) */
+    for (size_t i = 0; i < MICROBENCH_FILES; i++) {
+        benchmark(i);
+    }
+
+    size_t allocations = Allocations;
+    start = microbench_now();
+    while (result.seconds < MICROBENCH_TIME) {
+        for (size_t i = 0; i < MICROBENCH_BATCH; i++) {
+            benchmark(result.operations + i);
+        }
+        result.operations += MICROBENCH_BATCH;
+        result.seconds     = microbench_now() - start;
+    }
+    result.allocations = Allocations - allocations;
+
+    printf("%-24s %12zu %10.1f %10.2f\n", name, result.operations,
+           result.seconds * 1e9 / result.operations,
+           (double)result.allocations / result.operations);
+}
+
+/**
+ * Parse request i of corpus (from the request input buffer).
+ **/
+void microbench_parse(size_t i) {
+    const char *input  = Corpus[i % (sizeof(Corpus) / sizeof(Corpus[0]))];
+    size_t      length = strlen(input);
+
+    reset_request(&Parsed);
+    memcpy(Parsed.buffer, input, length);
+    Parsed.nread = length;
+    parse_request_input(&Parsed);
+}
+
+/**
+ * Determine mimetype of path i.
+ **/
+void microbench_mimetype(size_t i) {
+    determine_mimetype(Paths[i % (sizeof(Paths) / sizeof(Paths[0]))]);
+}
+
+/**
+ * Resolve the same deep URI repeatedly (served by the path cache).
+ **/
+void microbench_path_hot(size_t i) {
+    mode_t mode;
+    arena_reset(&Scratch);
+    determine_request_path(&Scratch, Uris[0], &mode);
+}
+
+/**
+ * Resolve different deep URIs in turn (more URIs than path cache slots).
+ **/
+void microbench_path_cold(size_t i) {
+    mode_t mode;
+    arena_reset(&Scratch);
+    determine_request_path(&Scratch, Uris[(i * 7919) % MICROBENCH_FILES], &mode);
+}
+
+/**
+ * Look up every status string in turn.
+ **/
+void microbench_status(size_t i) {
+    http_status_string(i % HTTP_STATUS_COUNT);
+}
+
+/**
+ * Generate deep directory tree and record the URIs of its files.
+ *
+ * @param   root        Path to empty directory.
+ * @return  0 on success and -1 on error.
+ *
+ * The tree is MICROBENCH_DEPTH directories deep, with MICROBENCH_FILES files
+ * at the bottom.
+ **/
+int microbench_tree(const char *root) {
+    char path[PATH_MAX];
+    char uri[192] = "";
+    size_t length = 0;
+
+    for (int depth = 0; depth < MICROBENCH_DEPTH; depth++) {
+        length += snprintf(uri + length, sizeof(uri) - length, "/level-%02d", depth);
+        snprintf(path, sizeof(path), "%s%s", root, uri);
+        if (mkdir(path, 0755) < 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < MICROBENCH_FILES; i++) {
+        snprintf(Uris[i], sizeof(Uris[i]), "%s/file-%04d.html", uri, i);
+        snprintf(path, sizeof(path), "%s%s", root, Uris[i]);
+
+        FILE *fs = fopen(path, "w");
+        if (!fs) {
+            return -1;
+        }
+        fclose(fs);
+    }
+    return 0;
+}
+
+/**
+ * Remove file or directory (nftw callback).
+ **/
+int microbench_remove(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+/**
+ * Return monotonic time in seconds.
+ **/
+double microbench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,228 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Internal Declarations */
+pid_t prefork_spawn(const int *listeners, int nworkers, int index);
+void  prefork_signal(int signum);
+
+/* Internal Variables */
+static volatile sig_atomic_t Terminate = 0;
+static sigset_t              WorkerMask;     /* Signal mask of workers */
+
+/**
+ * Handle HTTP requests with a pool of long-lived worker processes.
+ *
+ * @param   sfd         Server socket file descriptor (bound with SO_REUSEPORT).
+ * @return  Exit status of server.
+ *
+ * The parent starts Workers children (one per CPU if Workers is not positive)
+ * and then only supervises them, respawning any that exit.  The first worker
+ * serves sfd, and every other worker a SO_REUSEPORT listener of its own, so
+ * that the kernel spreads incoming connections across the workers.  The
+ * parent opens all of the listeners and keeps them open, both for the
+ * replacements of workers (connections wait in the listener meanwhile) and
+ * for a hot restart, which passes them all on (see reload_share): a listener
+ * is never closed while connections may be queued on it.
+ *
+ * With Affinity, worker i is pinned to a CPU of its own (see affinity_pin),
+ * and its listener only takes connections received by that CPU (see
+ * affinity_steer).
+ *
+ * The parent only takes signals while suspended (see reload_start).  SIGHUP
+ * is passed on to every worker.  On SIGQUIT, the workers are asked to drain
+ * as well, and the parent exits once they all did.  On SIGINT or SIGTERM, the
+ * parent terminates all of the workers and exits.
+ **/
+int prefork_server(int sfd) {
+    pid_t   *workers;
+    int     *listeners;
+    int      nworkers = Workers > 0 ? Workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool     logged   = false;
+    sigset_t signals;
+    sigset_t suspended;
+
+    if (nworkers <= 0) {
+        nworkers = 1;
+    }
+
+    if (!(workers = calloc(nworkers, sizeof(pid_t))) || !(listeners = calloc(nworkers, sizeof(int)))) {
+        fprintf(stderr, "Could Not Allocate Workers: %s\n", strerror(errno));
+        free(workers);
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Take the listeners of the previous server (on a hot restart), and bind
+     * any that are missing */
+    const int *inherited;
+    size_t     ninherited = reload_listeners(&inherited);
+
+    listeners[0] = sfd;
+    for (int i = 1; i < nworkers; i++) {
+        if ((size_t)i <= ninherited) {
+            listeners[i] = inherited[i - 1];
+        } else if ((listeners[i] = socket_listen(Port, true)) < 0) {
+            fprintf(stderr, "Worker Socket Could Not Be Established\n");
+            nworkers = i;
+            break;
+        }
+    }
+    for (size_t i = nworkers; i < ninherited + 1; i++) {
+        close(inherited[i - 1]);
+    }
+    reload_share(listeners + 1, nworkers - 1);
+
+    /* Stop supervising on SIGINT or SIGTERM, and wake up on SIGCHLD */
+    struct sigaction action = { .sa_handler = prefork_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, &WorkerMask);
+    suspended = *reload_sigmask();
+    sigdelset(&suspended, SIGINT);
+    sigdelset(&suspended, SIGTERM);
+    sigdelset(&suspended, SIGCHLD);
+
+    /* Respawn workers as they exit */
+    while (!Terminate) {
+        time_t started = time(NULL);
+        bool   exited  = false;
+
+        /* Start any missing workers */
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i] <= 0) {
+                workers[i] = prefork_spawn(listeners, nworkers, i);
+            }
+        }
+        if (!logged) {
+            log("Started %d prefork workers", nworkers);
+            logged = true;
+        }
+
+        /* Wait for a signal (a worker that exited meanwhile is pending) */
+        sigsuspend(&suspended);
+
+        int   status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < nworkers; i++) {
+                if (workers[i] == pid) {
+                    log("Worker %d exited with status %d", pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+                    workers[i] = 0;
+                    exited     = true;
+                }
+            }
+        }
+
+        int events = reload_poll(sfd);
+        if (events & RELOAD_CONFIG) {
+            for (int i = 0; i < nworkers; i++) {
+                if (workers[i] > 0) {
+                    kill(workers[i], SIGHUP);
+                }
+            }
+        }
+        if (events & RELOAD_DRAIN) {
+            break;
+        }
+
+        /* Avoid spinning if workers die immediately (ex. bind failure) */
+        if (exited && time(NULL) - started < 1) {
+            sleep(1);
+        }
+    }
+
+    /* Stop workers: SIGTERM ends them now, SIGQUIT once their connections are
+     * done (including FastCGI workers, which are children too, but only after
+     * the server workers need them no more) */
+    for (int i = 0; i < nworkers; i++) {
+        close(listeners[i]);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], Terminate ? SIGTERM : SIGQUIT);
+        }
+    }
+    for (int i = 0; i < nworkers; i++) {
+        while (workers[i] > 0 && waitpid(workers[i], NULL, 0) < 0 && errno == EINTR);
+    }
+    fastcgi_stop();
+
+    free(listeners);
+    free(workers);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Spawn a worker process.
+ *
+ * @param   listeners   Server socket file descriptor of every worker.
+ * @param   nworkers    Number of workers.
+ * @param   index       Index of worker.
+ * @return  Process identifier of worker (or -1 on error).
+ *
+ * Each worker simply runs single_server on its own listener (closing those of
+ * the others), with the signal handling of the parent undone.  Only the parent
+ * restarts the server.
+ **/
+pid_t prefork_spawn(const int *listeners, int nworkers, int index) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        int cpu = Affinity ? affinity_pin(index) : -1;
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &WorkerMask, NULL);
+
+        int sfd = listeners[index];
+        for (int i = 0; i < nworkers; i++) {
+            if (i != index) {
+                close(listeners[i]);
+            }
+        }
+        if (cpu >= 0) {
+            affinity_steer(sfd, cpu);
+        }
+        exit(single_server(sfd));
+    }
+
+    return pid;
+}
+
+/**
+ * Record signal for supervisor.
+ *
+ * @param   signum      Signal number.
+ *
+ * SIGCHLD only needs to end sigsuspend.
+ **/
+void prefork_signal(int signum) {
+    if (signum != SIGCHLD) {
+        Terminate = 1;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,148 @@
+/* queue.c: Bounded Lock-Free Request Queue */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Create request queue.
+ *
+ * @param   capacity    Minimum number of requests the queue can hold.
+ * @return  Newly allocated Queue structure (or NULL on error).
+ *
+ * The capacity is rounded up to the next power of two.  The returned queue
+ * must be deallocated using queue_delete.
+ **/
+Queue * queue_create(size_t capacity) {
+    Queue *q = calloc(1, sizeof(Queue));
+    size_t size = 2;
+
+    if (!q) {
+        return NULL;
+    }
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    if (!(q->cells = calloc(size, sizeof(QueueCell)))) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        q->cells[i].sequence = i;
+    }
+    q->mask = size - 1;
+
+    if (sem_init(&q->items, 0, 0) < 0) {
+        goto fail;
+    }
+
+    return q;
+
+fail:
+    free(q->cells);
+    free(q);
+    return NULL;
+}
+
+/**
+ * Deallocate request queue.
+ *
+ * @param   q           Queue structure.
+ *
+ * Any requests still in the queue are not deallocated.
+ **/
+void queue_delete(Queue *q) {
+    if (!q) {
+        return;
+    }
+
+    sem_destroy(&q->items);
+    free(q->cells);
+    free(q);
+}
+
+/**
+ * Push request into queue without blocking.
+ *
+ * @param   q           Queue structure.
+ * @param   r           Request structure.
+ * @return  true if the request was queued, false if the queue is full.
+ *
+ * This is a multi-producer, multi-consumer bounded queue (Dmitry Vyukov's
+ * algorithm): each cell carries a sequence number that tells producers and
+ * consumers whether it is free or filled for their position, so the ring
+ * itself needs no lock.  The semaphore only lets idle consumers sleep.
+ **/
+bool queue_push(Queue *q, Request *r) {
+    size_t position = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    QueueCell *cell;
+
+    while (true) {
+        cell = &q->cells[position & q->mask];
+
+        size_t   sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff     = (intptr_t)sequence - (intptr_t)position;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->request = r;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    sem_post(&q->items);
+    return true;
+}
+
+/**
+ * Pop request from queue, blocking until one is available.
+ *
+ * @param   q           Queue structure.
+ * @return  Request structure (or NULL on error).
+ *
+ * A successful sem_wait reserves one published request for this consumer, so
+ * the retry loop below only spins while racing other consumers for a cell.
+ **/
+Request * queue_pop(Queue *q) {
+    size_t position;
+    QueueCell *cell;
+
+    while (sem_wait(&q->items) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "sem_wait failed: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+
+    position = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &q->cells[position & q->mask];
+
+        size_t   sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff     = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            /* Cell is not published yet or was taken by another consumer */
+            position = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    Request *r = cell->request;
+    __atomic_store_n(&cell->sequence, position + q->mask + 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,428 @@
+/* reload.c: Configuration Reload and Hot Restart */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RELOAD_LISTEN_FD    "SPIDEY_LISTEN_FD"  /* Environment variable naming inherited listeners */
+#define RELOAD_LISTEN_PID   "SPIDEY_LISTEN_PID" /* Environment variable naming server that passed it */
+#define RELOAD_TLS_FD       "SPIDEY_TLS_FD"     /* Environment variable naming inherited TLS listener */
+#define RELOAD_MAX_LISTENERS 256                /* Most listeners passed on restart */
+
+/* Internal Declarations */
+void    reload_signal(int signum);
+void    reload_configuration(void);
+size_t  reload_inherit(const char *variable, int *fds, size_t n);
+char ** reload_environment(char *variables[]);
+pid_t   reload_exec(int sfd);
+
+/* Internal Variables */
+static volatile sig_atomic_t Reload      = 0;    /* SIGHUP received */
+static volatile sig_atomic_t Restart     = 0;    /* SIGUSR2 received */
+static volatile sig_atomic_t Drain       = 0;    /* SIGQUIT received */
+static sigset_t              Unblocked;          /* Signal mask while waiting */
+static char                **Arguments   = NULL; /* Command line to restart with */
+static pid_t                 Predecessor = 0;    /* Server that passed its listener */
+static const int            *Shared      = NULL; /* Further listeners to pass on restart (see reload_share) */
+static size_t                NShared     = 0;    /* Number of further listeners to pass */
+static int                   Inherited[RELOAD_MAX_LISTENERS];   /* Further listeners inherited */
+static size_t                NInherited  = 0;    /* Number of further listeners inherited */
+
+/**
+ * Install reload, restart, and drain signal handlers.
+ *
+ * @param   argv        Command line of server (used to restart it).
+ * @return  0 on success and -1 on error.
+ *
+ *  - SIGHUP reloads the configuration: the mimetypes file and custom error
+ *    pages are read again and the hot file and path caches are flushed.
+ *    FastCGI scripts are not looked for again (see fastcgi_start).
+ *
+ *  - SIGUSR2 starts a new server (the program named by argv[0], with the same
+ *    arguments) that inherits the listening socket.  Once it is serving, it
+ *    sends SIGQUIT to this server.
+ *
+ *  - SIGQUIT makes the server stop accepting, finish the connections it has,
+ *    and exit.
+ *
+ * The signals are blocked except while a server waits for work (see
+ * reload_wait and reload_sigmask), so they never interrupt a request, and
+ * they are only acted upon between requests (see reload_poll).
+ *
+ * This must be called before any workers are started, and after the FastCGI
+ * workers are, which should not inherit the blocked signals.
+ **/
+int reload_start(char *argv[]) {
+    struct sigaction action = { .sa_handler = reload_signal };
+    sigset_t         signals;
+
+    sigemptyset(&action.sa_mask);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGQUIT);
+
+    if (sigprocmask(SIG_BLOCK, &signals, &Unblocked) < 0 ||
+        sigaction(SIGHUP, &action, NULL) < 0 ||
+        sigaction(SIGUSR2, &action, NULL) < 0 ||
+        sigaction(SIGQUIT, &action, NULL) < 0) {
+        fprintf(stderr, "Could Not Install Reload Signals: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* A restarted server inherits the mask of the server that started it */
+    sigdelset(&Unblocked, SIGHUP);
+    sigdelset(&Unblocked, SIGUSR2);
+    sigdelset(&Unblocked, SIGQUIT);
+
+    Arguments = argv;
+    return 0;
+}
+
+/**
+ * Return listening socket inherited from previous server.
+ *
+ * @return  Server socket file descriptor (or -1 if none was inherited).
+ *
+ * The socket keeps its SO_REUSEPORT setting, so a server should be restarted
+ * in the same concurrency mode.  Any further listeners passed along with it
+ * are kept for reload_listeners.
+ **/
+int reload_listener(void) {
+    const char *pid = getenv(RELOAD_LISTEN_PID);
+    int         fds[RELOAD_MAX_LISTENERS];
+    size_t      n;
+
+    Predecessor = pid ? atoi(pid) : 0;
+    unsetenv(RELOAD_LISTEN_PID);
+
+    if ((n = reload_inherit(RELOAD_LISTEN_FD, fds, RELOAD_MAX_LISTENERS)) == 0) {
+        Predecessor = 0;
+        return -1;
+    }
+
+    NInherited = n - 1;
+    memcpy(Inherited, fds + 1, NInherited * sizeof(int));
+    log("Inherited %zu listeners from server %d", n, Predecessor);
+    return fds[0];
+}
+
+/**
+ * Return TLS listening socket inherited from previous server.
+ *
+ * @return  Server socket file descriptor (or -1 if none was inherited).
+ **/
+int reload_tls_listener(void) {
+    int sfd;
+
+    return reload_inherit(RELOAD_TLS_FD, &sfd, 1) ? sfd : -1;
+}
+
+/**
+ * Return further listening sockets inherited from previous server.
+ *
+ * @param   fds         Where to store array of server socket file descriptors.
+ * @return  Number of further listeners (passed by reload_share).
+ **/
+size_t reload_listeners(const int **fds) {
+    *fds = Inherited;
+    return NInherited;
+}
+
+/**
+ * Pass further listening sockets on restart.
+ *
+ * @param   fds         Array of server socket file descriptors (kept open by
+ *                      the caller, which must not free it).
+ * @param   n           Number of listeners.
+ *
+ * Servers with a SO_REUSEPORT listener per worker (prefork) pass all of
+ * them, so that the new server accepts from the same sockets and no
+ * connection queued on one is lost when the old server closes it.
+ **/
+void reload_share(const int *fds, size_t n) {
+    Shared  = fds;
+    NShared = n < RELOAD_MAX_LISTENERS - 1 ? n : RELOAD_MAX_LISTENERS - 1;
+}
+
+/**
+ * Tell previous server to drain, now that this one is serving.
+ **/
+void reload_ready(void) {
+    if (Predecessor > 0 && Predecessor == getppid()) {
+        kill(Predecessor, SIGQUIT);
+    }
+}
+
+/**
+ * Wait for server socket to become readable (or for a signal).
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Whether or not there is a connection to accept.
+ *
+ * This is the only place blocking servers take the reload signals, so
+ * reload_poll should be called whenever it returns.
+ **/
+bool reload_wait(int sfd) {
+    struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+
+    if (ppoll(&pfd, 1, NULL, &Unblocked) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "ppoll failed: %s\n", strerror(errno));
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Act on signals received since the last call.
+ *
+ * @param   sfd         Server socket file descriptor (passed on restart).
+ * @return  ReloadEvent flags.
+ *
+ * RELOAD_DRAIN is reported on every call once SIGQUIT was received.
+ **/
+int reload_poll(int sfd) {
+    int events = 0;
+
+    if (Reload) {
+        Reload = 0;
+        reload_configuration();
+        events |= RELOAD_CONFIG;
+    }
+
+    if (Restart) {
+        Restart = 0;
+        reload_exec(sfd);
+    }
+
+    if (Drain) {
+        events |= RELOAD_DRAIN;
+    }
+    return events;
+}
+
+/**
+ * Determine if server is draining.
+ *
+ * @return  Whether or not connections should be closed after their current
+ * response.
+ *
+ * Blocking servers only take SIGQUIT while waiting (see reload_wait), so one
+ * that is still pending counts as well.
+ **/
+bool reload_draining(void) {
+    sigset_t pending;
+
+    if (Drain) {
+        return true;
+    }
+    return sigpending(&pending) == 0 && sigismember(&pending, SIGQUIT) == 1;
+}
+
+/**
+ * Return signal mask to wait with.
+ *
+ * @return  Signal mask of the process with the reload signals unblocked (for
+ * ppoll, epoll_pwait, io_uring_enter, and spawned programs).
+ **/
+const sigset_t *reload_sigmask(void) {
+    return &Unblocked;
+}
+
+/**
+ * Record signal for reload_poll.
+ *
+ * @param   signum      Signal number.
+ **/
+void reload_signal(int signum) {
+    switch (signum) {
+        case SIGHUP:  Reload  = 1; break;
+        case SIGUSR2: Restart = 1; break;
+        case SIGQUIT: Drain   = 1; break;
+    }
+}
+
+/**
+ * Reload configuration.
+ *
+ * If the mimetypes file cannot be read, the previous table is kept, and so is
+ * the previous page of any error status that cannot be rebuilt.
+ **/
+void reload_configuration(void) {
+    if (load_mimetypes(MimeTypesPath) < 0) {
+        fprintf(stderr, "Could Not Reload Mimetypes, Keeping Previous Table\n");
+    }
+    if (load_error_pages(RootPath) < 0) {
+        fprintf(stderr, "Could Not Reload Some Error Pages, Keeping Previous Ones\n");
+    }
+    cache_flush();
+    path_cache_flush();
+    log("Reloaded configuration");
+}
+
+/**
+ * Take listening sockets named by environment variable.
+ *
+ * @param   variable    Name of environment variable (unset once read).
+ * @param   fds         Where to store server socket file descriptors.
+ * @param   n           Most listeners to take.
+ * @return  Number of listeners inherited.
+ *
+ * The variable holds a comma-separated list of descriptor numbers.
+ **/
+size_t reload_inherit(const char *variable, int *fds, size_t n) {
+    const char *fd = getenv(variable);
+    size_t      count = 0;
+
+    while (fd && *fd && count < n) {
+        char     *end;
+        int       sfd       = strtol(fd, &end, 10);
+        int       listening = 0;
+        socklen_t length    = sizeof(listening);
+
+        if (end == fd) {
+            break;
+        }
+        fd = *end == ',' ? end + 1 : end;
+
+        if (getsockopt(sfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0 || !listening) {
+            fprintf(stderr, "Ignoring Inherited Listener %d: Not A Listening Socket\n", sfd);
+            continue;
+        }
+
+        fcntl(sfd, F_SETFD, FD_CLOEXEC);
+        fds[count++] = sfd;
+    }
+
+    unsetenv(variable);
+    return count;
+}
+
+/**
+ * Build environment of new server.
+ *
+ * @param   variables   NULL-terminated array of "NAME=value" strings to set.
+ * @return  NULL-terminated array of "NAME=value" strings (or NULL on error).
+ *
+ * This is the environment of this server, with any previous values of the
+ * given variables replaced.  Only the array is allocated (free it once the
+ * server is started); the strings are those of environ and variables.
+ **/
+char ** reload_environment(char *variables[]) {
+    extern char **environ;
+    size_t        count = 0;
+    size_t        n     = 0;
+    char        **environment;
+
+    for (char **e = environ; *e; e++) {
+        count++;
+    }
+    for (char **v = variables; *v; v++) {
+        count++;
+    }
+
+    if (!(environment = calloc(count + 1, sizeof(char *)))) {
+        return NULL;
+    }
+
+    for (char **e = environ; *e; e++) {
+        bool replaced = false;
+
+        for (char **v = variables; *v && !replaced; v++) {
+            size_t length = strchr(*v, '=') - *v + 1;
+            replaced = strncmp(*e, *v, length) == 0;
+        }
+        if (!replaced) {
+            environment[n++] = *e;
+        }
+    }
+    for (char **v = variables; *v; v++) {
+        environment[n++] = *v;
+    }
+    return environment;
+}
+
+/**
+ * Start new server that inherits server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Process identifier of new server (or -1 on error).
+ *
+ * The socket (along with those of reload_share, and the TLS one, if any) is
+ * passed by descriptor number in the environment.  Signals this server ignores or blocks are reset, since both
+ * survive exec.
+ *
+ * The server may have other threads, so the new server is started with
+ * posix_spawn rather than by forking and preparing it in the child: everything
+ * is set up beforehand, and duplicating each socket onto itself clears its
+ * close-on-exec flag in the new server only.
+ **/
+pid_t reload_exec(int sfd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attributes;
+    sigset_t                   defaults;
+    int                        tls = tls_listener();
+    char                       listen_fd[sizeof(RELOAD_LISTEN_FD) + RELOAD_MAX_LISTENERS * 12];
+    int                        offset;
+    char                       listen_pid[32];
+    char                       tls_fd[32];
+    char                      *variables[] = { listen_fd, listen_pid, tls >= 0 ? tls_fd : NULL, NULL };
+    char                     **environment;
+    pid_t                      child;
+    int                        status;
+
+    offset = snprintf(listen_fd, sizeof(listen_fd), RELOAD_LISTEN_FD "=%d", sfd);
+    for (size_t i = 0; i < NShared; i++) {
+        offset += snprintf(listen_fd + offset, sizeof(listen_fd) - offset, ",%d", Shared[i]);
+    }
+    snprintf(listen_pid, sizeof(listen_pid), RELOAD_LISTEN_PID "=%d", getpid());
+    snprintf(tls_fd, sizeof(tls_fd), RELOAD_TLS_FD "=%d", tls);
+
+    if (!(environment = reload_environment(variables))) {
+        fprintf(stderr, "Could Not Start New Server: %s\n", strerror(errno));
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sfd, sfd);
+    for (size_t i = 0; i < NShared; i++) {
+        posix_spawn_file_actions_adddup2(&actions, Shared[i], Shared[i]);
+    }
+    if (tls >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, tls, tls);
+    }
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setsigmask(&attributes, &Unblocked);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    status = posix_spawnp(&child, Arguments[0], &actions, &attributes, Arguments, environment);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    free(environment);
+
+    if (status != 0) {
+        fprintf(stderr, "Could Not Execute %s: %s\n", Arguments[0], strerror(status));
+        return -1;
+    }
+
+    log("Started new server %d", child);
+    return child;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,71 +4,147 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+int        parse_request_method(Request *r, char *line, size_t length);
+int        parse_request_header(Request *r, char *line, size_t length);
+ssize_t    read_request(Request *r);
+StringView request_view(Request *r, const char *s, size_t length);
+void       request_address(Request *r);
+ssize_t    socket_stream_write(void *cookie, const char *buffer, size_t size);
+int        socket_stream_close(void *cookie);
 
 /**
  * Accept request from server socket.
  *
  * @param   sfd         Server socket file descriptor.
+ * @param   flags       Flags for client socket (SOCK_NONBLOCK or 0).
  * @return  Newly allocated Request structure.
  *
+ * This function accepts a client connection from the server socket (close on
+ * exec, so that CGI scripts do not inherit it) and then wraps it in a request
+ * struct (see open_request).
+ *
+ * The returned request struct must be deallocated using free_request.
+ **/
+Request * accept_request(int sfd, int flags) {
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    int fd;
+
+    /* Accept a client (close-on-exec, so that CGI children started by script
+     * threads do not hold other clients' sockets open) */
+    if ( (fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, flags | SOCK_CLOEXEC)) == -1){
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            fprintf(stderr, "Accept Failure: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    return open_request(fd, (struct sockaddr *)&raddr, rlen);
+}
+
+/**
+ * Create request for accepted client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   addr        Address of client (or NULL to look it up when needed).
+ * @param   length      Length of addr.
+ * @return  Newly allocated Request structure (or NULL on error, in which case
+ * fd is closed).
+ *
  * This function does the following:
  *
  *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  2. Initializes the response file in the request struct.
+ *  3. Stores the client address in the request struct.
+ *  4. Returns the request struct.
+ *
+ * The address is only formatted when it is needed (see request_host), and
+ * the socket stream is only opened by servers that write to it directly (see
+ * open_request_stream).
  *
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
+Request * open_request(int fd, const struct sockaddr *addr, socklen_t length) {
+    uint64_t start = metrics_now();
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr_storage);
-    
 
     /* Allocate request struct (zeroed) */
-    r = calloc(1, sizeof(Request));
-
-    // Initialize Headers 
-    r->headers = NULL;
-    
-    
-    /* Accept a client */
-    if ( (r->fd = accept(sfd, &raddr, &rlen)) == -1){
-        fprintf(stderr, "Accept Failure: %s\n", strerror(errno));
-        goto fail;
+    if (!(r = calloc(1, sizeof(Request)))) {
+        close(fd);
+        return NULL;
     }
 
+    // Initialize Response File
+    r->file    = -1;
+    r->fd      = fd;
+    r->waiting = -1;
 
-
-    /* Lookup client information */
-    if ( (getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXSERV,  NI_NUMERICHOST)) != 0){
-        fprintf(stderr, "Could Not Lookup Client Info: %s\n", gai_strerror(errno));
-        goto fail;
+    /* Record client address */
+    if (addr && length <= sizeof(r->addr)) {
+        memcpy(&r->addr, addr, length);
+        r->addrlen = length;
     }
-    
 
-    /* Open socket stream */
-    if ( (r->stream = fdopen(r->fd, "w+") ) == NULL) {
+    debug("Accepted request from %s:%s", request_host(r), request_port(r));
+    metrics_record(STAGE_ACCEPT, start);
+    return r;
+}
+
+/**
+ * Open socket stream of request.
+ *
+ * @param   r           Request structure.
+ * @return  0 on success and -1 on error.
+ *
+ * The socket stream sends with MSG_NOSIGNAL and counts the bytes it sends in
+ * r->nsent, so it has no underlying file descriptor (fileno).  Input is read
+ * directly into r->buffer instead.
+ **/
+int open_request_stream(Request *r) {
+    cookie_io_functions_t functions = {
+        .write = socket_stream_write,
+        .close = socket_stream_close,
+    };
+
+    if ( (r->stream = fopencookie(r, "w", functions) ) == NULL) {
         fprintf(stderr, "Could Not Open File Stream: %s\n", strerror(errno));
-        goto fail;
+        return -1;
     }
-    
+    return 0;
+}
 
-    log("Accepted request from %s:%s", r->host, r->port);
-    return r;
+/**
+ * Return numeric host of client.
+ *
+ * @param   r           Request structure.
+ * @return  IPv4 or IPv6 address string (formatted on first use).
+ **/
+const char *request_host(Request *r) {
+    if (!r->host[0]) {
+        request_address(r);
+    }
+    return r->host;
+}
 
-fail:
-    /* Deallocate request struct */
-    free_request(r);
-    return NULL;
+/**
+ * Return port number of client.
+ *
+ * @param   r           Request structure.
+ * @return  Port number string (formatted on first use).
+ **/
+const char *request_port(Request *r) {
+    if (!r->host[0]) {
+        request_address(r);
+    }
+    return r->port;
 }
 
 /**
@@ -79,71 +155,316 @@ fail:
  * This function does the following:
  *
  *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  2. Frees all allocated strings and headers (via reset_request).
+ *  3. Frees the request arena and the request struct.
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
+    /* Give up connection counters (see admission_acquire) */
+    admission_release(r);
+
+    /* End TLS session (sending its close notification) */
+    if(r->tls)
+        tls_close(r);
+
     /* Close socket or fd */
     if(r->stream)
         fclose(r->stream);
+    else if(r->fd >= 0)
+        close(r->fd);
 
-    /* Free allocated strings */
-    if(r->method)
-        free(r->method);
-    if(r->uri)
-        free(r->uri);
-    if(r->path)
-        free(r->path);
-    if(r->query)
-        free(r->query);
-
-    /* Free headers */
-    Header * h = r->headers;
-    Header *temp;
-    while ( h != NULL ){
-        temp = h;
-        h = h->next;
-        free(temp->name);
-        free(temp->data);
-        free(temp);
-        
-    }  
+    /* Free allocated strings and headers */
+    reset_request(r);
+    arena_free(&r->arena);
 
     /* Free request */
     free(r);
 }
 
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This function does the following:
+ *
+ *  1. Resets the request arena, releasing every request lifetime object.
+ *  2. Forgets the parsed request line and headers.
+ *  3. Closes any response file and releases any cache entry (and forgets
+ *     the response status and byte count).
+ *  4. Moves any unparsed (pipelined) input to the front of the buffer.
+ *  5. Counts the finished request.
+ *
+ * The socket and its stream are left open.
+ **/
+void reset_request(Request *r) {
+    /* Release request lifetime objects (keeping arena memory for reuse) */
+    arena_reset(&r->arena);
+    r->path = NULL;
+
+    /* Forget parsed request line and headers */
+    r->method   = r->uri = r->query = r->version = (StringView){ 0, 0 };
+    r->head     = false;
+    r->nheaders = 0;
+    r->state    = PARSE_REQUEST_LINE;
+
+    /* Close response file */
+    if (r->file >= 0)
+        close(r->file);
+    r->file        = -1;
+    r->file_offset = 0;
+    r->file_end    = 0;
+    r->ranges      = NULL;
+    r->nranges     = 0;
+    r->range       = 0;
+    r->range_sent  = 0;
+
+    cache_release(r->entry);
+    r->entry = NULL;
+
+    r->status  = HTTP_STATUS_OK;
+    r->started = 0;
+    r->nsent   = 0;
+
+    /* Keep pipelined input */
+    memmove(r->buffer, r->buffer + r->offset, r->nread - r->offset);
+    r->nread    -= r->offset;
+    r->offset    = 0;
+    r->scan      = 0;
+    r->keepalive = false;
+    r->nrequests++;
+}
+
+/**
+ * Wait for the next request on a persistent connection.
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Maximum time to wait in milliseconds.
+ * @return  Whether or not request data is available.
+ *
+ * This returns immediately if pipelined input is already buffered.  Otherwise,
+ * it waits for the client to send more data, returning false if the timeout
+ * expires, the client closes the connection, or an error occurs.
+ *
+ * Servers whose workers handle one connection at a time set r->waiting, so
+ * that an idle connection does not hold its worker while new connections wait
+ * for it: once r->waiting is readable, this gives up on the connection.  That
+ * is either the worker's own server socket (prefork), which reading fails on
+ * without consuming anything, or an EFD_SEMAPHORE eventfd shared by several
+ * workers (threaded), whose every wakeup is taken by one of them alone.
+ **/
+bool wait_request(Request *r, int timeout) {
+    struct pollfd pfds[2] = {
+        { .fd = r->fd,      .events = POLLIN },
+        { .fd = r->waiting, .events = POLLIN },     /* Ignored by poll if -1 */
+    };
+    struct timespec now;
+    long     deadline;
+    uint64_t count;
+
+    if (r->nread > r->offset) {
+        return true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout;
+
+    while (true) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = deadline - (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+        int  n         = poll(pfds, 2, remaining > 0 ? remaining : 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || pfds[0].revents) {
+            break;
+        }
+
+        /* Another worker took the wakeup */
+        if (read(r->waiting, &count, sizeof(count)) < 0 && errno == EAGAIN) {
+            continue;
+        }
+        debug("Closing idle connection from %s:%s for waiting connection", request_host(r), request_port(r));
+        return false;
+    }
+
+    return (pfds[0].revents & POLLIN) && read_request(r) > 0;
+}
+
 /**
  * Parse HTTP Request.
  *
  * @param   r           Request structure.
  * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function parses the request line and then the headers, reading more
+ * data from the client socket whenever the buffered input runs out, returning
+ * 0 on success, and -1 on error.
+ *
+ * The headers must arrive within RequestTimeout seconds of the first read:
+ * each read is bounded by the socket's receive timeout (see
+ * handle_connection) and the total time is checked between reads, so a
+ * client trickling in bytes cannot hold the connection either.  On timeout,
+ * r->status is set to HTTP_STATUS_REQUEST_TIMEOUT; on other errors found by
+ * the parser, it holds the status to answer with (see parse_request_input).
+ *
+ * If the request was already parsed from buffered input (ex. by the event
+ * loop via parse_request_input), this just reports the result.
  **/
 int parse_request(Request *r) {
-    /* Parse HTTP Request Method */
-    if( parse_request_method(r) < 0 ){
+    uint64_t deadline = 0;
+    int status;
+
+    while ((status = parse_request_input(r)) == 0) {
+        if (!deadline) {
+            deadline = metrics_now() + (uint64_t)RequestTimeout * 1000000000;
+        }
+
+        ssize_t nread = read_request(r);
+        if (nread <= 0) {
+            if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                r->status = HTTP_STATUS_REQUEST_TIMEOUT;
+            }
+            return -1;
+        }
+
+        if (RequestTimeout > 0 && metrics_now() > deadline) {
+            r->status = HTTP_STATUS_REQUEST_TIMEOUT;
+            return -1;
+        }
+    }
+
+    return status > 0 ? 0 : -1;
+}
+
+/**
+ * Parse buffered HTTP Request input.
+ *
+ * @param   r           Request structure.
+ * @return  1 if the request is complete, 0 if more input is needed, and -1 on
+ * error.
+ *
+ * This parses as many complete lines from r->buffer as are available and then
+ * stops, so it can be called again after each read on a non-blocking socket.
+ * r->offset marks the start of the first unparsed line and r->scan how far
+ * that line has already been searched for its newline, so no input is ever
+ * scanned twice.
+ *
+ * Nothing is allocated or copied: the method, uri, query, version, and header
+ * names and data are recorded as StringViews into r->buffer, each terminated
+ * in place with a NUL so that request_string may be used as a C string.
+ *
+ * A request line longer than REQUEST_MAX_LINE sets r->status to
+ * HTTP_STATUS_URI_TOO_LONG, and headers that do not fit in r->buffer (or
+ * number more than REQUEST_MAX_HEADERS) set it to
+ * HTTP_STATUS_HEADER_FIELDS_TOO_LARGE.  Other malformed input leaves it for
+ * HTTP_STATUS_BAD_REQUEST.
+ *
+ * Request bodies are only ever framed by Content-Length, so a request with a
+ * Transfer-Encoding is rejected with HTTP_STATUS_NOT_IMPLEMENTED (or with
+ * HTTP_STATUS_BAD_REQUEST if it has a Content-Length as well): its body would
+ * otherwise be taken for the next request on the connection.
+ *
+ * Once the blank line ending the headers is reached, this also decides whether
+ * the connection should be kept alive after the response, based on the HTTP
+ * version, the Connection header, and KeepAliveMax.
+ **/
+int parse_request_input(Request *r) {
+    while (r->state == PARSE_REQUEST_LINE || r->state == PARSE_HEADERS) {
+        char   *line    = r->buffer + r->offset;
+        char   *newline = memchr(r->buffer + r->scan, '\n', r->nread - r->scan);
+        size_t  length;
+
+        /* Wait for a complete line, unless it can never fit */
+        if (!newline) {
+            r->scan = r->nread;
+            if (r->state == PARSE_REQUEST_LINE && r->nread - r->offset > REQUEST_MAX_LINE) {
+                fprintf(stderr, "Request Line Too Long\n");
+                r->status = HTTP_STATUS_URI_TOO_LONG;
+                r->state  = PARSE_ERROR;
+                break;
+            }
+            if (r->nread < sizeof(r->buffer)) {
+                return 0;
+            }
+            fprintf(stderr, "Headers Too Long\n");
+            r->status = HTTP_STATUS_HEADER_FIELDS_TOO_LARGE;
+            r->state  = PARSE_ERROR;
+            break;
+        }
+
+        /* Terminate line (without CRLF) and advance past it */
+        length = newline - line;
+        if (r->state == PARSE_REQUEST_LINE && length > REQUEST_MAX_LINE) {
+            fprintf(stderr, "Request Line Too Long\n");
+            r->status = HTTP_STATUS_URI_TOO_LONG;
+            r->state  = PARSE_ERROR;
+            break;
+        }
+        if (length > 0 && line[length - 1] == '\r') {
+            length--;
+        }
+        line[length] = '\0';
+        r->offset = r->scan = newline - r->buffer + 1;
+
+        if (r->state == PARSE_REQUEST_LINE) {
+            /* Ignore empty lines before the request line (RFC 7230 3.5) */
+            if (length == 0) {
+                continue;
+            }
+            r->state = parse_request_method(r, line, length) < 0 ? PARSE_ERROR : PARSE_HEADERS;
+        } else if (length == 0) {
+            r->state = PARSE_DONE;
+        } else if (parse_request_header(r, line, length) < 0) {
+            r->state = PARSE_ERROR;
+        }
+    }
+
+    if (r->state != PARSE_DONE) {
         return -1;
     }
-    /* Parse HTTP Requet Headers*/
-    if( parse_request_headers(r) < 0 ){
+
+    if (request_header(r, "Transfer-Encoding")) {
+        fprintf(stderr, "Unsupported Transfer-Encoding\n");
+        r->status = request_header(r, "Content-Length") ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_NOT_IMPLEMENTED;
+        r->state  = PARSE_ERROR;
         return -1;
     }
 
-    return 0;
+    /* Determine if connection persists: HTTP/1.1 defaults to keep-alive, and
+     * either version may override it with a Connection header */
+    const char *connection = request_header(r, "Connection");
+    if( connection && strcasestr(connection, "close") ){
+        r->keepalive = false;
+    }
+    else if( connection && strcasestr(connection, "keep-alive") ){
+        r->keepalive = true;
+    }
+    if( r->nrequests + 1 >= (size_t)KeepAliveMax ){
+        r->keepalive = false;
+    }
+    if( r->keepalive && reload_draining() ){
+        r->keepalive = false;
+    }
+
+#ifndef NDEBUG
+    for (size_t i = 0; i < r->nheaders; i++) {
+    	debug("HTTP HEADER %s = %s", request_string(r, r->headers[i].name), request_string(r, r->headers[i].data));
+    }
+#endif
+    return 1;
 }
 
 /**
  * Parse HTTP Request Method and URI.
  *
  * @param   r           Request structure.
+ * @param   line        Request line (NUL-terminated, without CRLF).
+ * @param   length      Length of request line.
  * @return  -1 on error and 0 on success.
  *
  * HTTP Requests come in the form
@@ -155,66 +476,79 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (empty if it does not exist),
+ * and version, and notes whether the HTTP version defaults to a persistent
+ * connection.
  **/
-int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-    char *method;
+int parse_request_method(Request *r, char *line, size_t length) {
+    char *end = line + length;
+    char *method = line;
     char *uri;
     char *query;
-    char *realURI;
+    char *version;
+    char *separator;
 
-    /* Read line from socket */
-    if(!fgets(buffer, BUFSIZ, r->stream)){
-        goto fail;
-    }   
-    
-    /* Parse method and uri */
-    method = strtok(buffer, WHITESPACE);
-    r->method = strdup(method);
-    if(!(r->method)){
+    /* Parse method */
+    if (!(separator = memchr(method, ' ', end - method)) || separator == method) {
         goto fail;
     }
-    uri = strtok(NULL, WHITESPACE);
-    if(!uri){
+    *separator = '\0';
+    r->method = request_view(r, method, separator - method);
+    r->head   = streq(method, "HEAD");
+
+    /* Parse uri (and separate version, if any) */
+    for (uri = separator + 1; uri < end && *uri == ' '; uri++);
+    if (uri == end) {
         goto fail;
     }
 
-    /* Parse query from uri */
-    query = strchr(uri, '?');
-    if(!query){
-        query = "";
-        realURI = uri;
-    }
-    else{
-        *query++ = '\0';
-        realURI = strtok(uri, "?"); 
+    /* A single scan finds whichever of the query or version comes first */
+    query = (char *)scan_delimiters(uri, end - uri, " ?");
+    if (query && *query == ' ') {
+        separator = query;
+        query     = NULL;
+    } else {
+        separator = memchr(query ? query : uri, ' ', end - (query ? query : uri));
     }
 
-    r->uri = strdup(realURI);           
-    if(!(r->uri)){
-        goto fail;
+    if (separator) {
+        *separator = '\0';
+        for (version = separator + 1; version < end && *version == ' '; version++);
+    } else {
+        separator = end;
+        version   = end;
     }
-    
-    r->query = strdup(query);
-    if(!(r->query)){
-        goto fail;
+
+    /* Parse query from uri (an empty query views the uri's terminator) */
+    if (query) {
+        *query++   = '\0';
+        r->uri     = request_view(r, uri, query - 1 - uri);
+        r->query   = request_view(r, query, separator - query);
+    } else {
+        r->uri     = request_view(r, uri, separator - uri);
+        r->query   = request_view(r, separator, 0);
     }
+    r->version   = request_view(r, version, end - version);
+    r->keepalive = streq(version, "HTTP/1.1");
+
     /* Record method, uri, and query in request struct */
-    debug("HTTP METHOD: %s", r->method);
-    debug("HTTP URI:    %s", r->uri);
-    debug("HTTP QUERY:  %s", r->query);
+    debug("HTTP METHOD: %s", request_string(r, r->method));
+    debug("HTTP URI:    %s", request_string(r, r->uri));
+    debug("HTTP QUERY:  %s", request_string(r, r->query));
 
     return 0;
 
 fail:
+    fprintf(stderr, "Malformed Request Line\n");
     return -1;
 }
 
 /**
- * Parse HTTP Request Headers.
+ * Parse HTTP Request Header.
  *
  * @param   r           Request structure.
+ * @param   line        Header line (NUL-terminated, without CRLF).
+ * @param   length      Length of header line.
  * @return  -1 on error and 0 on success.
  *
  * HTTP Headers come in the form:
@@ -230,64 +564,260 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
- *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
- *      header      = new Header(name, data)
- *      headers.append(header)
+ * The name ends at the first ':' (so the data may contain more of them), and
+ * surrounding whitespace is trimmed from the data.  Folded (obsolete
+ * multi-line) headers and names containing whitespace are rejected.
  **/
-int parse_request_headers(Request *r) {
+int parse_request_header(Request *r, char *line, size_t length) {
+    char *end = line + length;
+    char *colon;
+    char *data;
 
-    Header ** trailer = &(r->headers); 
+    if (r->nheaders >= REQUEST_MAX_HEADERS) {
+        fprintf(stderr, "Too Many Headers\n");
+        r->status = HTTP_STATUS_HEADER_FIELDS_TOO_LARGE;
+        return -1;
+    }
 
-    char buffer[BUFSIZ];
-    char *name;
-    char *data;
+    /* Whitespace before the first ':' means the name is malformed */
+    if (!(colon = (char *)scan_delimiters(line, length, ": \t")) || *colon != ':' || colon == line) {
+        fprintf(stderr, "Malformed Header\n");
+        return -1;
+    }
 
-    /* Parse headers from socket */
-    while(fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2){
+    /* Trim whitespace around data */
+    for (data = colon + 1; data < end && (*data == ' ' || *data == '\t'); data++);
+    while (end > data && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    *colon = '\0';
+    *end   = '\0';
+    r->headers[r->nheaders].name = request_view(r, line, colon - line);
+    r->headers[r->nheaders].data = request_view(r, data, end - data);
+    r->nheaders++;
+    return 0;
+}
 
-        name = strtok(buffer, ":");
-        if(!name){
-            goto fail;
+/**
+ * Lookup HTTP Request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Name of header (case-insensitive).
+ * @return  Data of first matching header (or NULL if not present).
+ **/
+const char *request_header(Request *r, const char *name) {
+    for (size_t i = 0; i < r->nheaders; i++) {
+        if (strcasecmp(request_string(r, r->headers[i].name), name) == 0) {
+            return request_string(r, r->headers[i].data);
         }
-        data = strtok(NULL, ":");
-        if(!data){
-            goto fail;
+    }
+    return NULL;
+}
+
+/**
+ * Read more HTTP Request input from client socket.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read (0 on EOF or a full buffer, -1 on error).
+ **/
+ssize_t read_request(Request *r) {
+    ssize_t nread;
+
+    if (r->nread >= sizeof(r->buffer)) {
+        return 0;
+    }
+
+    do {
+        nread = request_recv(r, r->buffer + r->nread, sizeof(r->buffer) - r->nread, 0);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        r->nread += nread;
+    }
+    return nread;
+}
+
+/**
+ * Create StringView into request buffer.
+ *
+ * @param   r           Request structure.
+ * @param   s           Start of string inside r->buffer.
+ * @param   length      Length of string.
+ * @return  StringView of string.
+ **/
+StringView request_view(Request *r, const char *s, size_t length) {
+    return (StringView){ .offset = s - r->buffer, .length = length };
+}
+
+/**
+ * Format client address into r->host and r->port.
+ *
+ * @param   r           Request structure.
+ *
+ * The address is looked up with getpeername if it was not recorded when the
+ * request was opened.  Addresses that cannot be formatted become "-".
+ **/
+void request_address(Request *r) {
+    const void *address = NULL;
+    in_port_t   port    = 0;
+
+    if (!r->addrlen) {
+        socklen_t length = sizeof(r->addr);
+        if (getpeername(r->fd, (struct sockaddr *)&r->addr, &length) == 0)
+            r->addrlen = length;
+    }
+
+    if (r->addrlen && r->addr.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&r->addr;
+        address = &sin->sin_addr;
+        port    = sin->sin_port;
+    } else if (r->addrlen && r->addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&r->addr;
+        address = &sin6->sin6_addr;
+        port    = sin6->sin6_port;
+    }
+
+    if (!address || !inet_ntop(r->addr.ss_family, address, r->host, sizeof(r->host))) {
+        strcpy(r->host, "-");
+    }
+    snprintf(r->port, sizeof(r->port), "%u", ntohs(port));
+}
+
+/**
+ * Receive request data from client socket.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @param   flags       Flags for recv(2) (ignored for TLS connections).
+ * @return  Number of bytes received (0 on EOF, -1 on error with errno set).
+ *
+ * Data of TLS connections is decrypted (see tls_recv).
+ **/
+ssize_t request_recv(Request *r, void *buffer, size_t size, int flags) {
+    if (r->tls) {
+        return tls_recv(r, buffer, size);
+    }
+    return recv(r->fd, buffer, size, flags);
+}
+
+/**
+ * Send response data to client socket.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Data to send.
+ * @param   size        Number of bytes to send.
+ * @param   flags       Flags for send(2) (ignored for TLS connections).
+ * @return  Number of bytes sent (-1 on error with errno set).
+ *
+ * Data of TLS connections is encrypted (see tls_send).
+ **/
+ssize_t request_send(Request *r, const void *buffer, size_t size, int flags) {
+    if (r->tls) {
+        return tls_send(r, buffer, size);
+    }
+    return send(r->fd, buffer, size, flags);
+}
+
+/**
+ * Send gathered response data to client socket.
+ *
+ * @param   r           Request structure.
+ * @param   iov         Array of buffers to send in order.
+ * @param   n           Number of buffers.
+ * @param   flags       Flags for sendmsg(2) (ignored for TLS connections).
+ * @return  Number of bytes sent (-1 on error with errno set).
+ *
+ * TLS connections send the buffers one after the other, stopping at the first
+ * one that is not sent whole, so a retry starts with the same data.
+ **/
+ssize_t request_sendmsg(Request *r, struct iovec *iov, int n, int flags) {
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = n };
+    ssize_t total = 0;
+
+    if (!r->tls) {
+        return sendmsg(r->fd, &message, flags);
+    }
+
+    for (int i = 0; i < n; i++) {
+        ssize_t nsent = tls_send(r, iov[i].iov_base, iov[i].iov_len);
+        if (nsent < 0) {
+            return total ? total : -1;
         }
-        data = skip_whitespace(data); 
-        chomp(data);
-    
-        Header * curr = calloc(1, sizeof(Header));
-        if( !curr ){
-            fprintf(stderr, "Could Not Allocate Header Struct\n");
-            return -1;
+        total += nsent;
+        if ((size_t)nsent < iov[i].iov_len) {
+            break;
         }
+    }
+    return total;
+}
+
+/**
+ * Send part of file to client socket.
+ *
+ * @param   r           Request structure.
+ * @param   fd          File descriptor of file.
+ * @param   offset      Offset of first byte to send (advanced past the bytes
+ *                      sent).
+ * @param   count       Number of bytes to send.
+ * @return  Number of bytes sent (-1 on error with errno set, EINVAL if the file
+ * must be read and sent instead).
+ *
+ * TLS connections can only send files while the kernel encrypts for them
+ * (see tls_sendfile).
+ **/
+ssize_t request_sendfile(Request *r, int fd, off_t *offset, size_t count) {
+    ssize_t nsent;
 
-        curr->name = strdup(name);
-        curr->data = strdup(data);
-        *trailer = curr;
-        trailer = &(curr->next);
- 
+    if (!r->tls) {
+        return sendfile(r->fd, fd, offset, count);
     }
-    
 
-    if( !r->headers){
-        fprintf(stderr, "Header Loading Unsucessful\n");
-        goto fail;
+    if ((nsent = tls_sendfile(r, fd, *offset, count)) > 0) {
+        *offset += nsent;
     }
+    return nsent;
+}
 
-#ifndef NDEBUG
-    for (Header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->data);
+/**
+ * Send buffered socket stream output (fopencookie write function).
+ *
+ * @param   cookie      Request structure.
+ * @param   buffer      Data to send.
+ * @param   size        Number of bytes to send.
+ * @return  Number of bytes sent (less than size on error).
+ *
+ * A response header followed by a response file is sent with MSG_MORE (see
+ * response_file_pending).
+ **/
+ssize_t socket_stream_write(void *cookie, const char *buffer, size_t size) {
+    Request *r    = cookie;
+    size_t  nsent = 0;
+
+    while (nsent < size) {
+        ssize_t n = request_send(r, buffer + nsent, size - nsent, MSG_NOSIGNAL | (response_file_pending(r) ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        nsent += n;
     }
-#endif
-    return 0;
 
-fail:
-    return -1;
+    r->nsent += nsent;
+    return nsent;
+}
+
+/**
+ * Close client socket (fopencookie close function).
+ *
+ * @param   cookie      Request structure.
+ * @return  0 on success and -1 on error.
+ **/
+int socket_stream_close(void *cookie) {
+    Request *r = cookie;
+    return close(r->fd);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
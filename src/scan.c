@@ -0,0 +1,168 @@
+/* scan.c: Delimiter Scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Internal Declarations */
+typedef const char *(*ScanFunction)(const char *s, size_t length, const char *delimiters, size_t n);
+
+const char *scan_delimiters_scalar(const char *s, size_t length, const char *delimiters, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+const char *scan_delimiters_sse42(const char *s, size_t length, const char *delimiters, size_t n);
+const char *scan_delimiters_avx2(const char *s, size_t length, const char *delimiters, size_t n);
+#elif defined(__aarch64__)
+const char *scan_delimiters_neon(const char *s, size_t length, const char *delimiters, size_t n);
+#endif
+
+/* Internal Variables */
+static ScanFunction ScanDelimiters = scan_delimiters_scalar;
+
+/**
+ * Select fastest scan implementation for this CPU.
+ *
+ * This runs before main, so the selection never changes once requests are
+ * being handled (by any thread).
+ **/
+__attribute__((constructor))
+static void scan_dispatch(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ScanDelimiters = scan_delimiters_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        ScanDelimiters = scan_delimiters_sse42;
+    }
+#elif defined(__aarch64__)
+    ScanDelimiters = scan_delimiters_neon;    /* NEON is mandatory on AArch64 */
+#endif
+}
+
+/**
+ * Find first delimiter in string.
+ *
+ * @param   s           String to scan (need not be NUL-terminated).
+ * @param   length      Number of bytes to scan.
+ * @param   delimiters  Set of delimiter characters (NUL-terminated, at most
+ *                      SCAN_MAX_DELIMITERS of them).
+ * @return  Pointer to first byte of s that is in delimiters (or NULL if there
+ * is none).
+ *
+ * This checks 32 (AVX2) or 16 (SSE4.2, NEON) bytes at a time against every
+ * delimiter, falling back to a byte-by-byte loop on other CPUs and for the
+ * tail of the string.
+ **/
+const char *scan_delimiters(const char *s, size_t length, const char *delimiters) {
+    size_t n = strlen(delimiters);
+
+    if (n == 0 || n > SCAN_MAX_DELIMITERS) {
+        return NULL;
+    }
+    return ScanDelimiters(s, length, delimiters, n);
+}
+
+/**
+ * Find first delimiter in string, one byte at a time.
+ **/
+const char *scan_delimiters_scalar(const char *s, size_t length, const char *delimiters, size_t n) {
+    for (const char *end = s + length; s < end; s++) {
+        for (size_t i = 0; i < n; i++) {
+            if (*s == delimiters[i]) {
+                return s;
+            }
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * Find first delimiter in string, 16 bytes at a time with PCMPESTRI.
+ **/
+__attribute__((target("sse4.2")))
+const char *scan_delimiters_sse42(const char *s, size_t length, const char *delimiters, size_t n) {
+    char set[16] = { 0 };
+    memcpy(set, delimiters, n);
+    __m128i needles = _mm_loadu_si128((const __m128i *)set);
+
+    while (length >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)s);
+        int     index = _mm_cmpestri(needles, n, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return s + index;
+        }
+        s      += 16;
+        length -= 16;
+    }
+
+    return scan_delimiters_scalar(s, length, delimiters, n);
+}
+
+/**
+ * Find first delimiter in string, 32 bytes at a time with AVX2 compares.
+ **/
+__attribute__((target("avx2")))
+const char *scan_delimiters_avx2(const char *s, size_t length, const char *delimiters, size_t n) {
+    __m256i needles[SCAN_MAX_DELIMITERS];
+
+    for (size_t i = 0; i < n; i++) {
+        needles[i] = _mm256_set1_epi8(delimiters[i]);
+    }
+
+    while (length >= 32) {
+        __m256i block   = _mm256_loadu_si256((const __m256i *)s);
+        __m256i matches = _mm256_cmpeq_epi8(block, needles[0]);
+        for (size_t i = 1; i < n; i++) {
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(block, needles[i]));
+        }
+
+        unsigned int mask = _mm256_movemask_epi8(matches);
+        if (mask) {
+            return s + __builtin_ctz(mask);
+        }
+        s      += 32;
+        length -= 32;
+    }
+
+    return scan_delimiters_scalar(s, length, delimiters, n);
+}
+
+#elif defined(__aarch64__)
+
+/**
+ * Find first delimiter in string, 16 bytes at a time with NEON compares.
+ **/
+const char *scan_delimiters_neon(const char *s, size_t length, const char *delimiters, size_t n) {
+    uint8x16_t needles[SCAN_MAX_DELIMITERS];
+
+    for (size_t i = 0; i < n; i++) {
+        needles[i] = vdupq_n_u8(delimiters[i]);
+    }
+
+    while (length >= 16) {
+        uint8x16_t block   = vld1q_u8((const uint8_t *)s);
+        uint8x16_t matches = vceqq_u8(block, needles[0]);
+        for (size_t i = 1; i < n; i++) {
+            matches = vorrq_u8(matches, vceqq_u8(block, needles[i]));
+        }
+
+        if (vmaxvq_u8(matches)) {
+            return scan_delimiters_scalar(s, 16, delimiters, n);
+        }
+        s      += 16;
+        length -= 16;
+    }
+
+    return scan_delimiters_scalar(s, length, delimiters, n);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
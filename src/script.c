@@ -0,0 +1,171 @@
+/* script.c: Script Offload */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SCRIPT_THREADS      8           /* Scripts handled at once */
+
+/* Script Job */
+
+typedef struct script_job ScriptJob;
+struct script_job {
+    Request   *request;                 /*< Request answered by a script */
+    void      *context;                 /*< Connection of the event loop */
+    ScriptJob *next;                    /*< Next job in the same list */
+};
+
+/* Internal Declarations */
+void *script_worker(void *arg);
+
+/* Internal Variables */
+static pthread_mutex_t Lock     = PTHREAD_MUTEX_INITIALIZER;   /* Protects both job lists */
+static pthread_cond_t  Ready    = PTHREAD_COND_INITIALIZER;    /* Signals pending jobs */
+static ScriptJob      *Pending  = NULL;                         /* Jobs waiting for a thread (oldest first) */
+static ScriptJob     **Last     = &Pending;                     /* End of pending jobs */
+static ScriptJob      *Finished = NULL;                         /* Jobs whose response is staged */
+static int             Notify   = -1;                           /* Signalled whenever a job finishes */
+
+/**
+ * Start script threads for an event loop.
+ *
+ * @return  Non-blocking file descriptor that becomes readable whenever a script
+ * finishes (or -1 on error).
+ *
+ * CGI and FastCGI scripts may take arbitrarily long to answer, so rather than
+ * running them inside the event loop, where they would stall every other
+ * connection, the loop hands them to SCRIPT_THREADS threads (see
+ * script_submit) and picks up their responses once they are staged (see
+ * script_complete).  The threads inherit the blocked reload signals of the
+ * loop (see reload_start).
+ **/
+int script_start(void) {
+    if ((Notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could Not Create Script Notification: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < SCRIPT_THREADS; i++) {
+        pthread_t thread;
+        int       status;
+
+        if ((status = pthread_create(&thread, NULL, script_worker, NULL)) != 0) {
+            fprintf(stderr, "Could Not Start Script Thread: %s\n", strerror(status));
+            if (i == 0) {
+                close(Notify);
+                Notify = -1;
+                return -1;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+
+    return Notify;
+}
+
+/**
+ * Hand request to a script thread.
+ *
+ * @param   r           HTTP Request structure (with r->stream to stage the
+ *                      response in).
+ * @param   context     Value returned by script_complete once the response is
+ *                      staged.
+ * @return  Whether the request was handed off (if not, it must be handled by
+ * the caller).
+ *
+ * The thread calls handle_request, so nothing else may touch the request or
+ * its socket until it finishes.
+ **/
+bool script_submit(Request *r, void *context) {
+    ScriptJob *job;
+
+    if (Notify < 0 || !(job = calloc(1, sizeof(ScriptJob)))) {
+        return false;
+    }
+    job->request = r;
+    job->context = context;
+
+    pthread_mutex_lock(&Lock);
+    *Last = job;
+    Last  = &job->next;
+    pthread_cond_signal(&Ready);
+    pthread_mutex_unlock(&Lock);
+    return true;
+}
+
+/**
+ * Take next finished script request.
+ *
+ * @return  Context given to script_submit (or NULL if none has finished).
+ *
+ * This clears the notification first, so a script that finishes after the
+ * last job is taken signals the file descriptor again.  Event loops should
+ * call this until it returns NULL whenever the descriptor is readable.
+ **/
+void *script_complete(void) {
+    ScriptJob *job;
+    uint64_t   count;
+    void      *context = NULL;
+
+    if (read(Notify, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        debug("Could Not Clear Script Notification: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&Lock);
+    if ((job = Finished)) {
+        Finished = job->next;
+    }
+    pthread_mutex_unlock(&Lock);
+
+    if (job) {
+        context = job->context;
+        free(job);
+    }
+    return context;
+}
+
+/**
+ * Handle script requests until the process exits.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ **/
+void *script_worker(void *arg) {
+    uint64_t one = 1;
+
+    while (true) {
+        pthread_mutex_lock(&Lock);
+        while (!Pending) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        ScriptJob *job = Pending;
+        if (!(Pending = job->next)) {
+            Last = &Pending;
+        }
+        pthread_mutex_unlock(&Lock);
+
+        handle_request(job->request);
+
+        pthread_mutex_lock(&Lock);
+        job->next = Finished;
+        Finished  = job;
+        pthread_mutex_unlock(&Lock);
+
+        if (write(Notify, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "Could Not Signal Script Completion: %s\n", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
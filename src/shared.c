@@ -0,0 +1,420 @@
+/* shared.c: Shared Hot File Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SHARED_SLOTS        8192        /* Number of cached representations */
+#define SHARED_WAYS         8           /* Slots per bucket (power of two) */
+#define SHARED_ALIGN        64          /* Alignment of blocks in ring */
+#define SHARED_REVALIDATE   1           /* Seconds between mtime checks */
+
+#define SHARED_ALIGNED(n)   (((n) + SHARED_ALIGN - 1) & ~(uint64_t)(SHARED_ALIGN - 1))
+
+/* Slots and Blocks */
+
+typedef struct shared_slot SharedSlot;
+struct shared_slot {
+    unsigned     seq;                   /*< Even while stable, odd while written */
+    unsigned     pins;                  /*< Requests still sending the entry */
+    size_t       hash;                  /*< Hash of path */
+    Encoding     encoding;              /*< Content coding of entry */
+    bool         stale;                 /*< Whether lookups should skip the entry */
+    uint64_t     position;              /*< Position of block in ring */
+    CacheEntry  *entry;                 /*< Entry in block (or NULL if slot is empty) */
+};
+
+typedef struct {
+    uint64_t     length;                /*< Bytes of ring taken by block */
+    int          slot;                  /*< Slot owning block (-1 for none) */
+} SharedBlock;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Serializes writers (process-shared) */
+    uint64_t     head;                  /*< Position of next block */
+    uint64_t     tail;                  /*< Position of oldest block */
+    uint64_t     capacity;              /*< Size of ring */
+    SharedSlot   slots[SHARED_SLOTS];   /*< Buckets of SHARED_WAYS slots */
+    char         ring[] __attribute__((aligned(SHARED_ALIGN)));
+} SharedCache;
+
+/* Internal Declarations */
+size_t  shared_cache_hash(const char *path);
+void    shared_cache_lock(void);
+bool    shared_cache_reserve(uint64_t length);
+bool    shared_slot_acquire(SharedSlot *slot);
+void    shared_slot_publish(SharedSlot *slot);
+
+/* Internal Variables */
+static SharedCache *Shared = NULL;      /* Mapped at the same address in every worker */
+
+/**
+ * Move files of the hot file cache into memory shared by all workers.
+ *
+ * @return  0 on success and -1 on error.
+ *
+ * The cache is a memfd segment of CacheSize bytes used as a ring of blocks,
+ * each holding a CacheEntry followed by its strings, response header, and
+ * data, plus a table of slots indexing the blocks.  It must be mapped before
+ * any workers are forked, so that it is at the same address in all of them
+ * and the pointers inside entries are valid everywhere.
+ *
+ * Lookups take no lock: a slot is read under its sequence counter and pinned,
+ * which keeps its block from being reused until the entry is released (see
+ * shared_cache_lookup).  Insertions and evictions are serialized by a
+ * process-shared mutex, and the oldest blocks are evicted first as the ring
+ * wraps around.  Directory listings stay in the cache of each worker.
+ **/
+int shared_cache_start(void) {
+    uint64_t            capacity = CacheSize & ~(uint64_t)(SHARED_ALIGN - 1);
+    size_t              size     = sizeof(SharedCache) + capacity;
+    pthread_mutexattr_t attributes;
+    SharedCache        *cache;
+    int                 fd;
+
+    if (!capacity) {
+        return 0;
+    }
+
+    if ((fd = memfd_create("spidey-cache", MFD_CLOEXEC)) < 0 || ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Could Not Create Shared Cache: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        fprintf(stderr, "Could Not Map Shared Cache: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    cache->capacity = capacity;
+    Shared = cache;
+    debug("Shared cache of %zu bytes mapped", (size_t)capacity);
+    return 0;
+}
+
+/**
+ * Determine if the files of the cache are shared.
+ *
+ * @return  Whether or not shared_cache_start succeeded.
+ **/
+bool shared_cache_started(void) {
+    return Shared != NULL;
+}
+
+/**
+ * Lookup file in shared cache.
+ *
+ * @param   path        Resolved path of file.
+ * @param   encoding    Content coding of wanted representation.
+ * @return  Pinned CacheEntry (or NULL if the file is not cached).
+ *
+ * A slot is read between two loads of its sequence counter, with the pin
+ * taken in between: a writer first makes the counter odd and then gives up
+ * if the slot is pinned, so either the second load sees the writer (and the
+ * lookup retries) or the writer sees the pin (and leaves the slot alone).
+ *
+ * As in the private cache, the file is stat'd again at most once every
+ * SHARED_REVALIDATE seconds; a changed entry is marked stale for every worker.
+ *
+ * The returned entry must be released with cache_release.
+ **/
+CacheEntry *shared_cache_lookup(const char *path, Encoding encoding) {
+    size_t      hash;
+    SharedSlot *bucket;
+
+    if (!Shared) {
+        return NULL;
+    }
+
+    hash   = shared_cache_hash(path);
+    bucket = &Shared->slots[(hash & (SHARED_SLOTS / SHARED_WAYS - 1)) * SHARED_WAYS];
+
+    for (int way = 0; way < SHARED_WAYS; way++) {
+        SharedSlot *slot = &bucket[way];
+        CacheEntry *e;
+        unsigned    seq;
+
+        do {
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            e   = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+            if ((seq & 1) || !e || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash ||
+                __atomic_load_n(&slot->encoding, __ATOMIC_RELAXED) != encoding) {
+                e = NULL;
+                break;
+            }
+
+            __atomic_add_fetch(&slot->pins, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == seq) {
+                break;
+            }
+            __atomic_sub_fetch(&slot->pins, 1, __ATOMIC_RELEASE);
+        } while (true);
+
+        if (!e) {
+            continue;
+        }
+
+        if (__atomic_load_n(&slot->stale, __ATOMIC_RELAXED) || !streq(e->path, path)) {
+            __atomic_sub_fetch(&slot->pins, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        time_t now = time(NULL);
+        if (now - __atomic_load_n(&e->checked, __ATOMIC_RELAXED) >= SHARED_REVALIDATE) {
+            struct stat st;
+            if (stat(e->source, &st) < 0 || cache_changed(e, &st)) {
+                __atomic_store_n(&slot->stale, true, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&slot->pins, 1, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+        }
+
+        return e;
+    }
+
+    return NULL;
+}
+
+/**
+ * Copy cache entry into shared cache.
+ *
+ * @param   e           Private CacheEntry structure (not linked into any cache).
+ * @return  Pinned copy of e (or NULL if it could not be stored).
+ *
+ * Any previous representation of the same path and encoding is marked stale.
+ * Room is made by evicting the oldest blocks of the ring, which fails if one
+ * of them is still pinned.  The caller keeps ownership of e.
+ **/
+CacheEntry *shared_cache_insert(CacheEntry *e) {
+    size_t      plength = strlen(e->path) + 1;
+    size_t      slength = strlen(e->source) + 1;
+    size_t      mlength = strlen(e->mimetype) + 1;
+    uint64_t    length  = SHARED_ALIGNED(sizeof(SharedBlock) + sizeof(CacheEntry) + plength + slength + mlength + e->hlength + e->size);
+    size_t      hash    = shared_cache_hash(e->path);
+    SharedSlot *bucket  = &Shared->slots[(hash & (SHARED_SLOTS / SHARED_WAYS - 1)) * SHARED_WAYS];
+    SharedSlot *victim  = NULL;
+    CacheEntry *copy    = NULL;
+
+    if (length > Shared->capacity) {
+        return NULL;
+    }
+
+    shared_cache_lock();
+
+    /* Pick empty slot, or else the stalest and then oldest unpinned one */
+    for (int way = 0; way < SHARED_WAYS; way++) {
+        SharedSlot *slot = &bucket[way];
+
+        if (slot->entry && slot->hash == hash && slot->encoding == e->encoding && streq(slot->entry->path, e->path)) {
+            __atomic_store_n(&slot->stale, true, __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&slot->pins, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (!victim || !slot->entry ||
+            (victim->entry && (slot->stale > victim->stale || (slot->stale == victim->stale && slot->position < victim->position)))) {
+            victim = slot;
+        }
+        if (!victim->entry) {
+            break;
+        }
+    }
+
+    /* Skip the end of the ring if the block does not fit before it */
+    uint64_t offset = Shared->head % Shared->capacity;
+    if (offset + length > Shared->capacity) {
+        uint64_t padding = Shared->capacity - offset;
+
+        if (!shared_cache_reserve(padding)) {
+            goto done;
+        }
+        SharedBlock *block = (SharedBlock *)(Shared->ring + offset);
+        block->length = padding;
+        block->slot   = -1;
+        Shared->head += padding;
+        offset        = 0;
+    }
+
+    if (!victim || !shared_cache_reserve(length)) {
+        goto done;
+    }
+
+    /* Fill block (pointers are valid in every worker, see shared_cache_start) */
+    SharedBlock *block = (SharedBlock *)(Shared->ring + offset);
+    char        *data  = (char *)(block + 1) + sizeof(CacheEntry);
+
+    block->length = length;
+    block->slot   = -1;
+    copy  = (CacheEntry *)(block + 1);
+    *copy = (CacheEntry){
+        .path     = memcpy(data, e->path, plength),
+        .encoding = e->encoding,
+        .variants = e->variants,
+        .source   = memcpy(data + plength, e->source, slength),
+        .mimetype = memcpy(data + plength + slength, e->mimetype, mlength),
+        .header   = memcpy(data + plength + slength + mlength, e->header, e->hlength),
+        .hlength  = e->hlength,
+        .data     = memcpy(data + plength + slength + mlength + e->hlength, e->data, e->size),
+        .size     = e->size,
+        .inode    = e->inode,
+        .length   = e->length,
+        .mtime    = e->mtime,
+        .ctime    = e->ctime,
+        .checked  = e->checked,
+    };
+    uint64_t position = Shared->head;
+    Shared->head += length;
+
+    /* Publish slot, pinned for the caller */
+    if (!shared_slot_acquire(victim)) {
+        copy = NULL;
+        goto done;
+    }
+    victim->hash     = hash;
+    victim->encoding = e->encoding;
+    victim->stale    = false;
+    victim->position = position;
+    victim->entry    = copy;
+    copy->slot       = victim;
+    block->slot      = victim - Shared->slots;
+
+    /* Readers may be adding and dropping pins of their own meanwhile */
+    __atomic_add_fetch(&victim->pins, 1, __ATOMIC_SEQ_CST);
+    shared_slot_publish(victim);
+
+done:
+    pthread_mutex_unlock(&Shared->lock);
+    return copy;
+}
+
+/**
+ * Release pin on shared cache entry.
+ *
+ * @param   e           CacheEntry structure returned by shared_cache_lookup or
+ *                      shared_cache_insert.
+ **/
+void shared_cache_release(CacheEntry *e) {
+    __atomic_sub_fetch(&e->slot->pins, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Mark every entry of shared cache stale.
+ *
+ * The blocks are reused as the ring wraps around (or their slots are).
+ **/
+void shared_cache_flush(void) {
+    if (!Shared) {
+        return;
+    }
+
+    for (size_t i = 0; i < SHARED_SLOTS; i++) {
+        __atomic_store_n(&Shared->slots[i].stale, true, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Hash path string.
+ *
+ * @param   path        Path string.
+ * @return  FNV-1a hash of path.
+ **/
+size_t shared_cache_hash(const char *path) {
+    size_t hash = 2166136261u;
+
+    for (const char *c = path; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Lock shared cache for writing.
+ *
+ * If a worker died holding the lock, its changes are left as they are: every
+ * slot update is published last (a slot it left odd is skipped by lookups and
+ * repaired by the next writer, see shared_slot_acquire).
+ **/
+void shared_cache_lock(void) {
+    if (pthread_mutex_lock(&Shared->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&Shared->lock);
+    }
+}
+
+/**
+ * Evict oldest blocks until there is room for another (lock must be held).
+ *
+ * @param   length      Length of block to make room for.
+ * @return  Whether or not the room was made (false if a block is pinned).
+ **/
+bool shared_cache_reserve(uint64_t length) {
+    while (Shared->head + length - Shared->tail > Shared->capacity) {
+        SharedBlock *block = (SharedBlock *)(Shared->ring + Shared->tail % Shared->capacity);
+
+        if (block->slot >= 0) {
+            SharedSlot *slot = &Shared->slots[block->slot];
+
+            if (slot->entry && slot->position == Shared->tail) {
+                if (!shared_slot_acquire(slot)) {
+                    return false;
+                }
+                slot->entry = NULL;
+                slot->stale = false;
+                shared_slot_publish(slot);
+            }
+        }
+        Shared->tail += block->length;
+    }
+    return true;
+}
+
+/**
+ * Start writing slot, unless it is pinned (lock must be held).
+ *
+ * @param   slot        SharedSlot structure.
+ * @return  Whether or not the slot may be written (see shared_cache_lookup).
+ *
+ * The counter is made odd (it may already be, if a writer died), and made even
+ * again if the slot turns out to be pinned.
+ **/
+bool shared_slot_acquire(SharedSlot *slot) {
+    unsigned seq = slot->seq | 1;
+
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->pins, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Finish writing slot (lock must be held).
+ *
+ * @param   slot        SharedSlot structure.
+ **/
+void shared_slot_publish(SharedSlot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
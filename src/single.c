@@ -12,19 +12,43 @@
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The server socket is non-blocking, since another process (a sibling in a
+ * hot restart, see reload_start) may accept the connection it was woken for.
+ *
+ * Persistent connections (for prefork workers, whose sockets each have a
+ * connection queue of their own) are only kept while no other connection is
+ * waiting on the server socket (see wait_request).
+ *
+ * On SIGQUIT, the server stops accepting once its current connection is done.
  **/
 int single_server(int sfd) {
+    if (socket_nonblocking(sfd) < 0) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
     /* Accept and handle HTTP request */
-    while (true) {
+    while (!(reload_poll(sfd) & RELOAD_DRAIN)) {
     	/* Accept request */
-        Request * r = accept_request(sfd);
+        if (!reload_wait(sfd)) {
+            continue;
+        }
+
+        Request * r = accept_request(sfd, 0);
         if (!r){
-            fprintf(stderr, "Could Not Accept Request\n");
-            return EXIT_FAILURE;
+            continue;
+        }
+
+        /* Limits are shared with sibling prefork workers */
+        if (!admission_acquire(r)) {
+            admission_reject(r);
+            free_request(r);
+            continue;
         }
 
-            
-        handle_request(r);
+        r->waiting = sfd;
+        handle_connection(r);
         
 	/* Free request */
         free_request(r);
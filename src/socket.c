@@ -3,6 +3,7 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,9 +17,17 @@
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
+ * @param   reuseport   Whether or not to set SO_REUSEPORT on the socket.
  * @return  Allocated server socket file descriptor.
+ *
+ * With reuseport, several processes may each bind their own socket to the
+ * same port and the kernel distributes incoming connections among them.
+ *
+ * The accept queue holds ListenBacklog connections (the kernel caps it at
+ * net.core.somaxconn); once it is full, new connections wait in SYN retries
+ * rather than being accepted.
  **/
-int socket_listen(const char *port) {
+int socket_listen(const char *port, bool reuseport) {
     /* Lookup server address information */
     
     // Set Up Hints
@@ -46,6 +55,15 @@ int socket_listen(const char *port) {
             continue;
         }
 
+        // Allow Sibling Sockets to Share the Port
+        int enable = 1;
+        if( reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ){
+            fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
+
         // Attempt to Bind to Socket FD 
         if( (bind(server_fd, ptr->ai_addr, ptr->ai_addrlen)) < 0 ){
             fprintf(stderr, "bind failed: %s\n", strerror(errno));
@@ -55,7 +73,7 @@ int socket_listen(const char *port) {
         }
 
         // Listen on the Socket
-        if (listen(server_fd, SOMAXCONN) < 0 ){
+        if (listen(server_fd, ListenBacklog) < 0 ){
             fprintf(stderr, "listen failed: %s\n", strerror(errno));
             close(server_fd);
             server_fd = -1;
@@ -70,4 +88,19 @@ int socket_listen(const char *port) {
     return server_fd;
 }
 
+/**
+ * Put socket into non-blocking mode.
+ *
+ * @param   fd          Socket file descriptor.
+ * @return  0 on success and -1 on error.
+ **/
+int socket_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
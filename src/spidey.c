@@ -8,12 +8,6 @@
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9898";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
-
 /**
  * Display usage message and exit with specified status code.
  *
@@ -21,14 +15,37 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [haAbBcCeEfikKlmMnpPrsStTwxz]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a path       Access log file, - for standard output (default: none)\n");
+    fprintf(stderr, "    -A format     Access log format: common, combined, or json\n");
+    fprintf(stderr, "    -b length     Listen backlog (default: SOMAXCONN)\n");
+    fprintf(stderr, "    -B seconds    Idle timeout while reading a request body (default: 30)\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Event, Prefork, Threaded, or Uring mode\n");
+    fprintf(stderr, "    -C megabytes  Hot file cache size, 0 to disable (default: 64)\n");
+    fprintf(stderr, "    -e path       TLS certificate chain (PEM, may include the key)\n");
+    fprintf(stderr, "    -E path       TLS private key (PEM, default: in certificate file)\n");
+    fprintf(stderr, "    -f workers    FastCGI workers per .fcgi script (default: 0, disabled)\n");
+    fprintf(stderr, "                  Scripts are found at startup (and on SIGUSR2), not on SIGHUP\n");
+    fprintf(stderr, "    -i conns      Maximum connections per client address, 0 for no limit (default: 0)\n");
+    fprintf(stderr, "    -k seconds    Keep-alive idle timeout (default: 5)\n");
+    fprintf(stderr, "    -K requests   Maximum requests per connection (default: 100)\n");
+    fprintf(stderr, "    -l megabytes  Maximum request body size (default: 16)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n conns      Maximum concurrent connections, 0 for no limit (default: 1024)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -P            Pin workers to CPUs (event, prefork, threaded, and uring modes)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s requests   Log one in this many successful requests (default: 1)\n");
+    fprintf(stderr, "    -S port       Port to listen on for TLS (event mode, default: none)\n");
+    fprintf(stderr, "    -t threads    Number of worker threads (default: CPUs)\n");
+    fprintf(stderr, "    -T seconds    Time allowed to send request headers (default: 10)\n");
+    fprintf(stderr, "    -w workers    Number of prefork workers (default: CPUs)\n");
+    fprintf(stderr, "    -x uri        Serve metrics at this URI, e.g. /_metrics (default: none)\n");
+    fprintf(stderr, "                  Metrics are visible to every client and hide any file there\n");
+    fprintf(stderr, "    -z            Compress text files on the fly (gzip, br)\n");
     exit(status);
 }
 
@@ -40,7 +57,11 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
+ * This should set the mode, AccessLogPath, AccessLogFormat, AccessLogSample,
+ * Affinity, BodyTimeout, CacheSize, Compression, FastCGIWorkers, ListenBacklog,
+ * KeepAliveTimeout, KeepAliveMax, MaxBodySize, MaxConnections,
+ * MaxClientConnections, MimeTypesPath, DefaultMimeType, Port, RequestTimeout,
+ * RootPath, Threads, TLSCertificate, TLSKey, TLSPort, Workers, and MetricsPath
  * if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
@@ -48,31 +69,111 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
     	switch (arg[1]) {
+	    case 'a':
+	    	AccessLogPath = argv[argind++];
+	    	break;
+	    case 'A':
+	    	if (streq(argv[argind], "common")) {
+	    	    AccessLogFormat = ACCESS_LOG_COMMON;
+	    	} else if (streq(argv[argind], "combined")) {
+	    	    AccessLogFormat = ACCESS_LOG_COMBINED;
+	    	} else if (streq(argv[argind], "json")) {
+	    	    AccessLogFormat = ACCESS_LOG_JSON;
+	    	} else {
+	    	    return false;
+	    	}
+	    	argind++;
+	    	break;
+	    case 'b':
+	    	ListenBacklog = atoi(argv[argind++]);
+	    	break;
+	    case 'B':
+	    	BodyTimeout = atoi(argv[argind++]);
+	    	break;
 	    case 'c':
 	    	if (streq(argv[argind], "single")) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+                } else if (streq(argv[argind], "event")) {
+	    	    *mode = EVENT;
+                } else if (streq(argv[argind], "prefork")) {
+	    	    *mode = PREFORK;
+                } else if (streq(argv[argind], "threaded")) {
+	    	    *mode = THREADED;
+                } else if (streq(argv[argind], "uring")) {
+	    	    *mode = URING;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'C':
+	    	CacheSize = strtoul(argv[argind++], NULL, 10) << 20;
+	    	break;
+	    case 'e':
+	    	TLSCertificate = argv[argind++];
+	    	break;
+	    case 'E':
+	    	TLSKey = argv[argind++];
+	    	break;
+	    case 'f':
+	    	FastCGIWorkers = atoi(argv[argind++]);
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'i':
+	    	MaxClientConnections = atoi(argv[argind++]);
+	    	break;
+	    case 'k':
+	    	KeepAliveTimeout = atoi(argv[argind++]);
+	    	break;
+	    case 'K':
+	    	KeepAliveMax = atoi(argv[argind++]);
+	    	break;
+	    case 'l':
+	    	MaxBodySize = strtoul(argv[argind++], NULL, 10) << 20;
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
 	    case 'M':
 	    	DefaultMimeType = argv[argind++];
 	    	break;
+	    case 'n':
+	    	MaxConnections = atoi(argv[argind++]);
+	    	break;
 	    case 'p':
 	    	Port = argv[argind++];
 	    	break;
+	    case 'P':
+	    	Affinity = true;
+	    	break;
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 's':
+	    	AccessLogSample = atoi(argv[argind++]);
+	    	break;
+	    case 'S':
+	    	TLSPort = argv[argind++];
+	    	break;
+	    case 't':
+	    	Threads = atoi(argv[argind++]);
+	    	break;
+	    case 'T':
+	    	RequestTimeout = atoi(argv[argind++]);
+	    	break;
+	    case 'w':
+	    	Workers = atoi(argv[argind++]);
+	    	break;
+	    case 'x':
+	    	MetricsPath = argv[argind++];
+	    	break;
+	    case 'z':
+	    	Compression = true;
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -82,6 +183,24 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
     return true;
 }
 
+/**
+ * Return static string describing ServerMode.
+ *
+ * @param   mode        Server concurrency mode.
+ * @return  Human readable name of mode.
+ */
+const char *server_mode_string(ServerMode mode) {
+    switch (mode) {
+        case SINGLE:    return "Single";
+        case FORKING:   return "Forking";
+        case EVENT:     return "Event";
+        case PREFORK:   return "Prefork";
+        case THREADED:  return "Threaded";
+        case URING:     return "Uring";
+        default:        return "Unknown";
+    }
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
@@ -94,17 +213,72 @@ int main(int argc, char *argv[]) {
     if (! parse_options(argc, argv, &mode))  // If Parsing Fails, Display Usage
         usage(argv[0], EXIT_FAILURE);
 
+    // A single server cannot afford to wait on idle persistent connections
+    if ( mode == SINGLE )
+        KeepAliveMax = 1;
+
+    // Only modes with a fixed set of workers can keep each one on its own CPU
+    if ( Affinity && (mode == SINGLE || mode == FORKING) ){
+        fprintf(stderr, "CPU Affinity Requires Event, Prefork, Threaded, or Uring Mode, Ignoring\n");
+        Affinity = false;
+    }
+
+    // Only the event loop can hold TLS handshakes without blocking a worker
+    if ( TLSPort && mode != EVENT ){
+        fprintf(stderr, "TLS Requires Event Mode, Ignoring\n");
+        TLSPort = NULL;
+    }
+
+    // Build mimetype table once, rather than scanning the file per request
+    if ( load_mimetypes(MimeTypesPath) < 0 )
+        fprintf(stderr, "Could Not Load Mimetypes, Using %s\n", DefaultMimeType);
+
     // Get full rootpath
     char buffer[BUFSIZ];
-    realpath(RootPath, buffer);
+    if ( realpath(RootPath, buffer) == NULL ){
+        fprintf(stderr, "Could Not Resolve Root Path %s: %s\n", RootPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
     RootPath = buffer;
 
-    /* Listen to server socket */
+    // Build error responses once, so sending one is a single write
+    if ( load_error_pages(RootPath) < 0 )
+        fprintf(stderr, "Could Not Build Error Pages\n");
+
+    // Open access log before any workers exist, so they all append to it
+    if ( access_log_start() < 0 )
+        fprintf(stderr, "Could Not Start Access Log\n");
+
+    // Map metrics before any workers are forked, so they all count into it
+    if ( metrics_start() < 0 )
+        fprintf(stderr, "Could Not Start Metrics\n");
+
+    // Map connection counters before any workers are forked, so limits cover all of them
+    if ( admission_start() < 0 )
+        fprintf(stderr, "Could Not Start Admission Control, Admitting Everything\n");
+
+    // Map hot file cache before any workers are forked, so a file read by one is cached for all
+    if ( (mode == FORKING || mode == PREFORK) && shared_cache_start() < 0 )
+        fprintf(stderr, "Could Not Start Shared Cache, Caching Per Worker\n");
+
+    // Start FastCGI workers before serving, so every server mode shares them
+    if ( fastcgi_start() < 0 )
+        fprintf(stderr, "Could Not Start FastCGI Workers, Using CGI\n");
+
+    // Handle SIGHUP, SIGUSR2, and SIGQUIT between requests (after FastCGI, whose workers keep default signals)
+    if ( reload_start(argv) < 0 )
+        fprintf(stderr, "Could Not Start Reload Handling\n");
+
+    /* Listen to server socket (inherited from the previous server on a hot restart) */
     int server_fd;
-    if ( (server_fd = socket_listen(Port) ) < 0 ){
+    if ( (server_fd = reload_listener()) < 0 && (server_fd = socket_listen(Port, mode == PREFORK) ) < 0 ){
         fprintf(stderr, "Server Socket Could Not Be Established\n");  
         return EXIT_FAILURE; 
     }
+
+    // Listen for TLS next to the server socket (also inherited on a hot restart)
+    if ( TLSPort && tls_start() < 0 )
+        fprintf(stderr, "Could Not Start TLS, Serving HTTP Only\n");
     
 
     /* Determine real RootPath */
@@ -112,9 +286,12 @@ int main(int argc, char *argv[]) {
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", server_mode_string(mode));
+
+    /* Start the HTTP server for the selected concurrency mode */
 
-    /* Start either forking or single HTTP server */
+    // Let the previous server drain, now that connections will be accepted
+    reload_ready();
 
     int status; // status of proccesses 
 
@@ -123,6 +300,26 @@ int main(int argc, char *argv[]) {
         status = forking_server(server_fd);
     }
 
+    // Event-driven processes
+    else if ( mode == EVENT ){
+        status = event_server(server_fd);
+    }
+
+    // Pre-forked worker processes
+    else if ( mode == PREFORK ){
+        status = prefork_server(server_fd);
+    }
+
+    // Worker threads
+    else if ( mode == THREADED ){
+        status = threaded_server(server_fd);
+    }
+
+    // Event-driven process on io_uring
+    else if ( mode == URING ){
+        status = uring_server(server_fd);
+    }
+
     // One at a time processes
     else{
         status = single_server(server_fd);
@@ -0,0 +1,198 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define THREADED_QUEUE_SIZE 1024
+
+/* Internal Declarations */
+void  threaded_stop(Queue *q, pthread_t *threads, int nthreads);
+void *threaded_worker(void *arg);
+
+/* Internal Variables */
+static int Started = 0;                  /* Worker threads started so far */
+static int Idle    = 0;                  /* Worker threads waiting on the queue */
+static int Waiting = -1;                 /* Signalled for each connection queued while none is (see wait_request) */
+
+/**
+ * Handle HTTP requests with a pool of worker threads.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server.
+ *
+ * The calling thread accepts connections and pushes them into a bounded
+ * lock-free queue, while Threads worker threads (one per CPU if Threads is not
+ * positive) pop requests from it and handle them.  When the queue is full, the
+ * acceptor yields until a worker frees a slot.
+ *
+ * With Affinity, each worker thread is pinned to a CPU of its own (see
+ * affinity_pin); the acceptor is left to the scheduler.
+ *
+ * Connections over the admission limits are answered with 503 by the acceptor
+ * and never queued.
+ *
+ * A connection queued while every worker is busy also signals an eventfd, so
+ * that one worker waiting on an idle persistent connection closes it and takes
+ * the queued connection instead (see wait_request).
+ *
+ * Only the acceptor takes the reload signals (the workers inherit them
+ * blocked, see reload_start).  On SIGQUIT, it stops accepting and queues one
+ * NULL request per worker behind the queued connections, so each worker exits
+ * once there is nothing left to handle.
+ **/
+int threaded_server(int sfd) {
+    int        nthreads = Threads > 0 ? Threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    Queue     *q;
+
+    if (nthreads <= 0) {
+        nthreads = 1;
+    }
+
+    /* Broken client sockets must not take down every thread */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (socket_nonblocking(sfd) < 0) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    if (!(q = queue_create(THREADED_QUEUE_SIZE)) || !(threads = calloc(nthreads, sizeof(pthread_t)))) {
+        fprintf(stderr, "Could Not Allocate Queue: %s\n", strerror(errno));
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Without it, idle connections are kept for KeepAliveTimeout */
+    if ((Waiting = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Could Not Create Waiting Notification: %s\n", strerror(errno));
+    }
+
+    /* Start workers */
+    for (int i = 0; i < nthreads; i++) {
+        int status;
+
+        if ((status = pthread_create(&threads[i], NULL, threaded_worker, q)) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(status));
+            close(sfd);
+            threaded_stop(q, threads, i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    log("Started %d worker threads", nthreads);
+
+    /* Accept and queue HTTP requests */
+    while (!(reload_poll(sfd) & RELOAD_DRAIN)) {
+        if (!reload_wait(sfd)) {
+            continue;
+        }
+
+        Request *r = accept_request(sfd, 0);
+        if (!r) {
+            continue;
+        }
+
+        if (!admission_acquire(r)) {
+            admission_reject(r);
+            free_request(r);
+            continue;
+        }
+
+        while (!queue_push(q, r)) {
+            sched_yield();
+        }
+
+        uint64_t one = 1;
+        if (Waiting >= 0 && !__atomic_load_n(&Idle, __ATOMIC_SEQ_CST) && write(Waiting, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "Could Not Signal Waiting Connection: %s\n", strerror(errno));
+        }
+    }
+
+    /* Close server socket and let workers finish queued requests */
+    close(sfd);
+    threaded_stop(q, threads, nthreads);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Stop worker threads and release the pool.
+ *
+ * @param   q           Request queue shared with the workers.
+ * @param   threads     Worker threads.
+ * @param   nthreads    Number of worker threads started.
+ *
+ * One NULL request is queued per worker behind any queued connections, so
+ * each worker exits once there is nothing left to handle.  This is also how
+ * a partially started pool is torn down when pthread_create fails.
+ **/
+void threaded_stop(Queue *q, pthread_t *threads, int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        while (!queue_push(q, NULL)) {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    queue_delete(q);
+    if (Waiting >= 0) {
+        close(Waiting);
+        Waiting = -1;
+    }
+}
+
+/**
+ * Handle requests from queue.
+ *
+ * @param   arg         Request queue.
+ * @return  NULL.
+ *
+ * A NULL request (see threaded_server) stops the worker.
+ *
+ * Whichever worker pops a connection retires one pending wakeup, if any, so
+ * that no idle connection is closed for a connection already taken.
+ **/
+void *threaded_worker(void *arg) {
+    Queue   *q     = arg;
+    int      index = __atomic_fetch_add(&Started, 1, __ATOMIC_RELAXED);
+    Request *r;
+    uint64_t count;
+
+    if (Affinity) {
+        affinity_pin(index);
+    }
+
+    while (true) {
+        __atomic_add_fetch(&Idle, 1, __ATOMIC_SEQ_CST);
+        r = queue_pop(q);
+        __atomic_sub_fetch(&Idle, 1, __ATOMIC_SEQ_CST);
+        if (!r) {
+            break;
+        }
+
+        if (Waiting >= 0 && read(Waiting, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "Could Not Retire Waiting Notification: %s\n", strerror(errno));
+        }
+        r->waiting = Waiting;
+        handle_connection(r);
+        free_request(r);
+    }
+
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,113 @@
+/* timer.c: Timer Wheel */
+
+#include "spidey.h"
+
+/**
+ * Arm timer, replacing any deadline it already had.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Timer structure.
+ * @param   deadline    Time (in seconds) at which the timer expires.
+ *
+ * Timers are kept in the slot of their deadline (modulo TIMER_SLOTS), so
+ * arming, rearming, and cancelling a timer are O(1).
+ **/
+void timer_set(TimerWheel *wheel, Timer *timer, time_t deadline) {
+    Timer **slot = &wheel->slots[deadline & (TIMER_SLOTS - 1)];
+
+    timer_cancel(wheel, timer);
+
+    timer->deadline = deadline;
+    timer->prev     = NULL;
+    timer->next     = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot = timer;
+    wheel->armed++;
+}
+
+/**
+ * Disarm timer (if it is armed).
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Timer structure.
+ **/
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer->deadline) {
+        return;
+    }
+
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        wheel->slots[timer->deadline & (TIMER_SLOTS - 1)] = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->deadline = 0;
+    timer->prev     = timer->next = NULL;
+    wheel->armed--;
+}
+
+/**
+ * Disarm and return next expired timer.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   now         Current time (in seconds).
+ * @return  Expired Timer structure (or NULL if no timer has expired).
+ *
+ * The slots of every second since the last call are checked in turn, so
+ * callers should keep calling this until it returns NULL.  Timers more than
+ * TIMER_SLOTS seconds away share a slot with nearer ones and are skipped
+ * until their own deadline comes around.
+ **/
+Timer *timer_expired(TimerWheel *wheel, time_t now) {
+    /* After a long idle period, every slot is checked once */
+    if (wheel->current < now - TIMER_SLOTS) {
+        wheel->current = now - TIMER_SLOTS;
+    }
+
+    while (true) {
+        for (Timer *timer = wheel->slots[wheel->current & (TIMER_SLOTS - 1)]; timer; timer = timer->next) {
+            if (timer->deadline <= now) {
+                timer_cancel(wheel, timer);
+                return timer;
+            }
+        }
+
+        if (wheel->current >= now) {
+            return NULL;
+        }
+        wheel->current++;
+    }
+}
+
+/**
+ * Return armed timer after another (in no particular order).
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Current timer (or NULL for the first one).
+ * @return  Next armed Timer structure (or NULL if there are no more).
+ *
+ * Callers may cancel the current timer once they have the next one, for
+ * instance to close every idle connection.
+ **/
+Timer *timer_next(TimerWheel *wheel, Timer *timer) {
+    size_t slot = 0;
+
+    if (timer) {
+        if (timer->next) {
+            return timer->next;
+        }
+        slot = (timer->deadline & (TIMER_SLOTS - 1)) + 1;
+    }
+
+    for (; slot < TIMER_SLOTS; slot++) {
+        if (wheel->slots[slot]) {
+            return wheel->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,266 @@
+/* tls.c: TLS Termination */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TLS_SESSION_CONTEXT "spidey"        /* Sessions are only resumed by this server */
+#define TLS_SESSION_CACHE   20480           /* Sessions kept for clients without tickets */
+
+/* Internal Declarations */
+ssize_t tls_result(Request *r, int result);
+
+/* Internal Variables */
+static SSL_CTX *Context  = NULL;            /* Certificate, key, and session settings */
+static int      Listener = -1;              /* TLS server socket */
+
+/**
+ * Load TLS certificate and listen for HTTPS connections on TLSPort.
+ *
+ * @return  0 on success and -1 on error.
+ *
+ * Sessions are resumed from session tickets (or, for clients that do not
+ * support them, from a session cache), so returning clients skip the full
+ * handshake.  This must be called before any workers are forked: the ticket
+ * keys are generated here, so every worker accepts the tickets of the others.
+ *
+ * Where the kernel supports it, the negotiated keys are handed to kernel TLS
+ * once the handshake is done, so encryption happens in the kernel and files
+ * are still sent with sendfile (see tls_sendfile).  Otherwise records are
+ * encrypted in user space.
+ *
+ * The server socket is inherited from the previous server on a hot restart
+ * (see reload_tls_listener).
+ **/
+int tls_start(void) {
+    const char *key = TLSKey ? TLSKey : TLSCertificate;
+
+    if (!TLSCertificate) {
+        fprintf(stderr, "Could Not Start TLS: No Certificate Given\n");
+        return -1;
+    }
+
+    if (!(Context = SSL_CTX_new(TLS_server_method()))) {
+        fprintf(stderr, "Could Not Create TLS Context: %s\n", ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+    SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(Context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_id_context(Context, (const unsigned char *)TLS_SESSION_CONTEXT, strlen(TLS_SESSION_CONTEXT));
+    SSL_CTX_set_session_cache_mode(Context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(Context, TLS_SESSION_CACHE);
+
+    if (SSL_CTX_use_certificate_chain_file(Context, TLSCertificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(Context, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(Context) != 1) {
+        fprintf(stderr, "Could Not Load TLS Certificate: %s\n", ERR_error_string(ERR_get_error(), NULL));
+        goto fail;
+    }
+
+    if ((Listener = reload_tls_listener()) < 0 && (Listener = socket_listen(TLSPort, false)) < 0) {
+        fprintf(stderr, "TLS Server Socket Could Not Be Established\n");
+        goto fail;
+    }
+
+    log("Listening for TLS on port %s", TLSPort);
+    return 0;
+
+fail:
+    SSL_CTX_free(Context);
+    Context = NULL;
+    return -1;
+}
+
+/**
+ * Return TLS server socket.
+ *
+ * @return  Server socket file descriptor (or -1 if TLS is not started).
+ **/
+int tls_listener(void) {
+    return Listener;
+}
+
+/**
+ * Start TLS session on accepted client socket.
+ *
+ * @param   r           Request structure.
+ * @return  0 on success and -1 on error.
+ *
+ * The handshake is left to tls_handshake, so that it never blocks.
+ **/
+int tls_open(Request *r) {
+    if (!(r->tls = SSL_new(Context)) || SSL_set_fd(r->tls, r->fd) != 1) {
+        fprintf(stderr, "Could Not Start TLS Session: %s\n", ERR_error_string(ERR_get_error(), NULL));
+        SSL_free(r->tls);
+        r->tls = NULL;
+        return -1;
+    }
+
+    SSL_set_accept_state(r->tls);
+    return 0;
+}
+
+/**
+ * Advance TLS handshake as far as the non-blocking socket allows.
+ *
+ * @param   r           Request structure.
+ * @return  0 when the handshake is done, 1 if the socket would block, and -1
+ * on error.
+ **/
+int tls_handshake(Request *r) {
+    SSL *ssl = r->tls;
+
+    ERR_clear_error();
+    if (tls_result(r, SSL_do_handshake(ssl)) <= 0) {
+        if (errno == EAGAIN)
+            return 1;
+        debug("TLS handshake with %s:%s failed: %s", request_host(r), request_port(r), ERR_error_string(ERR_peek_error(), NULL));
+        return -1;
+    }
+
+    debug("TLS %s with %s:%s (%s%s, kernel TLS send %s, receive %s)", SSL_get_version(ssl),
+          request_host(r), request_port(r), SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? ", resumed" : "",
+          BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+    return 0;
+}
+
+/**
+ * Receive decrypted request data.
+ *
+ * @param   r           Request structure (with r->tls set).
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read (0 on EOF, -1 on error with errno set, EAGAIN
+ * if the socket would block).
+ **/
+ssize_t tls_recv(Request *r, void *buffer, size_t size) {
+    ERR_clear_error();
+    return tls_result(r, SSL_read(r->tls, buffer, size > INT_MAX ? INT_MAX : size));
+}
+
+/**
+ * Send encrypted response data.
+ *
+ * @param   r           Request structure (with r->tls set).
+ * @param   buffer      Data to send.
+ * @param   size        Number of bytes to send.
+ * @return  Number of bytes sent (-1 on error with errno set, EAGAIN if the
+ * socket would block).
+ *
+ * A send that would block must be retried with the same data.
+ **/
+ssize_t tls_send(Request *r, const void *buffer, size_t size) {
+    if (!size) {
+        return 0;
+    }
+
+    ERR_clear_error();
+    return tls_result(r, SSL_write(r->tls, buffer, size > INT_MAX ? INT_MAX : size));
+}
+
+/**
+ * Send part of file with kernel TLS.
+ *
+ * @param   r           Request structure (with r->tls set).
+ * @param   fd          File descriptor of file.
+ * @param   offset      Offset of first byte to send.
+ * @param   size        Number of bytes to send.
+ * @return  Number of bytes sent (-1 on error with errno set, EAGAIN if the
+ * socket would block and EINVAL if the session is not offloaded to the kernel).
+ *
+ * The file goes from the page cache to the socket without a user-space copy,
+ * as with sendfile(2) on a plain socket.
+ **/
+ssize_t tls_sendfile(Request *r, int fd, off_t offset, size_t size) {
+    if (!BIO_get_ktls_send(SSL_get_wbio(r->tls))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ERR_clear_error();
+    ossl_ssize_t nsent = SSL_sendfile(r->tls, fd, offset, size, 0);
+    if (nsent < 0) {
+        return tls_result(r, -1);
+    }
+    return nsent;
+}
+
+/**
+ * Determine if decrypted data is waiting to be received.
+ *
+ * @param   r           Request structure.
+ * @return  Whether tls_recv would return data without reading the socket
+ * (polling the socket does not show it).
+ **/
+bool tls_pending(Request *r) {
+    return r->tls && SSL_pending(r->tls) > 0;
+}
+
+/**
+ * Send close notification, unless the session already did.
+ *
+ * @param   r           Request structure (with r->tls set).
+ *
+ * This does not wait for the client's notification, and on a socket that
+ * would block the notification is dropped.
+ **/
+void tls_shutdown(Request *r) {
+    if (SSL_is_init_finished(r->tls) && !(SSL_get_shutdown(r->tls) & SSL_SENT_SHUTDOWN)) {
+        ERR_clear_error();
+        SSL_shutdown(r->tls);
+    }
+}
+
+/**
+ * End TLS session of request.
+ *
+ * @param   r           Request structure (with r->tls set).
+ **/
+void tls_close(Request *r) {
+    tls_shutdown(r);
+    SSL_free(r->tls);
+    r->tls = NULL;
+}
+
+/**
+ * Translate result of TLS operation into system call convention.
+ *
+ * @param   r           Request structure (with r->tls set).
+ * @param   result      Return value of TLS operation.
+ * @return  result if it is positive, 0 on EOF, and -1 on error (with errno set
+ * to EAGAIN if the operation would block and EPROTO on TLS protocol errors).
+ **/
+ssize_t tls_result(Request *r, int result) {
+    if (result > 0) {
+        return result;
+    }
+
+    switch (SSL_get_error(r->tls, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            errno = 0;
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (!errno)
+                errno = ECONNRESET;
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
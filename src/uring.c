@@ -0,0 +1,830 @@
+/* uring.c: io_uring HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define URING_ENTRIES       1024        /* Submission queue entries */
+#define URING_CHUNK_SIZE    (64 << 10)  /* Bytes of response file read at a time */
+
+#define URING_ACCEPT        1           /* user_data of accept completions */
+#define URING_TIMER         2           /* user_data of timer completions */
+#define URING_CANCEL        3           /* user_data of accept cancellation */
+#define URING_SCRIPT        4           /* user_data of script notifications */
+
+/**
+ * Connection states
+ */
+typedef enum {
+    CONNECTION_READING,                 /**< Receiving request headers */
+    CONNECTION_SCRIPT,                  /**< Waiting for script thread */
+    CONNECTION_WRITING,                 /**< Sending staged response */
+    CONNECTION_CLOSED,                  /**< Connection is finished */
+} ConnectionState;
+
+/**
+ * Connection operations (at most one is in flight per connection)
+ */
+typedef enum {
+    OPERATION_NONE,                     /**< Nothing in flight */
+    OPERATION_RECV,                     /**< Receiving request input */
+    OPERATION_RESPONSE,                 /**< Sending staged response */
+    OPERATION_ENTRY,                    /**< Sending cache entry */
+    OPERATION_PART,                     /**< Sending multipart delimiter */
+    OPERATION_READ,                     /**< Reading response file */
+    OPERATION_CHUNK,                    /**< Sending response file data */
+} Operation;
+
+/* Submission and Completion Rings */
+
+typedef struct {
+    int                  fd;            /*< io_uring file descriptor */
+    void                *rings;         /*< Mapping of both rings */
+    size_t               rsize;         /*< Size of rings mapping */
+    struct io_uring_sqe *sqes;          /*< Submission queue entries */
+    size_t               ssize;         /*< Size of sqes mapping */
+
+    unsigned            *sq_head;       /*< Next entry consumed by kernel */
+    unsigned            *sq_tail;       /*< Next entry published to kernel */
+    unsigned            *sq_array;      /*< Indexes of published entries */
+    unsigned             sq_mask;       /*< Number of entries - 1 */
+    unsigned             sq_entries;    /*< Number of entries */
+    unsigned             sq_next;       /*< Next entry to prepare */
+
+    unsigned            *cq_head;       /*< Next completion to reap */
+    unsigned            *cq_tail;       /*< Next completion posted by kernel */
+    unsigned             cq_mask;       /*< Number of completions - 1 */
+    struct io_uring_cqe *cqes;          /*< Completion queue entries */
+} Ring;
+
+/* Client Connection */
+
+typedef struct connection Connection;
+struct connection {
+    Timer            timer;             /*< Current deadline (first, see uring_expire) */
+    Request         *request;           /*< Client request */
+    ConnectionState  state;             /*< Current state of connection */
+    Operation        operation;         /*< Operation in flight */
+    char            *response;          /*< Staged response data */
+    size_t           length;            /*< Length of staged response */
+    size_t           sent;              /*< Number of response bytes sent */
+    uint64_t         responded;         /*< Time response was staged (0 once sent) */
+    char            *chunk;             /*< Response file data (URING_CHUNK_SIZE) */
+    size_t           chunk_length;      /*< Number of bytes in chunk */
+    size_t           chunk_sent;        /*< Number of chunk bytes sent */
+    struct iovec     iov[3];            /*< Unsent part of cache entry */
+    struct msghdr    message;           /*< Cache entry message (refers to iov) */
+    bool             eof;               /*< Whether client finished sending */
+    time_t           header;            /*< Time request started arriving (0 while idle) */
+};
+
+/* Internal Declarations */
+int  uring_setup(Ring *ring, unsigned entries);
+int  uring_enter(Ring *ring, unsigned wait);
+struct io_uring_sqe *uring_sqe(Ring *ring);
+void uring_reap(Ring *ring, int sfd);
+void uring_arm_accept(int sfd);
+void uring_arm_timer(void);
+void uring_arm_script(void);
+bool uring_submit(Connection *c, Operation operation, int opcode, int fd, void *addr, size_t length, off_t offset);
+int  uring_send_flags(Connection *c, Operation operation);
+void uring_open(int fd);
+void uring_complete(Connection *c, int result);
+void uring_process(Connection *c);
+void uring_respond(Connection *c);
+void uring_staged(Connection *c);
+bool uring_write(Connection *c);
+void uring_schedule(Connection *c);
+void uring_expire(void);
+void uring_drain(int sfd);
+void uring_close(Connection *c);
+
+/* Internal Variables */
+static Ring        Uring;               /* Server ring */
+static bool        Multishot = true;    /* Whether kernel supports multishot accept */
+static TimerWheel  Timers;              /* Connection deadlines */
+static bool        Draining  = false;   /* Whether accepting has stopped */
+static int         ScriptFD  = -1;      /* Script completion notification (see script_start) */
+static size_t      Scripts   = 0;       /* Connections waiting for script threads */
+static struct __kernel_timespec Interval = { .tv_sec = 1 };   /* Expiry check period */
+
+/**
+ * Handle HTTP requests with a single io_uring event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_FAILURE if the loop fails).
+ *
+ * This works like event_server, except that every socket and file operation
+ * is submitted to an io_uring instance instead of being attempted when epoll
+ * reports readiness:
+ *
+ *  - A multishot accept on the server socket yields each new connection.
+ *
+ *  - Request input is received directly into the request buffer.
+ *
+ *  - Staged responses and cache entries are sent with send and sendmsg, and
+ *    response files are read in URING_CHUNK_SIZE chunks and then sent, so a
+ *    read from a cold disk only delays its own connection.
+ *
+ *  - Script requests are handed to script threads (see script_submit), and a
+ *    poll on their notification reports when responses are staged.
+ *
+ * Operations prepared while handling one batch of completions are submitted
+ * together by the same io_uring_enter call that waits for the next batch.
+ *
+ * With Affinity, the loop is pinned to one CPU (see affinity_pin) before the
+ * rings are mapped.  If io_uring is not available, this falls back to
+ * event_server.
+ *
+ * As in event_server, the reload signals are only taken while waiting for
+ * completions, and on SIGQUIT the server drains its connections (see
+ * uring_drain) and exits.
+ **/
+int uring_server(int sfd) {
+    if (Affinity) {
+        affinity_pin(0);
+    }
+
+    if (uring_setup(&Uring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "Could Not Setup io_uring (%s), Using epoll\n", strerror(errno));
+        return event_server(sfd);
+    }
+
+    uring_arm_accept(sfd);
+    uring_arm_timer();
+    if ((ScriptFD = script_start()) >= 0) {
+        uring_arm_script();
+    }
+
+    /* Submit prepared operations and dispatch completions until drained */
+    while (!Draining || Timers.armed || Scripts) {
+        if (uring_enter(&Uring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            break;
+        }
+        uring_reap(&Uring, sfd);
+
+        if (!Draining && (reload_poll(sfd) & RELOAD_DRAIN)) {
+            uring_drain(sfd);
+        }
+    }
+
+    munmap(Uring.sqes, Uring.ssize);
+    munmap(Uring.rings, Uring.rsize);
+    close(Uring.fd);
+    if (!Draining) {
+        close(sfd);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Create io_uring instance and map its rings.
+ *
+ * @param   ring        Ring structure.
+ * @param   entries     Number of submission queue entries.
+ * @return  0 on success and -1 on error.
+ *
+ * The completion queue is made four times larger than the submission queue,
+ * since accept and timer completions may arrive alongside one completion for
+ * every connection.
+ **/
+int uring_setup(Ring *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return -1;
+    }
+
+    /* Both rings share one mapping (Linux 5.4+) */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->rsize = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->ssize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes  = mmap(NULL, ring->ssize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->rings, ring->rsize);
+        goto fail;
+    }
+
+    char *base = ring->rings;
+    ring->sq_head    = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail    = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_array   = (unsigned *)(base + p.sq_off.array);
+    ring->sq_mask    = *(unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_next    = *ring->sq_tail;
+    ring->cq_head    = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail    = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask    = *(unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        close(ring->fd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/**
+ * Submit prepared entries and optionally wait for completions.
+ *
+ * @param   ring        Ring structure.
+ * @param   wait        Number of completions to wait for.
+ * @return  Number of entries submitted (or -1 on error).
+ *
+ * While waiting, the reload signals are unblocked (see reload_sigmask).
+ **/
+int uring_enter(Ring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_next, __ATOMIC_RELEASE);
+
+    unsigned pending = ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                   wait ? reload_sigmask() : NULL, _NSIG / 8);
+}
+
+/**
+ * Prepare next submission queue entry.
+ *
+ * @param   ring        Ring structure.
+ * @return  Zeroed entry (or NULL if the queue is full and cannot be flushed).
+ *
+ * If the queue is full, the prepared entries are submitted first.
+ **/
+struct io_uring_sqe *uring_sqe(Ring *ring) {
+    if (ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        if (uring_enter(ring, 0) < 0 || ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sq_next++ & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+/**
+ * Dispatch all posted completions.
+ *
+ * @param   ring        Ring structure.
+ * @param   sfd         Server socket file descriptor.
+ **/
+void uring_reap(Ring *ring, int sfd) {
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t data   = cqe->user_data;
+        int      result = cqe->res;
+        unsigned flags  = cqe->flags;
+
+        /* Release slot before handling, which may post more completions */
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (data == URING_ACCEPT) {
+            if (result >= 0) {
+                uring_open(result);
+            } else if (result == -EINVAL && Multishot) {
+                Multishot = false;      /* Kernel predates multishot accept (5.19) */
+            } else if (result != -EINTR && result != -EAGAIN && result != -ECANCELED) {
+                fprintf(stderr, "Accept Failure: %s\n", strerror(-result));
+            }
+            if (!(flags & IORING_CQE_F_MORE) && !Draining) {
+                uring_arm_accept(sfd);
+            }
+        } else if (data == URING_TIMER) {
+            uring_expire();
+            uring_arm_timer();
+        } else if (data == URING_CANCEL) {
+            continue;
+        } else if (data == URING_SCRIPT) {
+            Connection *c;
+
+            while ((c = script_complete())) {
+                Scripts--;
+                uring_staged(c);
+                uring_process(c);
+            }
+            uring_arm_script();
+        } else {
+            uring_complete((Connection *)(uintptr_t)data, result);
+        }
+    }
+}
+
+/**
+ * Submit accept on server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ **/
+void uring_arm_accept(int sfd) {
+    struct io_uring_sqe *sqe = uring_sqe(&Uring);
+
+    if (!sqe) {
+        fprintf(stderr, "Could Not Submit Accept\n");
+        return;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = sfd;
+    sqe->ioprio       = Multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data    = URING_ACCEPT;
+}
+
+/**
+ * Submit timeout that triggers the next expiry check.
+ **/
+void uring_arm_timer(void) {
+    struct io_uring_sqe *sqe = uring_sqe(&Uring);
+
+    if (!sqe) {
+        fprintf(stderr, "Could Not Submit Timer\n");
+        return;
+    }
+    sqe->opcode    = IORING_OP_TIMEOUT;
+    sqe->addr      = (uintptr_t)&Interval;
+    sqe->len       = 1;
+    sqe->user_data = URING_TIMER;
+}
+
+/**
+ * Submit poll that reports finished script requests.
+ **/
+void uring_arm_script(void) {
+    struct io_uring_sqe *sqe = uring_sqe(&Uring);
+
+    if (!sqe) {
+        fprintf(stderr, "Could Not Submit Script Poll\n");
+        return;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = ScriptFD;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = URING_SCRIPT;
+}
+
+/**
+ * Submit operation for connection.
+ *
+ * @param   c           Client connection.
+ * @param   operation   Kind of operation (recorded for its completion).
+ * @param   opcode      io_uring opcode.
+ * @param   fd          File descriptor to operate on.
+ * @param   addr        Buffer (or msghdr for IORING_OP_SENDMSG).
+ * @param   length      Length of buffer (or 1 for IORING_OP_SENDMSG).
+ * @param   offset      File offset (for IORING_OP_READ).
+ * @return  Whether or not the operation was queued.
+ **/
+bool uring_submit(Connection *c, Operation operation, int opcode, int fd, void *addr, size_t length, off_t offset) {
+    struct io_uring_sqe *sqe = uring_sqe(&Uring);
+
+    if (!sqe) {
+        fprintf(stderr, "Could Not Submit Operation\n");
+        return false;
+    }
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)addr;
+    sqe->len       = length;
+    sqe->off       = offset;
+    sqe->msg_flags = opcode == IORING_OP_SEND || opcode == IORING_OP_SENDMSG ? uring_send_flags(c, operation) : 0;
+    sqe->user_data = (uintptr_t)c;
+
+    c->operation = operation;
+    return true;
+}
+
+/**
+ * Determine flags of send operation.
+ *
+ * @param   c           Client connection.
+ * @param   operation   Send operation being submitted.
+ * @return  MSG_NOSIGNAL, with MSG_MORE if file data follows the data sent.
+ *
+ * As in send_response_file, the staged header, file chunks, and part
+ * delimiters are held back to share TCP segments with the file data after
+ * them (see response_file_pending).
+ **/
+int uring_send_flags(Connection *c, Operation operation) {
+    Request *r    = c->request;
+    bool     more = false;
+
+    switch (operation) {
+        case OPERATION_RESPONSE:
+        case OPERATION_CHUNK:
+            more = response_file_pending(r);
+            break;
+        case OPERATION_PART:
+            more = r->ranges[r->range].end > r->ranges[r->range].start;
+            break;
+        default:
+            break;
+    }
+    return MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+}
+
+/**
+ * Start connection for accepted client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ **/
+void uring_open(int fd) {
+    Connection *c;
+    Request *r;
+
+    /* Multishot accept does not report addresses, so the client address is
+     * looked up only if needed (see request_host) */
+    if (!(r = open_request(fd, NULL, 0))) {
+        return;
+    }
+
+    if (!admission_acquire(r)) {
+        admission_reject(r);
+        free_request(r);
+        return;
+    }
+
+    if (!(c = calloc(1, sizeof(Connection)))) {
+        fprintf(stderr, "Could Not Allocate Connection\n");
+        free_request(r);
+        return;
+    }
+    c->request = r;
+    c->state   = CONNECTION_READING;
+    c->header  = time(NULL);
+    timer_set(&Timers, &c->timer, c->header + RequestTimeout);
+    metrics_connection(1);
+    uring_process(c);
+}
+
+/**
+ * Handle completion of connection operation.
+ *
+ * @param   c           Client connection.
+ * @param   result      Result of operation (negative errno on error).
+ *
+ * This records the progress made by the operation and then advances the
+ * connection state machine.
+ **/
+void uring_complete(Connection *c, int result) {
+    Request  *r = c->request;
+    Operation operation = c->operation;
+
+    c->operation = OPERATION_NONE;
+
+    /* Connection was shut down while the operation was in flight */
+    if (c->state == CONNECTION_CLOSED) {
+        uring_close(c);
+        return;
+    }
+
+    if (result < 0) {
+        /* Interrupted operations are resubmitted unchanged */
+        if (result != -EINTR && result != -EAGAIN)
+            c->state = CONNECTION_CLOSED;
+        uring_process(c);
+        return;
+    }
+
+    switch (operation) {
+        case OPERATION_RECV:
+            if (result == 0)
+                c->eof = true;
+            r->nread += result;
+            break;
+
+        case OPERATION_RESPONSE:
+            c->sent += result;
+            r->nsent += result;
+            break;
+
+        case OPERATION_ENTRY:
+            r->file_offset += result;
+            r->nsent += result;
+            break;
+
+        case OPERATION_PART:
+            r->nsent += result;
+            /* Once the delimiter is sent, continue with its range of the file */
+            if ((r->range_sent += result) == r->ranges[r->range].hlength) {
+                r->file_offset = r->ranges[r->range].start;
+                r->file_end    = r->ranges[r->range].end;
+                r->range++;
+                r->range_sent  = 0;
+            }
+            break;
+
+        case OPERATION_READ:
+            /* File was truncated while sending */
+            if (result == 0)
+                c->state = CONNECTION_CLOSED;
+            c->chunk_length = result;
+            c->chunk_sent   = 0;
+            r->file_offset += result;
+            break;
+
+        case OPERATION_CHUNK:
+            c->chunk_sent += result;
+            r->nsent += result;
+            break;
+
+        case OPERATION_NONE:
+            break;
+    }
+
+    uring_process(c);
+}
+
+/**
+ * Advance connection state machine until an operation is in flight.
+ *
+ * @param   c           Client connection.
+ **/
+void uring_process(Connection *c) {
+    Request *r = c->request;
+
+    while (true) {
+        switch (c->state) {
+            case CONNECTION_READING:
+                if (parse_request_input(r) != 0) {
+                    uring_respond(c);
+                } else if (c->eof) {
+                    c->state = CONNECTION_CLOSED;
+                } else if (uring_submit(c, OPERATION_RECV, IORING_OP_RECV, r->fd, r->buffer + r->nread, sizeof(r->buffer) - r->nread, 0)) {
+                    uring_schedule(c);
+                    return;
+                } else {
+                    c->state = CONNECTION_CLOSED;
+                }
+                break;
+
+            case CONNECTION_SCRIPT:
+                return;
+
+            case CONNECTION_WRITING:
+                if (uring_write(c)) {
+                    uring_schedule(c);
+                    return;
+                }
+                break;
+
+            case CONNECTION_CLOSED:
+                uring_close(c);
+                return;
+        }
+    }
+}
+
+/**
+ * Handle buffered request and stage response.
+ *
+ * @param   c           Client connection.
+ *
+ * As in event_server, the request handlers write to a memory stream that
+ * collects the response (except for any cache entry or file body), and script
+ * requests are handed to a script thread.
+ **/
+void uring_respond(Connection *c) {
+    Request *r = c->request;
+
+    r->stream = open_memstream(&c->response, &c->length);
+    if (!r->stream) {
+        fprintf(stderr, "Could Not Open Response Stream: %s\n", strerror(errno));
+        c->state  = CONNECTION_CLOSED;
+        return;
+    }
+
+    if (request_script(r) && script_submit(r, c)) {
+        timer_cancel(&Timers, &c->timer);
+        c->state = CONNECTION_SCRIPT;
+        Scripts++;
+        return;
+    }
+
+    handle_request(r);
+    uring_staged(c);
+}
+
+/**
+ * Finish staging response.
+ *
+ * @param   c           Client connection.
+ **/
+void uring_staged(Connection *c) {
+    Request *r = c->request;
+
+    fclose(r->stream);
+    r->stream    = NULL;
+    c->state     = CONNECTION_WRITING;
+    c->responded = metrics_now();
+}
+
+/**
+ * Submit next operation of staged response.
+ *
+ * @param   c           Client connection.
+ * @return  Whether or not an operation is in flight.
+ *
+ * The response is sent in the following order: the staged data, then either
+ * the cache entry or the response file.  Files are read into c->chunk and then
+ * sent, with each part of a multipart response preceded by its delimiter.
+ *
+ * Once the response is complete, a persistent connection is reset for the
+ * next request and moves back to CONNECTION_READING; otherwise it is marked
+ * closed.
+ **/
+bool uring_write(Connection *c) {
+    Request *r = c->request;
+    bool submitted;
+    int  n;
+
+    if (c->sent < c->length) {
+        submitted = uring_submit(c, OPERATION_RESPONSE, IORING_OP_SEND, r->fd, c->response + c->sent, c->length - c->sent, 0);
+    } else if (r->entry && (n = response_entry_vector(r, c->iov)) > 0) {
+        c->message = (struct msghdr){ .msg_iov = c->iov, .msg_iovlen = n };
+        submitted  = uring_submit(c, OPERATION_ENTRY, IORING_OP_SENDMSG, r->fd, &c->message, 1, 0);
+    } else if (c->chunk_sent < c->chunk_length) {
+        submitted = uring_submit(c, OPERATION_CHUNK, IORING_OP_SEND, r->fd, c->chunk + c->chunk_sent, c->chunk_length - c->chunk_sent, 0);
+    } else if (r->file >= 0 && r->file_offset < r->file_end) {
+        size_t remaining = r->file_end - r->file_offset;
+
+        if (!c->chunk && !(c->chunk = malloc(URING_CHUNK_SIZE))) {
+            c->state = CONNECTION_CLOSED;
+            return false;
+        }
+        submitted = uring_submit(c, OPERATION_READ, IORING_OP_READ, r->file, c->chunk,
+                                 remaining < URING_CHUNK_SIZE ? remaining : URING_CHUNK_SIZE, r->file_offset);
+    } else if (r->file >= 0 && r->range < r->nranges) {
+        const Range *part = &r->ranges[r->range];
+        submitted = uring_submit(c, OPERATION_PART, IORING_OP_SEND, r->fd, (char *)part->header + r->range_sent, part->hlength - r->range_sent, 0);
+    } else {
+        response_complete(r, c->responded);
+        c->responded = 0;
+
+        free(c->response);
+        c->response     = NULL;
+        c->length       = 0;
+        c->sent         = 0;
+        c->chunk_length = 0;
+        c->chunk_sent   = 0;
+
+        if (r->keepalive && !reload_draining()) {
+            reset_request(r);
+            c->state  = CONNECTION_READING;
+            c->header = 0;
+            timer_set(&Timers, &c->timer, time(NULL) + KeepAliveTimeout);
+        } else {
+            c->state = CONNECTION_CLOSED;
+        }
+        return false;
+    }
+
+    if (!submitted) {
+        c->state = CONNECTION_CLOSED;
+    }
+    return submitted;
+}
+
+/**
+ * Update deadline of connection that is waiting on an operation.
+ *
+ * @param   c           Client connection.
+ *
+ * As in event_server (see connection_schedule), writes may each take up to
+ * KeepAliveTimeout seconds, while request headers must arrive within
+ * RequestTimeout seconds of their first byte.
+ **/
+void uring_schedule(Connection *c) {
+    Request *r   = c->request;
+    time_t   now = time(NULL);
+
+    if (c->state == CONNECTION_WRITING) {
+        timer_set(&Timers, &c->timer, now + KeepAliveTimeout);
+    } else if (!c->header && r->nread > r->offset) {
+        c->header = now;
+        timer_set(&Timers, &c->timer, now + RequestTimeout);
+    }
+}
+
+/**
+ * Close connections whose deadline has passed.
+ *
+ * A connection always has an operation in flight, so its socket is shut down
+ * to complete that operation, and the connection is released once it does.
+ * One that did not send its request headers in time is answered with 408
+ * first (only a receive is in flight then, so the response can be sent
+ * directly).
+ **/
+void uring_expire(void) {
+    time_t now = time(NULL);
+    Timer *timer;
+
+    while ((timer = timer_expired(&Timers, now))) {
+        Connection *c = (Connection *)timer;
+
+        if (c->state == CONNECTION_READING && c->header)
+            response_abort(c->request, HTTP_STATUS_REQUEST_TIMEOUT);
+
+        c->state = CONNECTION_CLOSED;
+        if (c->operation == OPERATION_NONE)
+            uring_close(c);
+        else
+            shutdown(c->request->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Stop accepting connections and close idle ones.
+ *
+ * @param   sfd         Server socket file descriptor.
+ *
+ * The accept in flight is cancelled, and idle connections are shut down as in
+ * uring_expire.  Every other connection finishes its current response and is
+ * then closed instead of kept alive (see uring_write).
+ **/
+void uring_drain(int sfd) {
+    struct io_uring_sqe *sqe = uring_sqe(&Uring);
+    Timer *next;
+
+    if (sqe) {
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = URING_ACCEPT;
+        sqe->user_data = URING_CANCEL;
+    }
+    close(sfd);
+    Draining = true;
+
+    for (Timer *timer = timer_next(&Timers, NULL); timer; timer = next) {
+        Connection *c = (Connection *)timer;
+        Request    *r = c->request;
+
+        next = timer_next(&Timers, timer);
+        if (c->state != CONNECTION_READING || c->header || r->nread > r->offset)
+            continue;
+
+        timer_cancel(&Timers, &c->timer);
+        c->state = CONNECTION_CLOSED;
+        if (c->operation == OPERATION_NONE)
+            uring_close(c);
+        else
+            shutdown(r->fd, SHUT_RDWR);
+    }
+
+    log("Draining %zu connections", Timers.armed + Scripts);
+}
+
+/**
+ * Release client connection.
+ *
+ * @param   c           Client connection (with no operation in flight).
+ **/
+void uring_close(Connection *c) {
+    timer_cancel(&Timers, &c->timer);
+
+    /* Account for abandoned response */
+    if (c->responded)
+        response_complete(c->request, c->responded);
+
+    free(c->response);
+    free(c->chunk);
+    free_request(c->request);
+    free(c);
+    metrics_connection(-1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
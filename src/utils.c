@@ -4,108 +4,324 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Mimetype Table */
+
+typedef struct {
+    const char *extension;              /*< File extension (without '.') */
+    const char *mimetype;               /*< Corresponding mimetype */
+} MimeEntry;
+
+typedef struct {
+    MimeEntry  *entries;                /*< Open addressing hash table */
+    size_t      mask;                   /*< Number of table slots - 1 */
+    char       *data;                   /*< Contents of MimeTypesPath */
+} MimeTable;
+
+static MimeTable *Mimetypes = NULL;     /* Current table (see load_mimetypes) */
+
+/* Path Cache */
+
+#define PATH_CACHE_SLOTS    1024        /* Number of cached URIs (power of two) */
+#define PATH_CACHE_TTL      1           /* Seconds a resolution stays valid */
+
+typedef struct {
+    char       *uri;                    /*< Requested URI (or NULL if slot is unused) */
+    char       *path;                   /*< Resolved path (or NULL if not servable) */
+    mode_t      mode;                   /*< File type and permissions of path */
+    time_t      resolved;               /*< Time of resolution */
+} PathEntry;
+
+static PathEntry       PathCache[PATH_CACHE_SLOTS];   /* Direct mapped by URI hash */
+static pthread_mutex_t PathCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Internal Declarations */
+bool    path_within_root(const char *path);
+size_t  path_hash(const char *uri);
+
 /**
- * Determine mime-type from file extension.
+ * Hash file extension (case-insensitive).
  *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @param   extension   File extension.
+ * @return  FNV-1a hash of lowercase extension.
+ **/
+static size_t mimetype_hash(const char *extension) {
+    size_t hash = 2166136261u;
+
+    for (const char *c = extension; *c; c++) {
+        hash ^= (unsigned char)tolower((unsigned char)*c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Load mime-types table from file.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * @param   path        Path to mime.types file.
+ * @return  Number of extensions loaded (or -1 on error).
  *
  * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * This reads the whole file once and indexes every extension on every line in
+ * an open addressing hash table.  If an extension appears on several lines,
+ * the first mimetype wins.  Entries point directly into the file contents, so
+ * lookups need no allocation.
  *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
- *
- * This function returns an allocated string that must be free'd.
+ * Each table is read-only once built, so it may be shared among threads.
+ * Loading again (see reload_poll) publishes a new table atomically, while the
+ * previous one is kept: cache entries and requests in flight may still point
+ * at its mimetype strings.
  **/
-char * determine_mimetype(const char *path) {
-    char *ext;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
+int load_mimetypes(const char *path) {
+    FILE      *fs;
+    char      *data = NULL;
+    size_t     length = 0;
+    size_t     count = 0;
+    size_t     capacity = 0;
+    MimeEntry *entries = NULL;
+    MimeEntry *table = NULL;
+    MimeTable *mimetypes = NULL;
+    size_t     size = 16;
+    char      *line;
+    char      *lineptr;
 
-    /* Find file extension */
-    ext = strrchr(path, '/');
-
-    if( ! (ext = strchr(ext, '.')))
-        return strdup(DefaultMimeType) ;
-    else
-        ext++;
-     
-    /* Open MimeTypesPath file */
-    if ( ! (fs = fopen(MimeTypesPath, "r"))){
+    /* Read MimeTypesPath file */
+    if ( ! (fs = fopen(path, "r"))){
         fprintf(stderr, "Fopen Error on MimeTypesPaths: %s\n", strerror(errno));
-        return strdup(DefaultMimeType);
+        return -1;
     }
 
-    /* Scan file for matching file extensions */
+    FILE *contents = open_memstream(&data, &length);
+    if (!contents) {
+        fclose(fs);
+        return -1;
+    }
 
+    char   buffer[BUFSIZ];
+    size_t nread;
+    while ((nread = fread(buffer, 1, sizeof(buffer), fs)) > 0) {
+        fwrite(buffer, 1, nread, contents);
+    }
+    fclose(fs);
+    fclose(contents);
 
-    while( fgets(buffer, BUFSIZ, fs) > 0){
-        if( buffer[0] == '#' || buffer[0] == '\n')
-            continue;
+    /* Collect (extension, mimetype) pairs */
+    for (line = strtok_r(data, "\n", &lineptr); line; line = strtok_r(NULL, "\n", &lineptr)) {
+        char *saveptr;
+        char *mimetype;
+        char *extension;
 
-        token = strtok(buffer, WHITESPACE);
+        if (line[0] == '#' || !(mimetype = strtok_r(line, WHITESPACE, &saveptr)))
+            continue;
 
-        if( (token = strtok(NULL, WHITESPACE)) != 0 ){
-            if( streq(token, ext) ){
-                fclose(fs);
-                return strdup(strtok(buffer, WHITESPACE));
+        while ((extension = strtok_r(NULL, WHITESPACE, &saveptr))) {
+            if (count == capacity) {
+                capacity  = capacity ? capacity * 2 : 1024;
+                MimeEntry *resized = realloc(entries, capacity * sizeof(MimeEntry));
+                if (!resized)
+                    goto fail;
+                entries = resized;
             }
+            entries[count++] = (MimeEntry){ extension, mimetype };
         }
-   
-    } 
+    }
 
-    fclose(fs);
-    return strdup(DefaultMimeType);
+    /* Build table with a load factor of at most 1/2 */
+    while (size < 2 * count) {
+        size <<= 1;
+    }
+
+    if (!(table = calloc(size, sizeof(MimeEntry))) || !(mimetypes = malloc(sizeof(MimeTable))))
+        goto fail;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = mimetype_hash(entries[i].extension) & (size - 1);
+
+        while (table[slot].extension && strcasecmp(table[slot].extension, entries[i].extension)) {
+            slot = (slot + 1) & (size - 1);
+        }
+        if (!table[slot].extension) {
+            table[slot] = entries[i];
+        }
+    }
+    free(entries);
+
+    /* Replace previous table (which is never freed, see above) */
+    mimetypes->entries = table;
+    mimetypes->mask    = size - 1;
+    mimetypes->data    = data;
+    __atomic_store_n(&Mimetypes, mimetypes, __ATOMIC_RELEASE);
+
+    debug("Loaded %zu mimetype extensions from %s", count, path);
+    return count;
+
+fail:
+    free(entries);
+    free(table);
+    free(data);
+    return -1;
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @return  A static string containing the mime-type of the specified file.
+ *
+ * This function finds the file's extension (after the last '.' of the last
+ * path component) and looks it up in the table built by load_mimetypes.
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ *
+ * The returned string must not be modified or free'd.
+ **/
+const char * determine_mimetype(const char *path) {
+    MimeTable  *mimetypes = __atomic_load_n(&Mimetypes, __ATOMIC_ACQUIRE);
+    const char *ext;
+
+    /* Find file extension */
+    if( (ext = strrchr(path, '/')) == NULL )
+        ext = path;
+
+    if( ! (ext = strrchr(ext, '.')) || !mimetypes )
+        return DefaultMimeType;
+    ext++;
+
+    /* Probe table for matching file extension */
+    for (size_t slot = mimetype_hash(ext) & mimetypes->mask; mimetypes->entries[slot].extension; slot = (slot + 1) & mimetypes->mask) {
+        if (strcasecmp(mimetypes->entries[slot].extension, ext) == 0)
+            return mimetypes->entries[slot].mimetype;
+    }
+
+    return DefaultMimeType;
 }
 
 /**
  * Determine actual filesystem path based on RootPath and URI.
  *
+ * @param   arena       Arena to allocate path from.
  * @param   uri         Resource path of URI.
+ * @param   mode        Where to store the file type and permissions of path.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
  *
  * This function uses realpath(3) to generate the realpath of the
  * file requested in the URI.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * As a security check, if the real path is not RootPath itself or inside it
+ * (RootPath followed by a '/'), then return NULL.
+ *
+ * Otherwise, return a string containing the real path allocated from arena.
+ * It is released when the arena is reset.
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Since realpath lstats every path component, results (including failures)
+ * are remembered in the PathCache for PATH_CACHE_TTL seconds.
  **/
-char * determine_request_path(const char *uri) {
-
-    char buffer [BUFSIZ];
-    char path [BUFSIZ];
-    
-    sprintf(buffer, "%s%s", RootPath, uri);
-
-    if( !realpath(buffer, path))
-        return NULL;
-    
-    if ( !strncmp(RootPath, path, strlen(RootPath)))
-        return strdup(path);
-    else
-        return NULL;
-
-    
-    return NULL;
+char * determine_request_path(Arena *arena, const char *uri, mode_t *mode) {
+    PathEntry *e    = &PathCache[path_hash(uri) & (PATH_CACHE_SLOTS - 1)];
+    time_t     now  = time(NULL);
+    char      *path = NULL;
+    char       buffer[PATH_MAX];
+    char       resolved[PATH_MAX];
+    struct stat st;
+
+    /* Use cached resolution if it is recent enough */
+    pthread_mutex_lock(&PathCacheLock);
+    if (e->uri && streq(e->uri, uri) && now - e->resolved < PATH_CACHE_TTL) {
+        path  = e->path ? arena_strdup(arena, e->path) : NULL;
+        *mode = e->mode;
+        pthread_mutex_unlock(&PathCacheLock);
+        return path;
+    }
+    pthread_mutex_unlock(&PathCacheLock);
+
+    /* Resolve path and check that it is within RootPath */
+    *mode = 0;
+    if (snprintf(buffer, sizeof(buffer), "%s%s", RootPath, uri) < (int)sizeof(buffer) &&
+        realpath(buffer, resolved) && path_within_root(resolved) &&
+        stat(resolved, &st) == 0) {
+        path  = resolved;
+        *mode = st.st_mode;
+    }
+
+    /* Remember resolution */
+    char *cached_uri  = strdup(uri);
+    char *cached_path = path ? strdup(path) : NULL;
+    if (cached_uri && (!path || cached_path)) {
+        pthread_mutex_lock(&PathCacheLock);
+        free(e->uri);
+        free(e->path);
+        e->uri      = cached_uri;
+        e->path     = cached_path;
+        e->mode     = *mode;
+        e->resolved = now;
+        pthread_mutex_unlock(&PathCacheLock);
+    } else {
+        free(cached_uri);
+        free(cached_path);
+    }
+
+    return path ? arena_strdup(arena, path) : NULL;
+}
+
+/**
+ * Forget every cached path resolution.
+ **/
+void path_cache_flush(void) {
+    pthread_mutex_lock(&PathCacheLock);
+    for (size_t i = 0; i < PATH_CACHE_SLOTS; i++) {
+        free(PathCache[i].uri);
+        free(PathCache[i].path);
+        PathCache[i] = (PathEntry){ NULL };
+    }
+    pthread_mutex_unlock(&PathCacheLock);
+}
+
+/**
+ * Determine if resolved path is RootPath or inside of it.
+ *
+ * @param   path        Resolved path.
+ * @return  Whether or not path may be served.
+ *
+ * A plain prefix comparison would also accept siblings such as "/srv/www2"
+ * for a RootPath of "/srv/www", so the prefix must end at a '/'.
+ **/
+bool path_within_root(const char *path) {
+    size_t length = strlen(RootPath);
+
+    if (strncmp(RootPath, path, length) != 0) {
+        return false;
+    }
+    return path[length] == '\0' || path[length] == '/' || (length > 0 && RootPath[length - 1] == '/');
+}
+
+/**
+ * Hash URI string.
+ *
+ * @param   uri         URI string.
+ * @return  FNV-1a hash of uri.
+ **/
+size_t path_hash(const char *uri) {
+    size_t hash = 2166136261u;
+
+    for (const char *c = uri; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
 /**
@@ -117,46 +333,37 @@ char * determine_request_path(const char *uri) {
  * http://en.wikipedia.org/wiki/List_of_HTTP_status_codes
  **/
 const char * http_status_string(Status status) {
-
-    
-    static char *StatusStrings[] = {
-        "200 OK",
-        "400 Bad Request",
-        "404 Not Found",
-        "500 Internal Server Error",
-        "418 I'm A Teapot",
+    static const char *StatusStrings[HTTP_STATUS_COUNT] = {
+        [HTTP_STATUS_OK]                    = "200 OK",
+        [HTTP_STATUS_BAD_REQUEST]           = "400 Bad Request",
+        [HTTP_STATUS_NOT_FOUND]             = "404 Not Found",
+        [HTTP_STATUS_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+        [HTTP_STATUS_PARTIAL_CONTENT]       = "206 Partial Content",
+        [HTTP_STATUS_NOT_MODIFIED]          = "304 Not Modified",
+        [HTTP_STATUS_RANGE_NOT_SATISFIABLE] = "416 Range Not Satisfiable",
+        [HTTP_STATUS_FORBIDDEN]             = "403 Forbidden",
+        [HTTP_STATUS_METHOD_NOT_ALLOWED]    = "405 Method Not Allowed",
+        [HTTP_STATUS_PAYLOAD_TOO_LARGE]     = "413 Payload Too Large",
+        [HTTP_STATUS_SERVICE_UNAVAILABLE]   = "503 Service Unavailable",
+        [HTTP_STATUS_REQUEST_TIMEOUT]       = "408 Request Timeout",
+        [HTTP_STATUS_URI_TOO_LONG]          = "414 URI Too Long",
+        [HTTP_STATUS_HEADER_FIELDS_TOO_LARGE] = "431 Request Header Fields Too Large",
+        [HTTP_STATUS_NOT_IMPLEMENTED]       = "501 Not Implemented",
     };
 
-    switch (status) {
-
-        case 0:
-            return StatusStrings[0];
-            break;
-        case 1:
-            return StatusStrings[1];
-            break;
-        case 2:
-            return StatusStrings[2];
-            break;
-        case 3:
-            return StatusStrings[3];
-            break;
-    }
-
-    return NULL;
+    return (unsigned)status < HTTP_STATUS_COUNT ? StatusStrings[status] : NULL;
 }
 
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
  * @param   s           String.
- * @return  Point to first whitespace character in s.
+ * @return  Point to first whitespace character in s (or its terminating NUL).
+ *
+ * strcspn and strspn are vectorized by the C library, unlike a byte loop.
  **/
 char * skip_nonwhitespace(char *s) {
-
-    while( *s != ' ' )
-        ++s;
-    return s;
+    return s + strcspn(s, " \r\t\n");
 }
 
 /**
@@ -166,10 +373,7 @@ char * skip_nonwhitespace(char *s) {
  * @return  Point to first non-whitespace character in s.
  **/
 char * skip_whitespace(char *s) {
-
-    while(*s == ' ' || *s == '\r' || *s == '\t' || *s == '\n')
-        s++;
-    return s;
+    return s + strspn(s, " \r\t\n");
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */